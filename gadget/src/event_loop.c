@@ -0,0 +1,306 @@
+/**
+ * @brief Single threaded epoll event loop
+ *
+ * ep0, the endpoint completions, /dev/tpm0, timers and signals are all
+ * dispatched from the one thread running event_loop_run().
+ *
+ * @file event_loop.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#include <stdint.h>
+#include <signal.h>
+
+#include "event_loop.h"
+
+enum {
+    EVENT_LOOP_FD = 0,
+    EVENT_LOOP_TIMER,
+    EVENT_LOOP_SIGNAL,
+};
+
+typedef struct {
+    int             fd;
+    int             type;
+    event_loop_cb_t cb;
+    void *          arg;
+} event_loop_slot_t;
+
+/**
+ * Static variables
+ */
+static int               g_event_loop_fd = -1;
+static int               g_event_loop_stop = 0;
+static event_loop_slot_t g_event_loop_slots[EVENT_LOOP_MAX_FDS];
+
+
+static event_loop_slot_t * event_loop_find(int fd)
+{
+    int i;
+
+    for (i = 0; i < EVENT_LOOP_MAX_FDS; i++)
+    {
+        if (g_event_loop_slots[i].fd == fd)
+        {
+            return &g_event_loop_slots[i];
+        }
+    }
+
+    return NULL;
+}
+
+static int event_loop_add_type(int fd, uint32_t events, int type,
+                               event_loop_cb_t cb, void * arg)
+{
+    struct epoll_event ev;
+    event_loop_slot_t *slot;
+
+    slot = event_loop_find(-1);
+    if (!slot)
+    {
+        printf("event_loop: no free slot for fd %d\r\n", fd);
+        return -ENOSPC;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = events;
+    ev.data.u32 = slot - g_event_loop_slots;
+
+    if (epoll_ctl(g_event_loop_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        return -errno;
+    }
+
+    slot->fd   = fd;
+    slot->type = type;
+    slot->cb   = cb;
+    slot->arg  = arg;
+
+    return 0;
+}
+
+/**
+ * Create the event loop
+ *
+ * @return 0 - success, <0 - error
+ */
+int event_loop_init(void)
+{
+    int i;
+
+    for (i = 0; i < EVENT_LOOP_MAX_FDS; i++)
+    {
+        g_event_loop_slots[i].fd = -1;
+    }
+
+    g_event_loop_stop = 0;
+    g_event_loop_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_event_loop_fd < 0)
+    {
+        perror("epoll_create1");
+        return -errno;
+    }
+
+    return 0;
+}
+
+/**
+ * Destroy the event loop, the fds added are not closed
+ */
+void event_loop_deinit(void)
+{
+    int i;
+
+    for (i = 0; i < EVENT_LOOP_MAX_FDS; i++)
+    {
+        if ((g_event_loop_slots[i].fd != -1) &&
+            (g_event_loop_slots[i].type != EVENT_LOOP_FD))
+        {
+            close(g_event_loop_slots[i].fd);
+        }
+        g_event_loop_slots[i].fd = -1;
+    }
+
+    if (g_event_loop_fd != -1)
+    {
+        close(g_event_loop_fd);
+        g_event_loop_fd = -1;
+    }
+}
+
+int event_loop_add(int fd, uint32_t events, event_loop_cb_t cb, void * arg)
+{
+    return event_loop_add_type(fd, events, EVENT_LOOP_FD, cb, arg);
+}
+
+void event_loop_del(int fd)
+{
+    event_loop_slot_t *slot;
+
+    slot = event_loop_find(fd);
+    if ((fd < 0) || !slot)
+    {
+        return;
+    }
+
+    epoll_ctl(g_event_loop_fd, EPOLL_CTL_DEL, fd, NULL);
+    slot->fd = -1;
+}
+
+int event_loop_timer_add(int ms, int periodic, event_loop_cb_t cb, void * arg)
+{
+    struct itimerspec its;
+    int fd, ret;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("timerfd_create");
+        return -errno;
+    }
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec  = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    if (periodic)
+    {
+        its.it_interval = its.it_value;
+    }
+
+    if (timerfd_settime(fd, 0, &its, NULL) < 0)
+    {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+
+    ret = event_loop_add_type(fd, EPOLLIN, EVENT_LOOP_TIMER, cb, arg);
+    if (ret < 0)
+    {
+        close(fd);
+        return ret;
+    }
+
+    return fd;
+}
+
+void event_loop_timer_del(int fd)
+{
+    if (fd < 0)
+    {
+        return;
+    }
+
+    event_loop_del(fd);
+    close(fd);
+}
+
+int event_loop_signal_add(const sigset_t * mask, event_loop_cb_t cb, void * arg)
+{
+    int fd, ret;
+
+    if (sigprocmask(SIG_BLOCK, mask, NULL) < 0)
+    {
+        return -errno;
+    }
+
+    fd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("signalfd");
+        return -errno;
+    }
+
+    ret = event_loop_add_type(fd, EPOLLIN, EVENT_LOOP_SIGNAL, cb, arg);
+    if (ret < 0)
+    {
+        close(fd);
+    }
+
+    return ret;
+}
+
+static void event_loop_dispatch(event_loop_slot_t *slot, uint32_t events)
+{
+    struct signalfd_siginfo si;
+    uint64_t expirations;
+
+    switch (slot->type)
+    {
+    case EVENT_LOOP_TIMER:
+        if (read(slot->fd, &expirations, sizeof(expirations)) !=
+            sizeof(expirations))
+        {
+            return;
+        }
+        slot->cb(slot->fd, events, slot->arg);
+        break;
+
+    case EVENT_LOOP_SIGNAL:
+        while (read(slot->fd, &si, sizeof(si)) == sizeof(si))
+        {
+            slot->cb(slot->fd, si.ssi_signo, slot->arg);
+        }
+        break;
+
+    default:
+        slot->cb(slot->fd, events, slot->arg);
+        break;
+    }
+}
+
+/**
+ * Dispatch events until event_loop_stop()
+ *
+ * @return 0 - stopped, <0 - error
+ */
+int event_loop_run(void)
+{
+    struct epoll_event events[EVENT_LOOP_MAX_FDS];
+    event_loop_slot_t *slot;
+    int i, n;
+
+    g_event_loop_stop = 0;
+
+    while (!g_event_loop_stop)
+    {
+        n = epoll_wait(g_event_loop_fd, events, EVENT_LOOP_MAX_FDS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait");
+            return -errno;
+        }
+
+        for (i = 0; (i < n) && !g_event_loop_stop; i++)
+        {
+            slot = &g_event_loop_slots[events[i].data.u32];
+
+            /* Removed by an earlier callback of this round */
+            if (slot->fd == -1)
+            {
+                continue;
+            }
+
+            event_loop_dispatch(slot, events[i].events);
+        }
+    }
+
+    return 0;
+}
+
+void event_loop_stop(void)
+{
+    g_event_loop_stop = 1;
+}
@@ -0,0 +1,108 @@
+/**
+ * @brief Single threaded epoll event loop
+ *
+ * @file event_loop.h
+ */
+
+#ifndef EVENT_LOOP_H_
+#define EVENT_LOOP_H_
+
+#include <stdint.h>
+#include <signal.h>
+#include <sys/epoll.h>
+
+#define EVENT_LOOP_MAX_FDS          (16)
+
+/**
+ * Event callback
+ *
+ * @param fd     - File descriptor the events are for
+ *
+ * @param events - EPOLL* events, the signal number for signals
+ *
+ * @param arg    - Argument given when the fd was added
+ */
+typedef void (*event_loop_cb_t)(int fd, uint32_t events, void * arg);
+
+/**
+ * Create the event loop
+ *
+ * @return 0 - success, <0 - error
+ */
+int  event_loop_init(void);
+
+/**
+ * Destroy the event loop, the fds added are not closed
+ */
+void event_loop_deinit(void);
+
+/**
+ * Watch a file descriptor
+ *
+ * @param fd     - File descriptor, it must support poll
+ *
+ * @param events - EPOLL* events to watch, level triggered
+ *
+ * @param cb     - Callback for the events
+ *
+ * @param arg    - Argument to the callback
+ *
+ * @return 0 - success, <0 - error
+ */
+int  event_loop_add(int fd, uint32_t events, event_loop_cb_t cb, void * arg);
+
+/**
+ * Stop watching a file descriptor, it is not closed
+ *
+ * @param fd     - File descriptor
+ */
+void event_loop_del(int fd);
+
+/**
+ * Start a timer
+ *
+ * @param ms       - Expiry in msecs
+ *
+ * @param periodic - 1 to fire every ms msecs, 0 to fire once
+ *
+ * @param cb       - Callback on expiry
+ *
+ * @param arg      - Argument to the callback
+ *
+ * @return timer fd, <0 - error
+ */
+int  event_loop_timer_add(int ms, int periodic, event_loop_cb_t cb, void * arg);
+
+/**
+ * Stop and close a timer
+ *
+ * @param fd       - Timer fd
+ */
+void event_loop_timer_del(int fd);
+
+/**
+ * Receive signals through the event loop instead of signal handlers
+ *
+ * @param mask     - Signals to block and receive
+ *
+ * @param cb       - Callback, with the signal number for events
+ *
+ * @param arg      - Argument to the callback
+ *
+ * @return 0 - success, <0 - error
+ */
+int  event_loop_signal_add(const sigset_t * mask, event_loop_cb_t cb, void * arg);
+
+/**
+ * Dispatch events until event_loop_stop()
+ *
+ * @return 0 - stopped, <0 - error
+ */
+int  event_loop_run(void);
+
+/**
+ * Make event_loop_run() return once the current callback is done
+ */
+void event_loop_stop(void);
+
+#endif /* EVENT_LOOP_H_ */
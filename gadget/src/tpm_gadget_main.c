@@ -8,7 +8,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <pthread.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -27,21 +26,34 @@
 
 #include "usbg_service.h"
 #include "tpm_proxy.h"
+#include "event_loop.h"
+#include "tpm_log.h"
 
-static int g_end_app = 0;
-
-/* Signal Handler for SIGINT */
-void sigintHandler(int sig_num)
+/* SIGINT and SIGTERM, received through the event loop */
+static void signal_event(int fd, uint32_t signo, void *arg)
 {
-    g_end_app = 1;
+    printf("XAPRD TPM proxy service : signal %u\n", signo);
+    event_loop_stop();
 }
 
 int main()
 {
+    sigset_t mask;
+
     printf("XAPRD TPM proxy service\n");
 
-    g_end_app = 0;
-    signal(SIGINT, sigintHandler);
+    if (event_loop_init() < 0)
+    {
+        return 1;
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    event_loop_signal_add(&mask, signal_event, NULL);
+
+    /* Per command logging goes to the ring, not the console */
+    tpm_log_init();
 
     printf("XAPRD TPM proxy service : Started\n");
 
@@ -54,10 +66,8 @@ int main()
     /* TPM proxy function initialization */
     tpm_proxy_init();
 
-    while (!g_end_app)
-    {
-        usleep(100000);
-    }
+    /* ep0, the endpoints, the TPM and the timers all run from here */
+    event_loop_run();
 
     /* TPM proxy function deinitialization */
     tpm_proxy_deinit();
@@ -69,5 +79,9 @@ int main()
 
     system("umount /root/usbg");
 
+    tpm_log_deinit();
+
+    event_loop_deinit();
+
     return 0;
 }
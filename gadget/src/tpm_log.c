@@ -0,0 +1,299 @@
+/**
+ * @brief Binary log ring
+ *
+ * Any thread may log, the drain thread is the only reader. A writer
+ * reserves a slot by moving the head, fills it and publishes it by
+ * storing its sequence number. When the ring is full the record is
+ * dropped and counted, logging never waits.
+ *
+ * @file tpm_log.c
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <sys/eventfd.h>
+
+#include <stdint.h>
+
+#include "tpm_log.h"
+
+#define TPM_LOG_MSG_FMT(_id_, _fmt_)    _fmt_,
+
+static const char *g_tpm_log_fmt[TPM_MSG_MAX] = {
+    TPM_LOG_MSGS(TPM_LOG_MSG_FMT)
+};
+
+static const int g_tpm_log_prio[] = {
+    LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG
+};
+
+int g_tpm_log_level = TPM_LOG_INFO;
+
+/**
+ * Static variables
+ */
+static tpm_log_rec_t g_tpm_log_ring[TPM_LOG_RING_SZ];
+static uint32_t      g_tpm_log_head  = 0;
+static uint32_t      g_tpm_log_tail  = 0;
+static uint32_t      g_tpm_log_drops = 0;
+
+static int           g_tpm_log_efd   = -1;
+static int           g_tpm_log_stop  = 0;
+static FILE *        g_tpm_log_file  = NULL;
+static pthread_t     g_tpm_log_thread;
+
+
+void tpm_log_set_level(int level)
+{
+    if (level < TPM_LOG_ERR)
+    {
+        level = TPM_LOG_ERR;
+    }
+    if (level > TPM_LOG_DEBUG)
+    {
+        level = TPM_LOG_DEBUG;
+    }
+
+    __atomic_store_n(&g_tpm_log_level, level, __ATOMIC_RELAXED);
+}
+
+void tpm_log_write(int level, int id, int nargs, ...)
+{
+    tpm_log_rec_t  *rec;
+    struct timespec ts;
+    uint32_t        head, tail;
+    uint64_t        one = 1;
+    va_list         ap;
+    int             i;
+
+    head = __atomic_load_n(&g_tpm_log_head, __ATOMIC_RELAXED);
+    do
+    {
+        tail = __atomic_load_n(&g_tpm_log_tail, __ATOMIC_ACQUIRE);
+        if (head - tail >= TPM_LOG_RING_SZ)
+        {
+            __atomic_fetch_add(&g_tpm_log_drops, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&g_tpm_log_head, &head, head + 1,
+                1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    rec = &g_tpm_log_ring[head & (TPM_LOG_RING_SZ - 1)];
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec->ts_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    rec->id    = id;
+    rec->level = level;
+    rec->nargs = (nargs > TPM_LOG_MAX_ARGS) ? TPM_LOG_MAX_ARGS : nargs;
+
+    memset(rec->args, 0, sizeof(rec->args));
+    va_start(ap, nargs);
+    for (i = 0; i < rec->nargs; i++)
+    {
+        rec->args[i] = va_arg(ap, int);
+    }
+    va_end(ap);
+
+    __atomic_store_n(&rec->seq, head + 1, __ATOMIC_RELEASE);
+
+    /* Do not keep errors waiting for the next drain period */
+    if ((level <= TPM_LOG_PERSIST_LEVEL) && (g_tpm_log_efd != -1))
+    {
+        if (write(g_tpm_log_efd, &one, sizeof(one)) < 0)
+        {
+            /* Drained on the next period anyway */
+        }
+    }
+}
+
+/**
+ * Take the oldest published record off the ring
+ *
+ * @return 1 - got one, 0 - ring empty
+ */
+static int tpm_log_pop(tpm_log_rec_t *out)
+{
+    tpm_log_rec_t *rec;
+    uint32_t       tail;
+
+    tail = __atomic_load_n(&g_tpm_log_tail, __ATOMIC_RELAXED);
+    rec  = &g_tpm_log_ring[tail & (TPM_LOG_RING_SZ - 1)];
+
+    if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != tail + 1)
+    {
+        return 0;
+    }
+
+    memcpy(out, rec, sizeof(*out));
+    __atomic_store_n(&g_tpm_log_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+static void tpm_log_emit(const tpm_log_rec_t *rec)
+{
+    if ((rec->level <= TPM_LOG_PERSIST_LEVEL) && (rec->id < TPM_MSG_MAX))
+    {
+        syslog(g_tpm_log_prio[rec->level], g_tpm_log_fmt[rec->id],
+                rec->args[0], rec->args[1], rec->args[2], rec->args[3]);
+    }
+
+    if (g_tpm_log_file)
+    {
+        fwrite(rec, sizeof(*rec), 1, g_tpm_log_file);
+    }
+}
+
+static void tpm_log_drain(void)
+{
+    tpm_log_rec_t   rec;
+    struct timespec ts;
+    uint32_t        drops;
+
+    while (tpm_log_pop(&rec))
+    {
+        tpm_log_emit(&rec);
+    }
+
+    drops = __atomic_exchange_n(&g_tpm_log_drops, 0, __ATOMIC_RELAXED);
+    if (drops)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        memset(&rec, 0, sizeof(rec));
+        rec.ts_ns   = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        rec.level   = TPM_LOG_WARN;
+        rec.id      = TPM_MSG_LOG_DROPPED;
+        rec.nargs   = 1;
+        rec.args[0] = drops;
+        tpm_log_emit(&rec);
+    }
+
+    if (g_tpm_log_file)
+    {
+        fflush(g_tpm_log_file);
+    }
+}
+
+static void *tpm_log_thread(void *arg)
+{
+    struct sched_param param;
+    struct pollfd      pfd;
+    uint64_t           count;
+
+    /* Only runs when nothing else wants the CPU */
+    memset(&param, 0, sizeof(param));
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    pfd.fd     = g_tpm_log_efd;
+    pfd.events = POLLIN;
+
+    while (!__atomic_load_n(&g_tpm_log_stop, __ATOMIC_ACQUIRE))
+    {
+        if ((poll(&pfd, 1, TPM_LOG_DRAIN_MS) > 0) &&
+            (read(g_tpm_log_efd, &count, sizeof(count)) < 0))
+        {
+            /* Another wakeup raced this one */
+        }
+
+        tpm_log_drain();
+    }
+
+    tpm_log_drain();
+
+    return NULL;
+}
+
+/**
+ * Start the drain thread
+ *
+ * @return 0 - success, <0 - error
+ */
+int tpm_log_init(void)
+{
+    tpm_log_file_hdr_t hdr;
+    const char        *env;
+
+    env = getenv("TPM_LOG_LEVEL");
+    if (env)
+    {
+        tpm_log_set_level(atoi(env));
+    }
+
+    openlog("tpm_gadget", LOG_PID, LOG_DAEMON);
+
+    env = getenv("TPM_LOG_FILE");
+    if (env)
+    {
+        g_tpm_log_file = fopen(env, "ab");
+        if (!g_tpm_log_file)
+        {
+            perror(env);
+        }
+        else if (ftell(g_tpm_log_file) == 0)
+        {
+            hdr.magic    = TPM_LOG_MAGIC;
+            hdr.version  = TPM_LOG_VERSION;
+            hdr.rec_size = sizeof(tpm_log_rec_t);
+            fwrite(&hdr, sizeof(hdr), 1, g_tpm_log_file);
+        }
+    }
+
+    g_tpm_log_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (g_tpm_log_efd < 0)
+    {
+        perror("eventfd");
+        return -errno;
+    }
+
+    g_tpm_log_stop = 0;
+    if (pthread_create(&g_tpm_log_thread, NULL, &tpm_log_thread, NULL) != 0)
+    {
+        printf("log drain thread problem\n");
+        close(g_tpm_log_efd);
+        g_tpm_log_efd = -1;
+        return -EAGAIN;
+    }
+
+    return 0;
+}
+
+/**
+ * Drain what is left and stop the drain thread
+ */
+void tpm_log_deinit(void)
+{
+    uint64_t one = 1;
+
+    if (g_tpm_log_efd != -1)
+    {
+        __atomic_store_n(&g_tpm_log_stop, 1, __ATOMIC_RELEASE);
+        if (write(g_tpm_log_efd, &one, sizeof(one)) < 0)
+        {
+            /* The thread wakes up on its period */
+        }
+
+        pthread_join(g_tpm_log_thread, NULL);
+
+        close(g_tpm_log_efd);
+        g_tpm_log_efd = -1;
+    }
+
+    if (g_tpm_log_file)
+    {
+        fclose(g_tpm_log_file);
+        g_tpm_log_file = NULL;
+    }
+
+    closelog();
+}
@@ -0,0 +1,114 @@
+/**
+ * @brief Binary log ring
+ *
+ * Records are a message id plus int arguments, written to an in-memory
+ * ring without locks or system calls. A low priority thread drains the
+ * ring: errors and warnings go to syslog (the journal), every record to
+ * TPM_LOG_FILE when set, for tpm_log_decode.
+ *
+ * @file tpm_log.h
+ */
+
+#ifndef TPM_LOG_H_
+#define TPM_LOG_H_
+
+#include <stdint.h>
+
+#include "tpm_log_msgs.h"
+
+#define TPM_LOG_ERR                 (0)
+#define TPM_LOG_WARN                (1)
+#define TPM_LOG_INFO                (2)
+#define TPM_LOG_DEBUG               (3)
+
+/* Records above this level are compiled out */
+#ifndef TPM_LOG_LEVEL_MAX
+#define TPM_LOG_LEVEL_MAX           TPM_LOG_DEBUG
+#endif
+
+/* Records up to this level are sent to syslog */
+#define TPM_LOG_PERSIST_LEVEL       TPM_LOG_WARN
+
+#define TPM_LOG_RING_SZ             (1024)
+#define TPM_LOG_MAX_ARGS            (4)
+#define TPM_LOG_DRAIN_MS            (1000)
+
+/* File format: tpm_log_file_hdr_t, then tpm_log_rec_t in the card byte order */
+#define TPM_LOG_MAGIC               (0x4c4d5054)   /* "TPML" */
+#define TPM_LOG_VERSION             (1)
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t rec_size;
+} tpm_log_file_hdr_t;
+
+typedef struct {
+    uint64_t ts_ns;                     /* CLOCK_MONOTONIC */
+    uint32_t seq;                       /* Record number + 1 */
+    uint16_t id;                        /* TPM_MSG_* */
+    uint8_t  level;
+    uint8_t  nargs;
+    int32_t  args[TPM_LOG_MAX_ARGS];
+} tpm_log_rec_t;
+
+/* Runtime level, records above it are skipped */
+extern int g_tpm_log_level;
+
+#define TPM_LOG_NARGS_(_0, _1, _2, _3, _4, _n_, ...)  _n_
+#define TPM_LOG_NARGS(...)                                              \
+    TPM_LOG_NARGS_(0, ##__VA_ARGS__, 4, 3, 2, 1, 0)
+
+/**
+ * Log a record
+ *
+ * @param _level_ - TPM_LOG_*
+ *
+ * @param _id_    - TPM_MSG_*
+ *
+ * @param ...     - Up to TPM_LOG_MAX_ARGS int arguments of the message
+ */
+#define tpm_log(_level_, _id_, ...)                                     \
+    do {                                                                \
+        if (((_level_) <= TPM_LOG_LEVEL_MAX) &&                         \
+            ((_level_) <= g_tpm_log_level))                             \
+        {                                                               \
+            tpm_log_write((_level_), (_id_),                            \
+                    TPM_LOG_NARGS(__VA_ARGS__), ##__VA_ARGS__);         \
+        }                                                               \
+    } while (0)
+
+/**
+ * Start the drain thread
+ *
+ * TPM_LOG_LEVEL in the environment sets the runtime level, TPM_LOG_FILE
+ * a file to append every record to.
+ *
+ * @return 0 - success, <0 - error
+ */
+int  tpm_log_init(void);
+
+/**
+ * Drain what is left and stop the drain thread
+ */
+void tpm_log_deinit(void);
+
+/**
+ * Change the runtime level
+ *
+ * @param level - TPM_LOG_*
+ */
+void tpm_log_set_level(int level);
+
+/**
+ * Write a record to the ring, use tpm_log()
+ *
+ * @param level - TPM_LOG_*
+ *
+ * @param id    - TPM_MSG_*
+ *
+ * @param nargs - Number of int arguments following
+ */
+void tpm_log_write(int level, int id, int nargs, ...);
+
+#endif /* TPM_LOG_H_ */
@@ -0,0 +1,95 @@
+/**
+ * @brief Decoder of the binary log written to TPM_LOG_FILE
+ *
+ * Usage: tpm_log_decode [file], reads stdin without a file.
+ *
+ * @file tpm_log_decode.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <stdint.h>
+
+#include "tpm_log.h"
+
+#define TPM_LOG_MSG_FMT(_id_, _fmt_)    _fmt_,
+
+static const char *g_tpm_log_fmt[TPM_MSG_MAX] = {
+    TPM_LOG_MSGS(TPM_LOG_MSG_FMT)
+};
+
+static const char g_tpm_log_lvl[] = { 'E', 'W', 'I', 'D' };
+
+
+int main(int argc, char *argv[])
+{
+    tpm_log_file_hdr_t hdr;
+    tpm_log_rec_t      rec;
+    FILE              *fp = stdin;
+    uint32_t           next = 0;
+
+    if (argc > 2)
+    {
+        fprintf(stderr, "usage: %s [file]\n", argv[0]);
+        return 2;
+    }
+
+    if ((argc == 2) && !(fp = fopen(argv[1], "rb")))
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    if ((fread(&hdr, sizeof(hdr), 1, fp) != 1) ||
+        (hdr.magic != TPM_LOG_MAGIC))
+    {
+        fprintf(stderr, "not a tpm_gadget log\n");
+        return 1;
+    }
+
+    if ((hdr.version != TPM_LOG_VERSION) || (hdr.rec_size != sizeof(rec)))
+    {
+        fprintf(stderr, "unsupported log version %u, record size %u\n",
+                hdr.version, hdr.rec_size);
+        return 1;
+    }
+
+    while (fread(&rec, sizeof(rec), 1, fp) == 1)
+    {
+        /* The ring was full and the gadget counted drops, or it restarted */
+        if (rec.seq && next && (rec.seq != next))
+        {
+            printf("--- sequence %u -> %u\n", next, rec.seq);
+        }
+        if (rec.seq)
+        {
+            next = rec.seq + 1;
+        }
+
+        printf("[%6llu.%06llu] %c ",
+                (unsigned long long)(rec.ts_ns / 1000000000ULL),
+                (unsigned long long)(rec.ts_ns % 1000000000ULL) / 1000,
+                (rec.level <= TPM_LOG_DEBUG) ? g_tpm_log_lvl[rec.level] : '?');
+
+        if (rec.id < TPM_MSG_MAX)
+        {
+            printf(g_tpm_log_fmt[rec.id],
+                    rec.args[0], rec.args[1], rec.args[2], rec.args[3]);
+        }
+        else
+        {
+            printf("unknown message %u (%d %d %d %d)", rec.id,
+                    rec.args[0], rec.args[1], rec.args[2], rec.args[3]);
+        }
+        printf("\n");
+    }
+
+    if (fp != stdin)
+    {
+        fclose(fp);
+    }
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+/**
+ * @brief Messages of the binary log
+ *
+ * Shared with tpm_log_decode, a record only stores the message id and its
+ * arguments. Append new messages at the end so older logs still decode,
+ * and only use int conversions (%d, %u, %x) with up to TPM_LOG_MAX_ARGS.
+ *
+ * @file tpm_log_msgs.h
+ */
+
+#ifndef TPM_LOG_MSGS_H_
+#define TPM_LOG_MSGS_H_
+
+#define TPM_LOG_MSGS(X)                                                     \
+    X(TPM_MSG_USB_RX,          "read usb %d")                               \
+    X(TPM_MSG_USB_RX_ERR,      "Read USB fd error %d.")                     \
+    X(TPM_MSG_USB_SUBMIT_ERR,  "USB read queue error %d.")                  \
+    X(TPM_MSG_USB_TX,          "write to usb %d")                           \
+    X(TPM_MSG_USB_TX_ERR,      "write to usb %d failed, %d")                \
+    X(TPM_MSG_USB_ZLP,         "write ZLP")                                 \
+    X(TPM_MSG_TPM_RX,          "read tpm %d")                               \
+    X(TPM_MSG_TPM_RX_ERR,      "Read TPM fd <= 0.")                         \
+    X(TPM_MSG_TPM_TX_ERR,      "write to tpm %d failed")                    \
+    X(TPM_MSG_TPM_STRAY,       "TPM response %d without command")           \
+    X(TPM_MSG_TPM_CANCEL,      "cancel TPM command")                        \
+    X(TPM_MSG_TPM_DROP,        "drop canceled response %d")                 \
+    X(TPM_MSG_HELLO,           "framing HELLO, features 0x%x")              \
+    X(TPM_MSG_FRAME_UNKNOWN,   "Unknown frame type %u.")                    \
+    X(TPM_MSG_BATCH,           "batch of %d commands, %d bytes")            \
+    X(TPM_MSG_BATCH_CANCEL,    "batch canceled after %d commands")          \
+    X(TPM_MSG_BATCH_MALFORMED, "Malformed batch record.")                   \
+    X(TPM_MSG_USB_STATE,       "USB configured %d")                         \
+    X(TPM_MSG_LOG_DROPPED,     "%u log records dropped")                    \
+    X(TPM_MSG_USB_SKIP,        "drop %d bytes past a long message")         \
+    X(TPM_MSG_CMD_BAD_SIZE,    "Command of %u bytes, got %u, limit %u.")    \
+    X(TPM_MSG_TPM_MAX_CMD,     "TPM takes commands up to %u bytes")         \
+    X(TPM_MSG_TPM_CANCEL_ERR,  "TPM cancel not offered, errno %d")
+
+#define TPM_LOG_MSG_ENUM(_id_, _fmt_)   _id_,
+
+enum {
+    TPM_LOG_MSGS(TPM_LOG_MSG_ENUM)
+    TPM_MSG_MAX
+};
+
+#endif /* TPM_LOG_MSGS_H_ */
@@ -0,0 +1,213 @@
+/**
+ * @brief Framing of the transfers between the host driver and the gadget
+ *
+ * Encoding and decoding only, no I/O, so the codecs build and run on
+ * the development host as well.
+ *
+ * @file tpm_proto.c
+ */
+
+#include <string.h>
+#include <endian.h>
+
+#include <stdint.h>
+
+#include "tpm_proto.h"
+#include "tpm_proxy.h"
+
+
+uint32_t tpm_get_be32(const uint8_t *buf)
+{
+    return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+           ((uint32_t)buf[2] << 8) | buf[3];
+}
+
+void tpm_put_be32(uint8_t *buf, uint32_t val)
+{
+    buf[0] = val >> 24;
+    buf[1] = val >> 16;
+    buf[2] = val >> 8;
+    buf[3] = val;
+}
+
+/**
+ * Check whether a transfer from the host is framed
+ *
+ * @param buf   Received transfer
+ * @param len   Length of the transfer
+ * @param frame Filled with the frame header in host byte order
+ *
+ * @return 1 - framed, 0 - raw TPM command
+ */
+int tpm_proto_get_frame(const uint8_t *buf, int len, tpm_proto_frame_t *frame)
+{
+    if (len < (int)TPM_PROTO_FRAME_SZ)
+    {
+        return 0;
+    }
+
+    memcpy(frame, buf, TPM_PROTO_FRAME_SZ);
+    frame->magic = le32toh(frame->magic);
+    frame->type  = le16toh(frame->type);
+    frame->flags = le16toh(frame->flags);
+    frame->seq   = le32toh(frame->seq);
+    frame->len   = le32toh(frame->len);
+
+    return frame->magic == TPM_PROTO_MAGIC;
+}
+
+/**
+ * Write a frame header
+ *
+ * @param buf   At least TPM_PROTO_FRAME_SZ bytes, the payload follows
+ * @param type  TPM_PROTO_* frame type
+ * @param flags Frame flags
+ * @param seq   Sequence number
+ * @param len   Length of the payload
+ */
+void tpm_proto_put_frame(uint8_t *buf, uint16_t type, uint16_t flags,
+                         uint32_t seq, uint32_t len)
+{
+    tpm_proto_frame_t frame;
+
+    frame.magic = htole32(TPM_PROTO_MAGIC);
+    frame.type  = htole16(type);
+    frame.flags = htole16(flags);
+    frame.seq   = htole32(seq);
+    frame.len   = htole32(len);
+    memcpy(buf, &frame, TPM_PROTO_FRAME_SZ);
+}
+
+/**
+ * Length of the message a transfer starts, as its header says
+ *
+ * @param buf   Received transfer
+ * @param len   Length of the transfer
+ *
+ * @return message length, len - no header to go by
+ */
+uint32_t tpm_proto_msg_len(const uint8_t *buf, int len)
+{
+    tpm_proto_frame_t frame;
+
+    if (tpm_proto_get_frame(buf, len, &frame))
+    {
+        if (frame.len > UINT32_MAX - TPM_PROTO_FRAME_SZ)
+        {
+            return UINT32_MAX;
+        }
+        return TPM_PROTO_FRAME_SZ + frame.len;
+    }
+
+    if (len < TPM_HEADER_SZ)
+    {
+        return len;
+    }
+
+    return tpm_get_be32(&buf[2]);
+}
+
+/**
+ * Check the size in the header of a TPM command
+ *
+ * A transfer ending on a short packet ends the message, so the command
+ * has to be all there. Bytes after it are dropped.
+ *
+ * @param cmd   TPM command
+ * @param len   Bytes received
+ * @param max   Longest command the TPM takes
+ *
+ * @return length of the command, 0 - malformed, cut short or above max
+ */
+uint32_t tpm_proto_cmd_size(const uint8_t *cmd, int len, uint32_t max)
+{
+    uint32_t size;
+
+    if (len < TPM_HEADER_SZ)
+    {
+        return 0;
+    }
+
+    size = tpm_get_be32(&cmd[2]);
+    if ((size < TPM_HEADER_SZ) || (size > (uint32_t)len) || (size > max))
+    {
+        return 0;
+    }
+
+    return size;
+}
+
+/**
+ * Take the next record off the payload of a BATCH_CMD frame
+ *
+ * @param buf       Records
+ * @param len       Length of the records
+ * @param off       Offset of the record, moved past it and its padding
+ * @param data      Set to the offset of the command in buf
+ * @param data_len  Set to the length of the command
+ *
+ * @return 1 - got one, 0 - no records left, -1 - malformed record
+ */
+int tpm_proto_get_rec(const uint8_t *buf, int len, int *off,
+                      int *data, uint32_t *data_len)
+{
+    tpm_proto_rec_t rec;
+
+    if ((*off < 0) || (*off + (int)TPM_PROTO_REC_SZ > len))
+    {
+        return 0;
+    }
+
+    memcpy(&rec, &buf[*off], TPM_PROTO_REC_SZ);
+    rec.len = le32toh(rec.len);
+
+    if (rec.len > (uint32_t)(len - *off - (int)TPM_PROTO_REC_SZ))
+    {
+        return -1;
+    }
+
+    *data     = *off + TPM_PROTO_REC_SZ;
+    *data_len = rec.len;
+
+    /* The padding of the last record may be left out */
+    *off = *data + TPM_PROTO_REC_PAD(rec.len);
+
+    return 1;
+}
+
+/**
+ * Add a record to the payload of a BATCH_RSP frame
+ *
+ * @param buf       Records
+ * @param cap       Size of buf
+ * @param off       Offset of the record
+ * @param status    TPM_PROTO_REC_*
+ * @param data      Response, may be NULL if len is 0
+ * @param len       Length of the response
+ *
+ * @return offset past the record and its padding, -1 - no room for it
+ */
+int tpm_proto_put_rec(uint8_t *buf, int cap, int off, uint32_t status,
+                      const uint8_t *data, uint32_t len)
+{
+    tpm_proto_rec_t rec;
+
+    if ((off < 0) || (len > (uint32_t)cap) ||
+        (off + (int)TPM_PROTO_REC_SZ + (int)TPM_PROTO_REC_PAD(len) > cap))
+    {
+        return -1;
+    }
+
+    rec.len    = htole32(len);
+    rec.status = htole32(status);
+    memcpy(&buf[off], &rec, TPM_PROTO_REC_SZ);
+    off += TPM_PROTO_REC_SZ;
+
+    if (len)
+    {
+        memcpy(&buf[off], data, len);
+    }
+    memset(&buf[off + len], 0, TPM_PROTO_REC_PAD(len) - len);
+
+    return off + TPM_PROTO_REC_PAD(len);
+}
@@ -0,0 +1,120 @@
+/**
+ * @brief Framing of the transfers between the host driver and the gadget
+ *
+ * Keep in sync with host/tpmproxy-proto.h.
+ *
+ * @file tpm_proto.h
+ */
+
+#ifndef TPM_PROTO_H_
+#define TPM_PROTO_H_
+
+#include <stdint.h>
+
+/**
+ * With framing, every transfer starts with a tpm_proto_frame_t whose magic
+ * reads "TPMF". No TPM command starts with it, so framed and raw transfers
+ * are told apart by their first bytes. The host offers framing with a HELLO
+ * frame, commands come in CMD frames and their responses go back in RSP
+ * frames echoing the sequence number. All fields are little endian.
+ *
+ * BATCH_CMD frames hold a run of records, each a tpm_proto_rec_t followed by
+ * a command and padded to TPM_PROTO_REC_ALIGN. The commands are run in order
+ * and answered by one BATCH_RSP frame holding a record per command run, each
+ * followed by its response.
+ */
+#define TPM_PROTO_MAGIC             (0x464d5054)
+
+#define TPM_PROTO_HELLO             (0x0000)
+#define TPM_PROTO_CMD               (0x0001)
+#define TPM_PROTO_RSP               (0x0002)
+#define TPM_PROTO_BATCH_CMD         (0x0003)
+#define TPM_PROTO_BATCH_RSP         (0x0004)
+
+#define TPM_PROTO_FEAT_FRAMING      (1 << 0)
+#define TPM_PROTO_FEAT_BATCH        (1 << 1)
+#define TPM_PROTO_FEAT_CANCEL       (1 << 2)
+
+/** BATCH_CMD flag: skip the commands after one that failed */
+#define TPM_PROTO_STOP_ON_ERROR     (1 << 0)
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t type;
+    uint16_t flags;
+    uint32_t seq;
+    uint32_t len;
+} tpm_proto_frame_t;
+
+#define TPM_PROTO_FRAME_SZ          (sizeof(tpm_proto_frame_t))
+
+#define TPM_PROTO_REC_OK            (0)
+#define TPM_PROTO_REC_FAILED        (1)
+#define TPM_PROTO_REC_TRUNCATED     (2)
+
+typedef struct __attribute__((packed)) {
+    uint32_t len;
+    uint32_t status;
+} tpm_proto_rec_t;
+
+#define TPM_PROTO_REC_SZ            (sizeof(tpm_proto_rec_t))
+#define TPM_PROTO_REC_ALIGN         (4)
+#define TPM_PROTO_REC_PAD(_len_)    \
+    (((_len_) + TPM_PROTO_REC_ALIGN - 1) & ~(TPM_PROTO_REC_ALIGN - 1))
+
+/**
+ * Vendor control requests on ep0, bmRequestType USB_TYPE_VENDOR |
+ * USB_RECIP_DEVICE. The event loop answers them while a TPM command is in
+ * flight, it only waits for the TPM on kernels whose /dev/tpm0 cannot be
+ * polled and without io_uring.
+ */
+#define TPM_PROTO_VERSION           (1)
+
+#define TPM_PROTO_REQ_PING          (0x01)  /**< OUT, no data stage */
+#define TPM_PROTO_REQ_CAPS          (0x02)  /**< IN, tpm_proto_caps_t */
+#define TPM_PROTO_REQ_STATS         (0x03)  /**< IN, tpm_proto_stats_t */
+#define TPM_PROTO_REQ_CANCEL        (0x04)  /**< OUT, no data stage */
+
+#define TPM_PROTO_FAMILY_UNKNOWN    (0)
+#define TPM_PROTO_FAMILY_TPM12      (1)
+#define TPM_PROTO_FAMILY_TPM20      (2)
+
+typedef struct __attribute__((packed)) {
+    uint16_t version;       /**< TPM_PROTO_VERSION */
+    uint16_t features;      /**< TPM_PROTO_FEAT_* */
+    uint32_t max_cmd;       /**< longest command the TPM takes */
+    uint8_t  tpm_family;    /**< TPM_PROTO_FAMILY_* */
+    uint8_t  reserved[7];
+} tpm_proto_caps_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t commands;      /**< commands sent to the TPM */
+    uint32_t batches;       /**< BATCH_CMD frames run */
+    uint32_t tpm_errors;    /**< commands the TPM could not run */
+    uint32_t usb_errors;    /**< failed USB reads and writes */
+} tpm_proto_stats_t;
+
+/** Features this gadget offers in its HELLO */
+#define TPM_PROTO_FEATURES          (TPM_PROTO_FEAT_FRAMING | \
+                                     TPM_PROTO_FEAT_BATCH |   \
+                                     TPM_PROTO_FEAT_CANCEL)
+
+/*
+ * Codecs, tpm_proto.c
+ */
+uint32_t tpm_get_be32(const uint8_t *buf);
+void     tpm_put_be32(uint8_t *buf, uint32_t val);
+
+int  tpm_proto_get_frame(const uint8_t *buf, int len, tpm_proto_frame_t *frame);
+void tpm_proto_put_frame(uint8_t *buf, uint16_t type, uint16_t flags,
+                         uint32_t seq, uint32_t len);
+
+uint32_t tpm_proto_msg_len(const uint8_t *buf, int len);
+uint32_t tpm_proto_cmd_size(const uint8_t *cmd, int len, uint32_t max);
+
+int  tpm_proto_get_rec(const uint8_t *buf, int len, int *off,
+                       int *data, uint32_t *data_len);
+int  tpm_proto_put_rec(uint8_t *buf, int cap, int off, uint32_t status,
+                       const uint8_t *data, uint32_t len);
+
+#endif /* TPM_PROTO_H_ */
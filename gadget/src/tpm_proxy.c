@@ -8,7 +8,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <pthread.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -24,163 +23,1051 @@
 #include <stdint.h>
 #include <string.h>
 #include <signal.h>
+#include <endian.h>
 
 #include "tpm_proxy.h"
+#include "tpm_proto.h"
 #include "usbg_service.h"
+#include "event_loop.h"
+#include "tpm_log.h"
+
+enum {
+    /* Read right after the write, /dev/tpm0 cannot be polled */
+    TPM_PROXY_MODE_SYNC = 0,
+    /* Read once the TPM fd polls readable */
+    TPM_PROXY_MODE_POLL,
+    /* Read queued to the io_uring engine */
+    TPM_PROXY_MODE_URING,
+};
 
 /**
  * Static variables
  */
-static int g_tpm_serv_fd          = -1;
-static int g_tpm_stop_thr         = 1;
-static int g_tpm_stopped_thr_srv  = 0;
-static pthread_attr_t g_tpm_serv_attr;
+static int g_tpm_fd               = -1;
+static int g_tpm_conn_timer       = -1;
+static int g_tpm_retry_timer      = -1;
+
+/* How the response to a command is collected, TPM_PROXY_MODE_* */
+static int g_tpm_mode             = TPM_PROXY_MODE_SYNC;
+
+/* TPM read or write queued to the I/O engine */
+static int g_tpm_io_id            = -1;
+
+/* Answer on its way to the host, and its length */
+static int g_tpm_tx_id            = -1;
+static int g_tpm_tx_len           = 0;
+
+/* Length of the command being written to the TPM */
+static int g_tpm_cmd_len          = 0;
+
+/* Receive buffer of the transfer being handled, lent by the USB service */
+static uint8_t *g_tpm_rx8        = NULL;
+
+/* Receive buffers hold any message taken, shorter transfers end one */
+#define TPM_PROXY_RX_SZ   (TPM_PROTO_FRAME_SZ + USBG_READ_MAX)
+
+/* Rest of a message longer than the buffers, dropped up to a short transfer */
+static int      g_tpm_rx_skip     = 0;
+
+/* Bytes of the TPM response read so far */
+static int      g_tpm_rsp_off     = 0;
+
+/* Longest command the TPM takes, TPM_PT_MAX_COMMAND_SIZE */
+static uint32_t g_tpm_max_cmd     = USBG_READ_MAX;
+static uint8_t g_tpm_rsp8[TPM_PROTO_FRAME_SZ + USBG_READ_MAX];
+static uint8_t g_tpm_tpm8[USBG_READ_MAX];
+
+/* The command sent to the TPM came framed, and with which sequence number */
+static int      g_tpm_framed      = 0;
+static uint32_t g_tpm_seq         = 0;
+
+/* Reported through the vendor control requests */
+static uint8_t           g_tpm_family = TPM_PROTO_FAMILY_UNKNOWN;
+static tpm_proto_stats_t g_tpm_stats;
+
+/* A command is with the TPM, and the host canceled it */
+static int               g_tpm_pending     = 0;
+static int               g_tpm_canceled    = 0;
+
+/* The cancel file failed once, it is not reported again */
+static int               g_tpm_cancel_warned = 0;
 
-static pthread_t g_tpm_hnd_thread_srv;
+/* BATCH_CMD frame being run, its records stay in g_tpm_rx8 */
+typedef struct {
+    int               active;
+    tpm_proto_frame_t frame;
+    int               len;
+    int               in_off;
+    int               out_off;
+    int               ncmds;
+} tpm_proxy_batch_t;
+
+static tpm_proxy_batch_t g_tpm_batch;
 
 
 /*** Function prototypes ***/
 
+static void tpm_proxy_usb_rx_next(void);
+static void tpm_proxy_retry_timeout(int fd, uint32_t events, void *arg);
+static void tpm_proxy_tpm_read_done(int result, void *arg);
+static void tpm_proxy_tpm_write_done(int result, void *arg);
+
 
-static void *handle_tpm_thread_srv(void *arg)
+/**
+ * Find out which TPM family /dev/tpm0 belongs to
+ *
+ * @return TPM_PROTO_FAMILY_*
+ */
+static uint8_t tpm_proxy_get_family(void)
 {
-    int     iret, fd_usb, iact, sock_max;
-    fd_set  read_fds;
-    fd_set  except_fds;
-    int     itimeoutc;
-    uint8_t buf8[USBG_READ_MAX];
-    int     fd_tpm0, fd_wr_usb;
+    FILE *fp;
+    int   major = 0;
 
-    printf("handle_psock_thread_usb+\n");
+    /* Exported by kernels 5.6 and later */
+    fp = fopen("/sys/class/tpm/tpm0/tpm_version_major", "r");
+    if (!fp)
+    {
+        return TPM_PROTO_FAMILY_UNKNOWN;
+    }
 
-    fd_tpm0 = open("/dev/tpm0", O_RDWR | O_SYNC);
+    if (fscanf(fp, "%d", &major) != 1)
+    {
+        major = 0;
+    }
+    fclose(fp);
 
-    if (fd_tpm0 < 0)
+    switch (major)
     {
-        perror("/dev/tpm0 open fails");
-        goto thr_error2;
+    case 1:
+        return TPM_PROTO_FAMILY_TPM12;
+    case 2:
+        return TPM_PROTO_FAMILY_TPM20;
+    default:
+        return TPM_PROTO_FAMILY_UNKNOWN;
+    }
+}
+
+/**
+ * Ask a TPM 2.0 for TPM_PT_MAX_COMMAND_SIZE
+ *
+ * Runs before the TPM fd is handed to the event loop, while it blocks.
+ * Without an answer the limit stays at USBG_READ_MAX, which is also the
+ * most the kernel takes in one write to /dev/tpm0.
+ */
+static void tpm_proxy_get_max_cmd(void)
+{
+    static const uint8_t cmd[] = {
+        0x80, 0x01,                 /* TPM_ST_NO_SESSIONS */
+        0x00, 0x00, 0x00, 0x16,     /* commandSize */
+        0x00, 0x00, 0x01, 0x7a,     /* TPM_CC_GetCapability */
+        0x00, 0x00, 0x00, 0x06,     /* TPM_CAP_TPM_PROPERTIES */
+        0x00, 0x00, 0x01, 0x1e,     /* TPM_PT_MAX_COMMAND_SIZE */
+        0x00, 0x00, 0x00, 0x01,     /* propertyCount */
+    };
+    uint8_t  rsp[64];
+    uint32_t max;
+    int      len;
+
+    g_tpm_max_cmd = USBG_READ_MAX;
+
+    if (g_tpm_family == TPM_PROTO_FAMILY_TPM12)
+    {
+        return;
     }
 
-    printf("open OK tpm0 (%d)\r\n", fd_tpm0);
+    if ((write(g_tpm_fd, cmd, sizeof(cmd)) != sizeof(cmd)) ||
+        ((len = read(g_tpm_fd, rsp, sizeof(rsp))) < 0))
+    {
+        return;
+    }
 
-    /* Wait for USB */
-    itimeoutc = TPM_WAIT_USBG_CONN;
-    while (( gadgetfs_io_is_ready() == 0) &&
-            (--itimeoutc))
+    /* Header, moreData, capability, count, then the property and value */
+    if ((len < 27) || (tpm_get_be32(&rsp[6]) != 0) ||
+        (tpm_get_be32(&rsp[15]) != 1) || (tpm_get_be32(&rsp[19]) != 0x11e))
     {
-        usleep(1000);
+        return;
     }
 
-    /* If timeout => stop thread */
-    if (!itimeoutc)
+    max = tpm_get_be32(&rsp[23]);
+    if ((max >= TPM_HEADER_SZ) && (max < g_tpm_max_cmd))
     {
-        printf("USB thread stop\n");
-        return NULL;
+        g_tpm_max_cmd = max;
     }
+}
+
+/**
+ * Mark a command as sent to the TPM
+ */
+static void tpm_proxy_cmd_start(void)
+{
+    g_tpm_pending  = 1;
+    g_tpm_canceled = 0;
+    g_tpm_rsp_off  = 0;
+}
 
-    printf("[GadgetFS] Ready for client connect().\n");
+/**
+ * Mark the command sent to the TPM as done
+ *
+ * @return 1 - the host canceled it, drop the response, 0 - forward it
+ */
+static int tpm_proxy_cmd_done(void)
+{
+    int canceled = g_tpm_canceled;
+
+    g_tpm_pending  = 0;
+    g_tpm_canceled = 0;
+
+    return canceled;
+}
 
-    fd_usb = gadgetfs_io_get_read_fd();
-    fd_wr_usb = gadgetfs_io_get_write_fd();
-    FD_ZERO(&read_fds);
-    FD_ZERO(&except_fds);
-    FD_SET(fd_usb, &read_fds);
-    FD_SET(fd_usb, &except_fds);
-    FD_SET(fd_tpm0, &read_fds);
-    FD_SET(fd_tpm0, &except_fds);
+/**
+ * Cancel the command with the TPM, the host gave up on it
+ *
+ * The kernel TPM driver aborts the command, so the TPM takes the next one
+ * right away. Its response is dropped.
+ */
+static void tpm_proxy_cancel(void)
+{
+    int fd;
 
-    if (fd_usb >= fd_tpm0)
+    if (g_tpm_pending && !g_tpm_canceled)
     {
-        sock_max = fd_usb;
-    } else {
-        sock_max = fd_tpm0;
+        tpm_log(TPM_LOG_INFO, TPM_MSG_TPM_CANCEL);
+        g_tpm_canceled = 1;
+
+        fd = open(TPM_CANCEL_PATH, O_WRONLY);
+        if ((fd < 0) || (write(fd, "1", 1) != 1))
+        {
+            /* Not offered by every TPM driver, the response is dropped anyway */
+            if (!g_tpm_cancel_warned)
+            {
+                tpm_log(TPM_LOG_WARN, TPM_MSG_TPM_CANCEL_ERR, errno);
+                g_tpm_cancel_warned = 1;
+            }
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
     }
+}
+
+/**
+ * Answer the vendor control requests, see usbg_vendor_handler_t
+ */
+static int tpm_proxy_vendor_request(uint8_t request, uint16_t value,
+                                    int dir_in, uint8_t *buf, int len)
+{
+    tpm_proto_caps_t  caps;
+    tpm_proto_stats_t stats;
 
-    while(!g_tpm_stop_thr)
+    switch (request)
     {
-        iact = select(sock_max + 1, &read_fds, 0, &except_fds, NULL);
+    case TPM_PROTO_REQ_PING:
+        return dir_in ? -1 : 0;
 
-        printf("select DONE\r\n");
+    case TPM_PROTO_REQ_CANCEL:
+        if (dir_in)
+        {
+            return -1;
+        }
+        tpm_proxy_cancel();
+        return 0;
 
-        switch (iact) {
-          case -1:
-            perror("select()");
-            goto thr_error1;
+    case TPM_PROTO_REQ_CAPS:
+        if (!dir_in)
+        {
+            return -1;
+        }
+        memset(&caps, 0, sizeof(caps));
+        caps.version    = htole16(TPM_PROTO_VERSION);
+        caps.features   = htole16(TPM_PROTO_FEATURES);
+        caps.max_cmd    = htole32(g_tpm_max_cmd);
+        caps.tpm_family = g_tpm_family;
+        if (len > (int)sizeof(caps))
+        {
+            len = sizeof(caps);
+        }
+        memcpy(buf, &caps, len);
+        return len;
 
-          case 0:
-            // you should never get here
-            printf("select() returns 0.\r\n");
-            goto thr_error1;
+    case TPM_PROTO_REQ_STATS:
+        if (!dir_in)
+        {
+            return -1;
+        }
+        stats.commands   = htole32(g_tpm_stats.commands);
+        stats.batches    = htole32(g_tpm_stats.batches);
+        stats.tpm_errors = htole32(g_tpm_stats.tpm_errors);
+        stats.usb_errors = htole32(g_tpm_stats.usb_errors);
+        if (len > (int)sizeof(stats))
+        {
+            len = sizeof(stats);
+        }
+        memcpy(buf, &stats, len);
+        return len;
 
-          default:
-            /* All set fds should be checked. */
+    default:
+        return -1;
+    }
+}
 
-            if (FD_ISSET(fd_usb, &read_fds)) {
-                /* Data received */
+/**
+ * Transfer to the host completed, see usbg_io_cb_t
+ *
+ * The host reads with transfers larger than any response, so one that ends
+ * on a packet boundary is terminated with a zero length packet. The next
+ * transfer from the host is taken once the answer is out.
+ */
+static void tpm_usb_write_done(int result, void *arg)
+{
+    int fd = (int)(intptr_t)arg;
 
-                printf("USB RX\r\n");
+    g_tpm_tx_id = -1;
 
-                iret = read(fd_usb, &buf8[0], USBG_READ_MAX);
+    if (result != g_tpm_tx_len)
+    {
+        tpm_log(TPM_LOG_ERR, TPM_MSG_USB_TX_ERR, g_tpm_tx_len, result);
+        g_tpm_stats.usb_errors++;
+    }
+    else if ((result > 0) && ((result % gadgetfs_io_get_max_packet()) == 0))
+    {
+        tpm_log(TPM_LOG_DEBUG, TPM_MSG_USB_ZLP);
+        g_tpm_tx_len = 0;
+        g_tpm_tx_id = usbg_io_submit(fd, 1, g_tpm_rsp8, 0,
+                tpm_usb_write_done, arg);
+        if (g_tpm_tx_id >= 0)
+        {
+            return;
+        }
+        g_tpm_tx_id = -1;
+    }
+    else if (result > 0)
+    {
+        tpm_log(TPM_LOG_DEBUG, TPM_MSG_USB_TX, result);
+    }
 
-                if (iret <= 0)
-                {
-                    printf("Read USB fd <= 0.\r\n");
-                    goto thr_error1;
-                }
+    tpm_proxy_usb_rx_next();
+}
 
-                if (iret > 0)
-                {
-                    printf("read usb %d\r\n", iret);
+/**
+ * Queue a transfer to the host to the I/O engine
+ *
+ * @param fd    USB write fd
+ * @param buf   Data to send, untouched until the transfer completes
+ * @param len   Length of the data
+ *
+ * @return request id, <0 - error
+ */
+static int tpm_usb_write(int fd, const uint8_t *buf, int len)
+{
+    int iret;
 
-                    write(fd_tpm0, &buf8[0], iret);
-                }
-            }
+    g_tpm_tx_len = len;
+    iret = usbg_io_submit(fd, 1, (void *)buf, len, tpm_usb_write_done,
+            (void *)(intptr_t)fd);
+    if (iret < 0)
+    {
+        tpm_log(TPM_LOG_ERR, TPM_MSG_USB_TX_ERR, len, iret);
+        g_tpm_stats.usb_errors++;
+        return iret;
+    }
 
-            if (FD_ISSET(fd_tpm0, &read_fds)) {
-                /* Data received */
+    g_tpm_tx_id = iret;
 
-                printf("TPM0 RX\r\n");
+    return iret;
+}
 
-                iret = read(fd_tpm0, &buf8[0], USBG_READ_MAX);
+/**
+ * Send a framed transfer to the host
+ *
+ * @param fd    USB write fd
+ * @param type  TPM_PROTO_* frame type
+ * @param flags Frame flags
+ * @param seq   Sequence number
+ * @param buf   Buffer with TPM_PROTO_FRAME_SZ bytes of headroom, then the payload
+ * @param len   Length of the payload
+ *
+ * @return request id, <0 - error
+ */
+static int tpm_proto_write_frame(int fd, uint16_t type, uint16_t flags,
+                                 uint32_t seq, uint8_t *buf, int len)
+{
+    tpm_proto_put_frame(buf, type, flags, seq, len);
 
-                if (iret <= 0)
-                {
-                    printf("Read TPM fd <= 0.\r\n");
-                    //goto thr_error1;
-                }
+    return tpm_usb_write(fd, buf, TPM_PROTO_FRAME_SZ + len);
+}
 
-                if (iret > 0)
-                {
-                    printf("write to usb %d\r\n", iret);
+/**
+ * Buffer the response to the pending command goes to
+ */
+static uint8_t *tpm_proxy_rsp_buf(void)
+{
+    return g_tpm_batch.active ? g_tpm_tpm8 : &g_tpm_rsp8[TPM_PROTO_FRAME_SZ];
+}
 
-                    write(fd_wr_usb, &buf8[0], iret);
-                }
-            }
+/**
+ * Add a read from the TPM to the response being collected
+ *
+ * The response is complete once it is as long as its header says, the
+ * kernel hands out the rest of a response on the next read.
+ *
+ * @param iret  read() result
+ *
+ * @return response length, <0 - error, -EINPROGRESS - more to read
+ */
+static int tpm_proxy_rsp_collect(int iret)
+{
+    uint32_t size;
 
-            if (FD_ISSET(fd_usb, &except_fds)) {
-              printf("Exception USB fd.\r\n");
-              goto thr_error1;
-            }
+    if ((iret < 0) || ((iret == 0) && (g_tpm_rsp_off == 0)))
+    {
+        g_tpm_rsp_off = 0;
+        return iret;
+    }
 
-            if (FD_ISSET(fd_tpm0, &except_fds)) {
-              printf("Exception TPM0 fd.\r\n");
-              goto thr_error1;
-            }
+    g_tpm_rsp_off += iret;
+
+    if ((iret > 0) && (g_tpm_rsp_off < USBG_READ_MAX))
+    {
+        if (g_tpm_rsp_off < TPM_HEADER_SZ)
+        {
+            return -EINPROGRESS;
+        }
+
+        size = tpm_get_be32(&tpm_proxy_rsp_buf()[2]);
+        if (size > (uint32_t)g_tpm_rsp_off)
+        {
+            return -EINPROGRESS;
+        }
+    }
+
+    iret = g_tpm_rsp_off;
+    g_tpm_rsp_off = 0;
+
+    return iret;
+}
+
+/**
+ * Write a command to the TPM
+ *
+ * With io_uring the write is queued as well, /dev/tpm0 may block in it.
+ *
+ * @param buf   TPM command
+ * @param len   Length of the command
+ *
+ * @return write() result, -EINPROGRESS - tpm_proxy_tpm_write_done() gets it
+ */
+static int tpm_proxy_tpm_write(const uint8_t *buf, int len)
+{
+    int iret;
+
+    g_tpm_cmd_len = len;
+
+    if (g_tpm_mode == TPM_PROXY_MODE_URING)
+    {
+        iret = usbg_io_submit(g_tpm_fd, 1, (void *)buf, len,
+                tpm_proxy_tpm_write_done, NULL);
+        if (iret < 0)
+        {
+            return iret;
+        }
+        g_tpm_io_id = iret;
+        return -EINPROGRESS;
+    }
+
+    iret = write(g_tpm_fd, buf, len);
+
+    return (iret < 0) ? -errno : iret;
+}
+
+/**
+ * Collect the response to the command just written to the TPM
+ *
+ * @return response length or <0 now, -EINPROGRESS - tpm_proxy_tpm_done()
+ *         gets it later
+ */
+static int tpm_proxy_tpm_read(void)
+{
+    uint8_t *buf = tpm_proxy_rsp_buf() + g_tpm_rsp_off;
+    int      len = USBG_READ_MAX - g_tpm_rsp_off;
+    int      iret;
+
+    switch (g_tpm_mode)
+    {
+    case TPM_PROXY_MODE_URING:
+        iret = usbg_io_submit(g_tpm_fd, 0, buf, len,
+                tpm_proxy_tpm_read_done, NULL);
+        if (iret < 0)
+        {
+            return iret;
+        }
+        g_tpm_io_id = iret;
+        return -EINPROGRESS;
+
+    case TPM_PROXY_MODE_POLL:
+        return -EINPROGRESS;
+
+    default:
+        do
+        {
+            iret = tpm_proxy_rsp_collect(read(g_tpm_fd,
+                    tpm_proxy_rsp_buf() + g_tpm_rsp_off,
+                    USBG_READ_MAX - g_tpm_rsp_off));
+        } while (iret == -EINPROGRESS);
+        return iret;
+    }
+}
+
+/**
+ * The command went to the TPM, collect its response
+ *
+ * @param iret  write() result
+ *
+ * @return response length or <0 now, -EINPROGRESS - tpm_proxy_tpm_done()
+ *         gets it later
+ */
+static int tpm_proxy_tpm_sent(int iret)
+{
+    if (iret != g_tpm_cmd_len)
+    {
+        tpm_log(TPM_LOG_ERR, TPM_MSG_TPM_TX_ERR, g_tpm_cmd_len);
+        return (iret < 0) ? iret : -EIO;
+    }
+
+    return tpm_proxy_tpm_read();
+}
+
+/**
+ * Send a command to the TPM and collect its response
+ *
+ * @param buf   TPM command
+ * @param len   Length of the command
+ *
+ * @return response length or <0 now, -EINPROGRESS - tpm_proxy_tpm_result()
+ *         gets it later
+ */
+static int tpm_proxy_tpm_send(const uint8_t *buf, int len)
+{
+    int iret;
+
+    iret = tpm_proxy_tpm_write(buf, len);
+    if (iret == -EINPROGRESS)
+    {
+        return iret;
+    }
+
+    return tpm_proxy_tpm_sent(iret);
+}
+
+/**
+ * Finish the batch and answer with one BATCH_RSP frame
+ *
+ * @param canceled  1 - the host gave up on the batch, send nothing
+ */
+static void tpm_proxy_batch_end(int canceled)
+{
+    g_tpm_batch.active = 0;
+
+    tpm_log(TPM_LOG_DEBUG, TPM_MSG_BATCH, g_tpm_batch.ncmds,
+            g_tpm_batch.out_off);
+    g_tpm_stats.batches++;
+
+    if (canceled)
+    {
+        tpm_log(TPM_LOG_INFO, TPM_MSG_BATCH_CANCEL, g_tpm_batch.ncmds);
+    }
+    else
+    {
+        tpm_proto_write_frame(gadgetfs_io_get_write_fd(), TPM_PROTO_BATCH_RSP,
+                0, g_tpm_batch.frame.seq, g_tpm_rsp8, g_tpm_batch.out_off);
+    }
+
+    tpm_proxy_usb_rx_next();
+}
+
+/**
+ * Add the response record of the current command to the BATCH_RSP frame
+ *
+ * @param status    TPM_PROTO_REC_*
+ * @param rlen      Length of the response in g_tpm_tpm8
+ */
+static void tpm_proxy_batch_put(uint32_t status, int rlen)
+{
+    int off;
+
+    if (status == TPM_PROTO_REC_FAILED)
+    {
+        g_tpm_stats.tpm_errors++;
+    }
+
+    g_tpm_batch.ncmds++;
+
+    /* Room for the record header was checked before the command went out */
+    off = tpm_proto_put_rec(&g_tpm_rsp8[TPM_PROTO_FRAME_SZ], USBG_READ_MAX,
+            g_tpm_batch.out_off, status, g_tpm_tpm8, rlen);
+    if (off < 0)
+    {
+        tpm_proxy_batch_end(0);
+        return;
+    }
+    g_tpm_batch.out_off = off;
+
+    if ((status != TPM_PROTO_REC_OK) &&
+        (g_tpm_batch.frame.flags & TPM_PROTO_STOP_ON_ERROR))
+    {
+        tpm_proxy_batch_end(0);
+    }
+}
+
+/**
+ * Send the next command of the batch to the TPM
+ *
+ * @param rlen  Set to the response length or <0, -EINPROGRESS -
+ *              tpm_proxy_tpm_result() gets it later
+ *
+ * @return 1 - the command went to the TPM, 0 - the batch ended
+ */
+static int tpm_proxy_batch_write(int *rlen)
+{
+    const uint8_t  *buf = &g_tpm_rx8[TPM_PROTO_FRAME_SZ];
+    uint32_t        cmd_len;
+    int             cmd_off, iret;
+
+    iret = tpm_proto_get_rec(buf, g_tpm_batch.len, &g_tpm_batch.in_off,
+            &cmd_off, &cmd_len);
+    if (iret == 0)
+    {
+        tpm_proxy_batch_end(0);
+        return 0;
+    }
+
+    if ((iret < 0) ||
+        (g_tpm_batch.out_off + (int)TPM_PROTO_REC_SZ > USBG_READ_MAX))
+    {
+        tpm_log(TPM_LOG_WARN, TPM_MSG_BATCH_MALFORMED);
+        tpm_proxy_batch_end(0);
+        return 0;
+    }
+
+    g_tpm_stats.commands++;
+    tpm_proxy_cmd_start();
 
-        } /* switch (iact) { */
+    *rlen = tpm_proxy_tpm_send(&buf[cmd_off], cmd_len);
+
+    return 1;
+}
+
+/**
+ * Add the response to the current command of the batch
+ *
+ * @param rlen      Length of the response in g_tpm_tpm8, <0 - error
+ */
+static void tpm_proxy_batch_rsp(int rlen)
+{
+    uint32_t status = TPM_PROTO_REC_OK;
+
+    if (rlen <= 0)
+    {
+        status = TPM_PROTO_REC_FAILED;
+        rlen = 0;
+    }
+    else if (g_tpm_batch.out_off + (int)TPM_PROTO_REC_SZ +
+             (int)TPM_PROTO_REC_PAD(rlen) > USBG_READ_MAX)
+    {
+        status = TPM_PROTO_REC_TRUNCATED;
+        rlen = 0;
+    }
+
+    /* The host gave up on the whole batch */
+    if (tpm_proxy_cmd_done())
+    {
+        tpm_proxy_batch_end(1);
+        return;
+    }
+
+    tpm_proxy_batch_put(status, rlen);
+}
+
+/**
+ * Run the batch until a command waits for the TPM, or up to its end
+ */
+static void tpm_proxy_batch_next(void)
+{
+    int rlen;
+
+    while (g_tpm_batch.active)
+    {
+        if (!tpm_proxy_batch_write(&rlen))
+        {
+            continue;
+        }
+
+        /* tpm_proxy_tpm_result() continues the batch */
+        if (rlen == -EINPROGRESS)
+        {
+            return;
+        }
+
+        tpm_proxy_batch_rsp(rlen);
+    }
+}
+
+/**
+ * Start running the commands of a BATCH_CMD frame
+ *
+ * @param frame     Frame header of the batch
+ * @param len       Length of the records following it in g_tpm_rx8
+ */
+static void tpm_proxy_batch(const tpm_proto_frame_t *frame, int len)
+{
+    memset(&g_tpm_batch, 0, sizeof(g_tpm_batch));
+    g_tpm_batch.active = 1;
+    g_tpm_batch.frame  = *frame;
+    g_tpm_batch.len    = len;
+
+    tpm_proxy_batch_next();
+}
+
+/**
+ * Forward the response of the TPM to the host
+ *
+ * @param iret  Length of the response after the frame headroom of
+ *              g_tpm_rsp8, <0 - error
+ */
+static void tpm_proxy_tpm_rsp(int iret)
+{
+    if (!g_tpm_pending)
+    {
+        tpm_log(TPM_LOG_WARN, TPM_MSG_TPM_STRAY, iret);
+        return;
+    }
+
+    tpm_log(TPM_LOG_DEBUG, TPM_MSG_TPM_RX, iret);
+
+    if (iret <= 0)
+    {
+        tpm_log(TPM_LOG_ERR, TPM_MSG_TPM_RX_ERR);
+        g_tpm_stats.tpm_errors++;
+    }
+
+    if (tpm_proxy_cmd_done())
+    {
+        tpm_log(TPM_LOG_INFO, TPM_MSG_TPM_DROP, iret);
+    }
+    else if (iret > 0)
+    {
+        if (g_tpm_framed)
+        {
+            tpm_proto_write_frame(gadgetfs_io_get_write_fd(), TPM_PROTO_RSP,
+                    0, g_tpm_seq, g_tpm_rsp8, iret);
+        }
+        else
+        {
+            tpm_usb_write(gadgetfs_io_get_write_fd(),
+                    &g_tpm_rsp8[TPM_PROTO_FRAME_SZ], iret);
+        }
+    }
+
+    tpm_proxy_usb_rx_next();
+}
+
+/**
+ * Send a command to the TPM
+ *
+ * @param buf   TPM command
+ * @param len   Length of the command
+ */
+static void tpm_proxy_tpm_cmd(const uint8_t *buf, int len)
+{
+    int iret;
+
+    g_tpm_stats.commands++;
+    tpm_proxy_cmd_start();
+
+    iret = tpm_proxy_tpm_send(buf, len);
+    if (iret != -EINPROGRESS)
+    {
+        tpm_proxy_tpm_rsp(iret);
+    }
+}
+
+/**
+ * Hand the response, or the error, on to the batch or the host
+ *
+ * @param iret  Length of the response, <0 - error
+ */
+static void tpm_proxy_tpm_result(int iret)
+{
+    if (g_tpm_batch.active)
+    {
+        tpm_proxy_batch_rsp(iret);
+        tpm_proxy_batch_next();
+        return;
+    }
+
+    tpm_proxy_tpm_rsp(iret);
+}
+
+/**
+ * The TPM response arrived after tpm_proxy_tpm_read() said -EINPROGRESS
+ *
+ * @param iret  Length of the response, <0 - error
+ */
+static void tpm_proxy_tpm_done(int iret)
+{
+    iret = tpm_proxy_rsp_collect(iret);
+    if (iret == -EINPROGRESS)
+    {
+        /* Comes back here with the rest */
+        iret = tpm_proxy_tpm_read();
+        if (iret == -EINPROGRESS)
+        {
+            return;
+        }
+    }
+
+    tpm_proxy_tpm_result(iret);
+}
+
+/**
+ * TPM fd events, called from the event loop
+ */
+static void tpm_proxy_tpm_event(int fd, uint32_t events, void *arg)
+{
+    int iret;
+
+    iret = read(g_tpm_fd, tpm_proxy_rsp_buf() + g_tpm_rsp_off,
+            USBG_READ_MAX - g_tpm_rsp_off);
+
+    if ((iret < 0) && (errno == EAGAIN))
+    {
+        return;
     }
 
-thr_error1:
+    tpm_proxy_tpm_done(iret);
+}
 
-    printf("handle_psock_thread_usb-\n");
+/**
+ * TPM read completion of the I/O engine, see usbg_io_cb_t
+ */
+static void tpm_proxy_tpm_read_done(int result, void *arg)
+{
+    g_tpm_io_id = -1;
 
-    close(fd_tpm0);
+    tpm_proxy_tpm_done(result);
+}
 
-thr_error2:
+/**
+ * TPM write completion of the I/O engine, see usbg_io_cb_t
+ */
+static void tpm_proxy_tpm_write_done(int result, void *arg)
+{
+    int iret;
 
-    g_tpm_stopped_thr_srv = 1;
+    g_tpm_io_id = -1;
 
-    return NULL;
+    iret = tpm_proxy_tpm_sent(result);
+    if (iret != -EINPROGRESS)
+    {
+        tpm_proxy_tpm_result(iret);
+    }
+}
+
+/**
+ * Answer a command whose size is malformed or longer than the TPM takes,
+ * it is not sent to the TPM
+ *
+ * @param size  Size of the command, as its header says
+ * @param len   Bytes of it received
+ */
+static void tpm_proxy_bad_size(uint32_t size, uint32_t len)
+{
+    uint8_t *rsp = &g_tpm_rsp8[TPM_PROTO_FRAME_SZ];
+
+    tpm_log(TPM_LOG_WARN, TPM_MSG_CMD_BAD_SIZE, size, len, g_tpm_max_cmd);
+    g_tpm_stats.tpm_errors++;
+
+    if (g_tpm_family == TPM_PROTO_FAMILY_TPM12)
+    {
+        rsp[0] = 0x00;              /* TPM_TAG_RSP_COMMAND */
+        rsp[1] = 0xc4;
+        tpm_put_be32(&rsp[6], 0x19);    /* TPM_BAD_PARAM_SIZE */
+    }
+    else
+    {
+        rsp[0] = 0x80;              /* TPM_ST_NO_SESSIONS */
+        rsp[1] = 0x01;
+        tpm_put_be32(&rsp[6], 0x142);   /* TPM_RC_COMMAND_SIZE */
+    }
+    tpm_put_be32(&rsp[2], TPM_HEADER_SZ);
+
+    if (g_tpm_framed)
+    {
+        tpm_proto_write_frame(gadgetfs_io_get_write_fd(), TPM_PROTO_RSP,
+                0, g_tpm_seq, g_tpm_rsp8, TPM_HEADER_SZ);
+    }
+    else
+    {
+        tpm_usb_write(gadgetfs_io_get_write_fd(), rsp, TPM_HEADER_SZ);
+    }
+
+    tpm_proxy_usb_rx_next();
+}
+
+/**
+ * A transfer from the host arrived, see usbg_rx_cb_t
+ *
+ * The buffer goes back once the host has the answer, the transfers
+ * queued behind it wait, the TPM takes one command at a time anyway.
+ */
+static void tpm_proxy_usb_rx(int result, uint8_t *buf)
+{
+    tpm_proto_frame_t frame;
+    uint32_t          len;
+
+    g_tpm_rx8 = buf;
+
+    if (result < 0)
+    {
+        tpm_log(TPM_LOG_ERR, TPM_MSG_USB_RX_ERR, result);
+        g_tpm_stats.usb_errors++;
+        g_tpm_rx_skip = 0;
+
+        /* Back off, the reads are queued again on reconnect */
+        if (!gadgetfs_io_is_ready())
+        {
+            tpm_proxy_usb_rx_next();
+        }
+        else if (g_tpm_retry_timer == -1)
+        {
+            g_tpm_retry_timer = event_loop_timer_add(TPM_USB_RETRY_MS, 0,
+                    tpm_proxy_retry_timeout, NULL);
+        }
+        return;
+    }
+
+    tpm_log(TPM_LOG_DEBUG, TPM_MSG_USB_RX, result);
+
+    /* The host wrote more than a buffer, its message was answered already */
+    if (g_tpm_rx_skip)
+    {
+        g_tpm_rx_skip = (result == (int)TPM_PROXY_RX_SZ);
+        tpm_log(TPM_LOG_DEBUG, TPM_MSG_USB_SKIP, result);
+        tpm_proxy_usb_rx_next();
+        return;
+    }
+
+    if (result == 0)
+    {
+        tpm_proxy_usb_rx_next();
+        return;
+    }
+
+    g_tpm_rx_skip = (result == (int)TPM_PROXY_RX_SZ) &&
+                    (tpm_proto_msg_len(g_tpm_rx8, result) > (uint32_t)result);
+
+    if (!tpm_proto_get_frame(g_tpm_rx8, result, &frame))
+    {
+        g_tpm_framed = 0;
+        len = tpm_proto_cmd_size(g_tpm_rx8, result, g_tpm_max_cmd);
+        if (len == 0)
+        {
+            tpm_proxy_bad_size(tpm_proto_msg_len(g_tpm_rx8, result), result);
+            return;
+        }
+        tpm_proxy_tpm_cmd(g_tpm_rx8, len);
+    }
+    else if (frame.type == TPM_PROTO_HELLO)
+    {
+        tpm_log(TPM_LOG_INFO, TPM_MSG_HELLO, frame.flags);
+        tpm_proto_write_frame(gadgetfs_io_get_write_fd(), TPM_PROTO_HELLO,
+                TPM_PROTO_FEATURES, frame.seq, g_tpm_rsp8, 0);
+        tpm_proxy_usb_rx_next();
+    }
+    else if (frame.type == TPM_PROTO_CMD)
+    {
+        g_tpm_framed = 1;
+        g_tpm_seq = frame.seq;
+        len = tpm_proto_cmd_size(&g_tpm_rx8[TPM_PROTO_FRAME_SZ],
+                result - TPM_PROTO_FRAME_SZ, g_tpm_max_cmd);
+        if ((len == 0) || (len != frame.len))
+        {
+            tpm_proxy_bad_size(frame.len, result - TPM_PROTO_FRAME_SZ);
+            return;
+        }
+        tpm_proxy_tpm_cmd(&g_tpm_rx8[TPM_PROTO_FRAME_SZ], len);
+    }
+    else if (frame.type == TPM_PROTO_BATCH_CMD)
+    {
+        /* Records past the transfer are left out, the host sees none for them */
+        if (frame.len > (uint32_t)result - TPM_PROTO_FRAME_SZ)
+        {
+            tpm_log(TPM_LOG_WARN, TPM_MSG_CMD_BAD_SIZE, frame.len,
+                    result - (int)TPM_PROTO_FRAME_SZ, USBG_READ_MAX);
+            frame.len = result - TPM_PROTO_FRAME_SZ;
+        }
+        tpm_proxy_batch(&frame, frame.len);
+    }
+    else
+    {
+        tpm_log(TPM_LOG_WARN, TPM_MSG_FRAME_UNKNOWN, frame.type);
+        tpm_proxy_usb_rx_next();
+    }
+}
+
+/**
+ * Move on to the next transfer from the host, unless the TPM is still busy
+ * or the answer still on its way
+ */
+static void tpm_proxy_usb_rx_next(void)
+{
+    if (g_tpm_pending || g_tpm_batch.active || (g_tpm_tx_id != -1))
+    {
+        return;
+    }
+
+    gadgetfs_io_rx_release();
+}
+
+static void tpm_proxy_retry_timeout(int fd, uint32_t events, void *arg)
+{
+    event_loop_timer_del(g_tpm_retry_timer);
+    g_tpm_retry_timer = -1;
+
+    tpm_proxy_usb_rx_next();
+}
+
+static void tpm_proxy_conn_timeout(int fd, uint32_t events, void *arg)
+{
+    event_loop_timer_del(g_tpm_conn_timer);
+    g_tpm_conn_timer = -1;
+
+    printf("USB not configured after %d ms\r\n", TPM_WAIT_USBG_CONN);
+}
+
+/**
+ * USB configured state changes, see usbg_state_handler_t
+ */
+static void tpm_proxy_usb_state(int ready)
+{
+    if (!ready)
+    {
+        tpm_log(TPM_LOG_INFO, TPM_MSG_USB_STATE, 0);
+        g_tpm_rx_skip = 0;
+
+        /* Nobody to answer to anymore */
+        tpm_proxy_cancel();
+        return;
+    }
+
+    if (g_tpm_conn_timer != -1)
+    {
+        event_loop_timer_del(g_tpm_conn_timer);
+        g_tpm_conn_timer = -1;
+    }
+
+    tpm_log(TPM_LOG_INFO, TPM_MSG_USB_STATE, 1);
 }
 
 /**
@@ -190,20 +1077,79 @@ thr_error2:
  */
 int tpm_proxy_init(void)
 {
+    int flags, iret;
+
     printf("tpm_proxy_init+\n");
 
-    /**
-     * ---------------------------------------------------------------------------------
-     */
+    g_tpm_fd = open("/dev/tpm0", O_RDWR);
 
-    g_tpm_stop_thr = 0;
-    /**
-     * Create TPM proxy handler thread
+    if (g_tpm_fd < 0)
+    {
+        perror("/dev/tpm0 open fails");
+        return -errno;
+    }
+
+    printf("open OK tpm0 (%d)\r\n", g_tpm_fd);
+
+    /*
+     * io_uring takes blocking reads of any file, kernel AIO none from the
+     * TPM. Older kernels answer in write() and offer no poll.
      */
-    pthread_attr_init(&g_tpm_serv_attr);
-    pthread_attr_setstacksize (&g_tpm_serv_attr, TPM_TH_STACK_SZ);
-    pthread_create(&g_tpm_hnd_thread_srv, NULL, &handle_tpm_thread_srv,
-            &g_tpm_serv_fd);
+    g_tpm_io_id = -1;
+    g_tpm_tx_id = -1;
+    if (usbg_io_engine() == USBG_IO_ENGINE_URING)
+    {
+        g_tpm_mode = TPM_PROXY_MODE_URING;
+    }
+    else if (event_loop_add(g_tpm_fd, EPOLLIN, tpm_proxy_tpm_event, NULL) == 0)
+    {
+        g_tpm_mode = TPM_PROXY_MODE_POLL;
+    }
+    else
+    {
+        printf("tpm0 cannot be polled, blocking reads\r\n");
+        g_tpm_mode = TPM_PROXY_MODE_SYNC;
+    }
+
+    g_tpm_family = tpm_proxy_get_family();
+    tpm_proxy_get_max_cmd();
+    tpm_log(TPM_LOG_INFO, TPM_MSG_TPM_MAX_CMD, g_tpm_max_cmd);
+
+    if (g_tpm_mode == TPM_PROXY_MODE_POLL)
+    {
+        flags = fcntl(g_tpm_fd, F_GETFL);
+        fcntl(g_tpm_fd, F_SETFL, flags | O_NONBLOCK);
+    }
+    memset(&g_tpm_stats, 0, sizeof(g_tpm_stats));
+    memset(&g_tpm_batch, 0, sizeof(g_tpm_batch));
+    g_tpm_pending  = 0;
+    g_tpm_canceled = 0;
+    g_tpm_rx_skip  = 0;
+
+    gadgetfs_set_vendor_handler(tpm_proxy_vendor_request);
+    gadgetfs_set_state_handler(tpm_proxy_usb_state);
+
+    /* Reads stay queued from here on, also before the host configures us */
+    iret = gadgetfs_io_rx_start(TPM_PROXY_RX_SZ, tpm_proxy_usb_rx);
+    if (iret < 0)
+    {
+        tpm_log(TPM_LOG_ERR, TPM_MSG_USB_SUBMIT_ERR, iret);
+        gadgetfs_set_vendor_handler(NULL);
+        gadgetfs_set_state_handler(NULL);
+        event_loop_del(g_tpm_fd);
+        close(g_tpm_fd);
+        g_tpm_fd = -1;
+        return iret;
+    }
+
+    g_tpm_conn_timer = event_loop_timer_add(TPM_WAIT_USBG_CONN, 0,
+            tpm_proxy_conn_timeout, NULL);
+
+    /* The host may have configured us already */
+    if (gadgetfs_io_is_ready())
+    {
+        tpm_proxy_usb_state(1);
+    }
 
     printf("tpm_proxy_init-\n");
 
@@ -215,38 +1161,42 @@ int tpm_proxy_init(void)
  */
 void tpm_proxy_deinit(void)
 {
-    int    ires, i;
-    void * vres;
+    printf("tpm_proxy_deinit+\n");
 
-    printf("Wait for stopping g_tpm_hnd_thread\n");
+    gadgetfs_set_vendor_handler(NULL);
+    gadgetfs_set_state_handler(NULL);
+    gadgetfs_io_rx_stop();
+    g_tpm_rx8 = NULL;
 
-    g_tpm_stop_thr = 1;
+    if (g_tpm_conn_timer != -1)
+    {
+        event_loop_timer_del(g_tpm_conn_timer);
+        g_tpm_conn_timer = -1;
+    }
 
-    i = TPM_WAIT_USBG_THR_STOP;
-    while ((--i) && (!g_tpm_stopped_thr_srv))
+    if (g_tpm_retry_timer != -1)
     {
-        usleep(10000);
+        event_loop_timer_del(g_tpm_retry_timer);
+        g_tpm_retry_timer = -1;
     }
 
-    /* If timeout => cancel thread SRV */
-    if (!i)
+    if (g_tpm_io_id != -1)
     {
-        printf("pthread_cancel srv\n");
-        ires = pthread_cancel(g_tpm_hnd_thread_srv);
-        if (ires != 0)
-        {
-            printf("g_tpm_hnd_thread_srv cancel problem\n");
-        }
+        usbg_io_cancel(g_tpm_io_id);
+        g_tpm_io_id = -1;
     }
 
-    ires = pthread_join(g_tpm_hnd_thread_srv, &vres);
-    if (ires != 0)
+    if (g_tpm_tx_id != -1)
     {
-        printf("g_tpm_hnd_thread_srv pthread_join problem\n");
+        usbg_io_cancel(g_tpm_tx_id);
+        g_tpm_tx_id = -1;
     }
-    if (g_tpm_serv_fd != -1)
+
+    if (g_tpm_fd != -1)
     {
-        close(g_tpm_serv_fd);
+        event_loop_del(g_tpm_fd);
+        close(g_tpm_fd);
+        g_tpm_fd = -1;
     }
 
     printf("tpm_proxy_deinit-\n");
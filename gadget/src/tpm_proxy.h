@@ -8,10 +8,11 @@
 #ifndef TPM_PROXY_H_
 #define TPM_PROXY_H_
 
-#define TPM_TH_STACK_SZ             (65535)
-#define TPM_WAIT_USBG_THR_STOP      (100)
 #define TPM_WAIT_USBG_CONN          (10000)
+#define TPM_USB_RETRY_MS            (100)
 #define USBG_READ_MAX               (4096)
+#define TPM_HEADER_SZ               (10)
+#define TPM_CANCEL_PATH             "/sys/class/tpm/tpm0/device/cancel"
 
 
 int  tpm_proxy_init(void);
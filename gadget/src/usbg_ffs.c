@@ -0,0 +1,467 @@
+/**
+ * @brief FunctionFS backend of the USB service
+ *
+ * @file usbg_ffs.c
+ *
+ * Same interface, endpoints and vendor requests as the gadgetfs backend,
+ * the endpoint files and the I/O engine are shared with usbg_service.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+
+#include <linux/types.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include "usbg_service.h"
+#include "usbg_ffs.h"
+#include "event_loop.h"
+
+#define USBG_FFS_STR_INTERFACE  "Custom interface"
+#define USBG_FFS_NR_EPS         (4)
+
+/**
+ * Static variables
+ */
+static int  g_ffs_ep0 = -1;
+static int  g_ffs_bound = 0;
+static char g_ffs_udc[64];
+
+
+static int ffs_write_attr(const char *path, const char *value)
+{
+    int fd, ret = 0;
+
+    fd = open(path, O_WRONLY);
+    if (fd < 0)
+    {
+        ret = -errno;
+        printf("Unable to open %s (%m)\n", path);
+        return ret;
+    }
+
+    if (write(fd, value, strlen(value)) < 0)
+    {
+        ret = -errno;
+        printf("Unable to write %s (%m)\n", path);
+    }
+
+    close(fd);
+
+    return ret;
+}
+
+static void ffs_mkdir(const char *path)
+{
+    if ((mkdir(path, 0755) < 0) && (errno != EEXIST))
+    {
+        printf("Unable to create %s (%m)\n", path);
+    }
+}
+
+/*
+ * UDC from the environment, or the first one the kernel has
+ */
+static int ffs_find_udc(char *name, size_t len)
+{
+    const char    *env = getenv(USBG_FFS_UDC_ENV);
+    struct dirent *de;
+    DIR           *dir;
+    int            ret = -ENODEV;
+
+    if (env && *env)
+    {
+        snprintf(name, len, "%s", env);
+        return 0;
+    }
+
+    dir = opendir(USBG_FFS_UDC_CLASS);
+    if (!dir)
+    {
+        return -errno;
+    }
+
+    while ((de = readdir(dir)) != NULL)
+    {
+        if (de->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        snprintf(name, len, "%s", de->d_name);
+        ret = 0;
+        break;
+    }
+
+    closedir(dir);
+
+    return ret;
+}
+
+/*
+ * Speed the UDC connected at, read once the host enabled the function
+ */
+static enum usb_device_speed ffs_udc_speed(void)
+{
+    char    path[128];
+    char    speed[32];
+    ssize_t len;
+    int     fd;
+
+    snprintf(path, sizeof(path), USBG_FFS_UDC_CLASS "/%s/current_speed",
+             g_ffs_udc);
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return USB_SPEED_UNKNOWN;
+    }
+
+    len = read(fd, speed, sizeof(speed) - 1);
+    close(fd);
+    if (len <= 0)
+    {
+        return USB_SPEED_UNKNOWN;
+    }
+    speed[len] = '\0';
+
+    /* Names of usb_speed_string(), super-speed-plus uses 1024 too */
+    if (strncmp(speed, "super-speed", 11) == 0)
+    {
+        return USB_SPEED_SUPER;
+    }
+    if (strncmp(speed, "high-speed", 10) == 0)
+    {
+        return USB_SPEED_HIGH;
+    }
+    if (strncmp(speed, "full-speed", 10) == 0)
+    {
+        return USB_SPEED_FULL;
+    }
+
+    return USB_SPEED_UNKNOWN;
+}
+
+static void ffs_fill_descs(struct usb_interface_descriptor *intf,
+                           struct usb_endpoint_descriptor_no_audio *ep,
+                           uint16_t max_packet)
+{
+    static const uint8_t addr[USBG_FFS_NR_EPS] = {
+        USB_DIR_IN | 1, USB_DIR_OUT | 2, USB_DIR_IN | 3, USB_DIR_OUT | 4
+    };
+    int i;
+
+    intf->bLength            = USB_DT_INTERFACE_SIZE;
+    intf->bDescriptorType    = USB_DT_INTERFACE;
+    intf->bInterfaceNumber   = 0;
+    intf->bAlternateSetting  = 0;
+    intf->bNumEndpoints      = USBG_FFS_NR_EPS;
+    intf->bInterfaceClass    = USB_CLASS_VENDOR_SPEC;
+    intf->bInterfaceSubClass = 0;
+    intf->bInterfaceProtocol = 0;
+    intf->iInterface         = 1;
+
+    for (i = 0; i < USBG_FFS_NR_EPS; i++)
+    {
+        ep[i].bLength          = USB_DT_ENDPOINT_SIZE;
+        ep[i].bDescriptorType  = USB_DT_ENDPOINT;
+        ep[i].bEndpointAddress = addr[i];
+        ep[i].bmAttributes     = USB_ENDPOINT_XFER_BULK;
+        ep[i].wMaxPacketSize   = htole16(max_packet);
+        ep[i].bInterval        = 0;
+    }
+}
+
+/*
+ * Descriptors and strings of the function, written to ep0 before anything
+ */
+static int ffs_write_descs(int fd)
+{
+    struct {
+        struct usb_functionfs_descs_head_v2 header;
+        __le32 fs_count;
+        __le32 hs_count;
+        struct {
+            struct usb_interface_descriptor         intf;
+            struct usb_endpoint_descriptor_no_audio ep[USBG_FFS_NR_EPS];
+        } __attribute__((packed)) fs_descs, hs_descs;
+    } __attribute__((packed)) descs;
+
+    struct {
+        struct usb_functionfs_strings_head header;
+        struct {
+            __le16 code;
+            char   str1[sizeof(USBG_FFS_STR_INTERFACE)];
+        } __attribute__((packed)) lang0;
+    } __attribute__((packed)) strings;
+
+    memset(&descs, 0, sizeof(descs));
+    descs.header.magic  = htole32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2);
+    descs.header.length = htole32(sizeof(descs));
+    /* Vendor requests to the device come here too */
+    descs.header.flags  = htole32(FUNCTIONFS_HAS_FS_DESC |
+                                  FUNCTIONFS_HAS_HS_DESC |
+                                  FUNCTIONFS_ALL_CTRL_RECIP);
+    descs.fs_count = htole32(1 + USBG_FFS_NR_EPS);
+    descs.hs_count = htole32(1 + USBG_FFS_NR_EPS);
+    ffs_fill_descs(&descs.fs_descs.intf, descs.fs_descs.ep, 64);
+    ffs_fill_descs(&descs.hs_descs.intf, descs.hs_descs.ep, 512);
+
+    if (write(fd, &descs, sizeof(descs)) != sizeof(descs))
+    {
+        printf("FunctionFS descriptors error (%m)\n");
+        return -EINVAL;
+    }
+
+    memset(&strings, 0, sizeof(strings));
+    strings.header.magic      = htole32(FUNCTIONFS_STRINGS_MAGIC);
+    strings.header.length     = htole32(sizeof(strings));
+    strings.header.str_count  = htole32(1);
+    strings.header.lang_count = htole32(1);
+    strings.lang0.code        = htole16(0x0409); /* en-us */
+    memcpy(strings.lang0.str1, USBG_FFS_STR_INTERFACE,
+           sizeof(USBG_FFS_STR_INTERFACE));
+
+    if (write(fd, &strings, sizeof(strings)) != sizeof(strings))
+    {
+        printf("FunctionFS strings error (%m)\n");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/*
+ * ep0 events, called from the event loop
+ */
+static void handle_ffs_ep0_event(int fd, uint32_t events, void *arg)
+{
+    struct usb_functionfs_event ep0_events[4];
+    struct usb_ctrlrequest     *setup;
+    int                         ret, nevents, i, status;
+
+    ret = read(fd, ep0_events, sizeof(ep0_events));
+    if (ret < 0)
+    {
+        if (errno != EAGAIN)
+        {
+            printf("ep0 closed (%m)\n");
+            event_loop_del(fd);
+        }
+        return;
+    }
+    nevents = ret / sizeof(ep0_events[0]);
+
+    for (i = 0; i < nevents; i++)
+    {
+        switch (ep0_events[i].type)
+        {
+        case FUNCTIONFS_BIND:
+            usbsg_debug("FFS BIND\n");
+            break;
+        case FUNCTIONFS_ENABLE:
+            usbsg_debug("FFS ENABLE\n");
+            printf("usbg xcomm started\n");
+            usbg_set_speed(ffs_udc_speed());
+            usbg_set_ready(1);
+            break;
+        case FUNCTIONFS_DISABLE:
+        case FUNCTIONFS_UNBIND:
+            usbsg_debug("FFS DISABLE\n");
+            usbg_set_speed(USB_SPEED_UNKNOWN);
+            usbg_set_ready(0);
+            break;
+        case FUNCTIONFS_SETUP:
+            setup = &ep0_events[i].u.setup;
+            setup->wValue  = le16toh(setup->wValue);
+            setup->wIndex  = le16toh(setup->wIndex);
+            setup->wLength = le16toh(setup->wLength);
+
+            if ((setup->bRequestType & USB_TYPE_MASK) == USB_TYPE_VENDOR)
+            {
+                usbg_vendor_request(fd, setup);
+                break;
+            }
+
+            usbsg_debug("FFS stall request %d\n", setup->bRequest);
+            if (setup->bRequestType & USB_DIR_IN)
+                status = read(fd, &status, 0);
+            else
+                status = write(fd, &status, 0);
+            break;
+        case FUNCTIONFS_SUSPEND:
+        case FUNCTIONFS_RESUME:
+        default:
+            break;
+        }
+    }
+}
+
+/**
+ * Compose the gadget in configfs and mount its FunctionFS instance
+ */
+void ffs_usb_mount(void)
+{
+    char id[8];
+    int  iret;
+
+    printf("Prepare USB FunctionFS\n");
+
+    iret = system("modprobe libcomposite");
+    iret = system("mount -t configfs none " USBG_FFS_CONFIGFS " 2>/dev/null");
+
+    ffs_mkdir(USBG_FFS_GADGET);
+    snprintf(id, sizeof(id), "0x%04x", USBG_VID);
+    ffs_write_attr(USBG_FFS_GADGET "/idVendor", id);
+    snprintf(id, sizeof(id), "0x%04x", USBG_PID);
+    ffs_write_attr(USBG_FFS_GADGET "/idProduct", id);
+    ffs_write_attr(USBG_FFS_GADGET "/bcdDevice", "0x0200");
+
+    ffs_mkdir(USBG_FFS_GADGET "/strings/0x409");
+    ffs_write_attr(USBG_FFS_GADGET "/strings/0x409/manufacturer", "Xaptum");
+    ffs_write_attr(USBG_FFS_GADGET "/strings/0x409/product", "mPCIe OC");
+    ffs_write_attr(USBG_FFS_GADGET "/strings/0x409/serialnumber", "0001");
+
+    ffs_mkdir(USBG_FFS_GADGET "/configs/c.1");
+    ffs_mkdir(USBG_FFS_GADGET "/configs/c.1/strings/0x409");
+    ffs_write_attr(USBG_FFS_GADGET "/configs/c.1/strings/0x409/configuration",
+            "High speed configuration");
+    ffs_write_attr(USBG_FFS_GADGET "/configs/c.1/bmAttributes", "0xc0");
+
+    ffs_mkdir(USBG_FFS_GADGET "/functions/" USBG_FFS_FUNCTION);
+    if ((symlink(USBG_FFS_GADGET "/functions/" USBG_FFS_FUNCTION,
+                 USBG_FFS_GADGET "/configs/c.1/" USBG_FFS_FUNCTION) < 0) &&
+        (errno != EEXIST))
+    {
+        printf("Unable to link " USBG_FFS_FUNCTION " (%m)\n");
+    }
+
+    iret = system("mkdir -p " USBG_FFS_MOUNT);
+    iret = system("mount -t functionfs " USBG_FFS_INSTANCE " " USBG_FFS_MOUNT);
+
+    iret = iret;
+}
+
+/**
+ * Write the descriptors, open the endpoints and bind the gadget to a UDC
+ *
+ * @return 0 - success, <0 - error
+ */
+int ffs_usb_init(void)
+{
+    static const char *ep_names[USBG_FFS_NR_EPS] = {
+        USBG_FFS_MOUNT "/ep1", USBG_FFS_MOUNT "/ep2",
+        USBG_FFS_MOUNT "/ep3", USBG_FFS_MOUNT "/ep4"
+    };
+    int  fds[USBG_FFS_NR_EPS];
+    int  i, ret;
+
+    printf("USB FunctionFS setup\n");
+
+    g_ffs_ep0 = open(USBG_FFS_MOUNT "/ep0", O_RDWR);
+    if (g_ffs_ep0 < 0)
+    {
+        printf("Unable to open " USBG_FFS_MOUNT "/ep0 (%m)\n");
+        return -ENODEV;
+    }
+
+    ret = ffs_write_descs(g_ffs_ep0);
+    if (ret < 0)
+    {
+        goto fail;
+    }
+
+    /* The endpoint files show up once the descriptors are in */
+    for (i = 0; i < USBG_FFS_NR_EPS; i++)
+    {
+        fds[i] = open(ep_names[i], O_RDWR);
+        if (fds[i] < 0)
+        {
+            printf("Unable to open %s (%m)\n", ep_names[i]);
+            while (i--)
+            {
+                close(fds[i]);
+            }
+            ret = -ENODEV;
+            goto fail;
+        }
+    }
+
+    /* Closed by gadgetfs_usb_stop() from here on */
+
+    usbg_set_ep_fds(fds[0], fds[1], fds[2], fds[3]);
+
+    ret = event_loop_add(g_ffs_ep0, EPOLLIN, handle_ffs_ep0_event, NULL);
+    if (ret < 0)
+    {
+        goto fail;
+    }
+
+    ret = ffs_find_udc(g_ffs_udc, sizeof(g_ffs_udc));
+    if (ret < 0)
+    {
+        printf("No UDC found, set " USBG_FFS_UDC_ENV "\n");
+        goto fail;
+    }
+
+    printf("Bind to UDC %s\n", g_ffs_udc);
+    ret = ffs_write_attr(USBG_FFS_GADGET "/UDC", g_ffs_udc);
+    if (ret < 0)
+    {
+        goto fail;
+    }
+    g_ffs_bound = 1;
+
+    return 0;
+
+fail:
+    event_loop_del(g_ffs_ep0);
+    close(g_ffs_ep0);
+    g_ffs_ep0 = -1;
+
+    return ret;
+}
+
+/**
+ * Unbind the gadget and take it out of configfs
+ */
+void ffs_usb_stop(void)
+{
+    int iret;
+
+    printf("Stop USB FunctionFS\n");
+
+    if (g_ffs_bound)
+    {
+        ffs_write_attr(USBG_FFS_GADGET "/UDC", "\n");
+        g_ffs_bound = 0;
+    }
+
+    if (g_ffs_ep0 != -1)
+    {
+        event_loop_del(g_ffs_ep0);
+        close(g_ffs_ep0);
+        g_ffs_ep0 = -1;
+    }
+
+    iret = system("umount " USBG_FFS_MOUNT);
+    iret = iret;
+
+    unlink(USBG_FFS_GADGET "/configs/c.1/" USBG_FFS_FUNCTION);
+    rmdir(USBG_FFS_GADGET "/configs/c.1/strings/0x409");
+    rmdir(USBG_FFS_GADGET "/configs/c.1");
+    rmdir(USBG_FFS_GADGET "/functions/" USBG_FFS_FUNCTION);
+    rmdir(USBG_FFS_GADGET "/strings/0x409");
+    rmdir(USBG_FFS_GADGET);
+}
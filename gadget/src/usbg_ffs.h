@@ -0,0 +1,50 @@
+/**
+ * @brief FunctionFS backend of the USB service
+ *
+ * Selected with USBG_BACKEND=functionfs. The gadget is composed through
+ * configfs, so the TPM function can sit next to other functions, and is
+ * bound to the UDC in USBG_UDC, or the first one in /sys/class/udc. With
+ * dummy_hcd loaded this runs on any Linux box.
+ *
+ * @file usbg_ffs.h
+ */
+
+#ifndef USBG_FFS_H_
+#define USBG_FFS_H_
+
+#include <linux/usb/ch9.h>
+
+#define USBG_FFS_UDC_ENV    "USBG_UDC"
+#define USBG_FFS_CONFIGFS   "/sys/kernel/config"
+#define USBG_FFS_GADGET     USBG_FFS_CONFIGFS "/usb_gadget/tpm_proxy"
+#define USBG_FFS_FUNCTION   "ffs.tpm"
+#define USBG_FFS_INSTANCE   "tpm"
+#define USBG_FFS_MOUNT      "/dev/usb-ffs/tpm"
+#define USBG_FFS_UDC_CLASS  "/sys/class/udc"
+
+/**
+ * Compose the gadget in configfs and mount its FunctionFS instance
+ */
+void ffs_usb_mount(void);
+
+/**
+ * Write the descriptors, open the endpoints and bind the gadget to a UDC
+ *
+ * @return 0 - success, <0 - error
+ */
+int  ffs_usb_init(void);
+
+/**
+ * Unbind the gadget and take it out of configfs
+ */
+void ffs_usb_stop(void);
+
+/*
+ * Provided by usbg_service.c to the backends
+ */
+void usbg_set_ready(int ready);
+void usbg_set_speed(enum usb_device_speed speed);
+void usbg_set_ep_fds(int fd_in, int fd_out, int fd_tun_in, int fd_tun_out);
+void usbg_vendor_request(int fd, struct usb_ctrlrequest * setup);
+
+#endif /* USBG_FFS_H_ */
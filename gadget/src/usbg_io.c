@@ -0,0 +1,568 @@
+/**
+ * @brief Endpoint and TPM I/O engine
+ *
+ * Both engines use the raw system calls, the card has neither liburing
+ * nor libaio. Completions are reaped into the request table when the
+ * eventfd fires, or while usbg_io_sync() sleeps, and the callbacks run
+ * from the event loop.
+ *
+ * @file usbg_io.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+#include <linux/aio_abi.h>
+#ifdef USBG_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#include <stdint.h>
+
+#include "usbg_io.h"
+#include "event_loop.h"
+
+/* user_data of cancel requests, their completions are not requests */
+#define USBG_IO_CANCEL_TAG          (0xffffffffu)
+
+typedef struct {
+    int          busy;
+    int          done;
+    int          result;
+    usbg_io_cb_t cb;
+    void *       arg;
+    struct iocb  iocb;
+} usbg_io_req_t;
+
+/**
+ * Static variables
+ */
+static int           g_usbg_io_engine = USBG_IO_ENGINE_NONE;
+static int           g_usbg_io_efd    = -1;
+static usbg_io_req_t g_usbg_io_reqs[USBG_IO_NR_REQS];
+
+static aio_context_t g_usbg_aio_ctx   = 0;
+
+#ifdef USBG_IO_URING
+static struct {
+    int                  fd;
+    unsigned *           sq_head;
+    unsigned *           sq_tail;
+    unsigned *           sq_mask;
+    unsigned *           sq_array;
+    unsigned *           cq_head;
+    unsigned *           cq_tail;
+    unsigned *           cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *               sq_ptr;
+    size_t               sq_sz;
+    void *               cq_ptr;
+    size_t               cq_sz;
+    size_t               sqes_sz;
+} g_usbg_uring = { .fd = -1 };
+#endif
+
+
+/*
+ * A request completed, the callback runs on the next dispatch
+ */
+static void usbg_io_complete(uint64_t id, int result)
+{
+    usbg_io_req_t *req;
+
+    if ((id >= USBG_IO_NR_REQS) || !g_usbg_io_reqs[id].busy)
+    {
+        return;
+    }
+
+    req = &g_usbg_io_reqs[id];
+    req->done   = 1;
+    req->result = result;
+}
+
+#ifdef USBG_IO_URING
+static void usbg_uring_exit(void)
+{
+    if (g_usbg_uring.sqes)
+    {
+        munmap(g_usbg_uring.sqes, g_usbg_uring.sqes_sz);
+    }
+    if (g_usbg_uring.cq_ptr && (g_usbg_uring.cq_ptr != g_usbg_uring.sq_ptr))
+    {
+        munmap(g_usbg_uring.cq_ptr, g_usbg_uring.cq_sz);
+    }
+    if (g_usbg_uring.sq_ptr)
+    {
+        munmap(g_usbg_uring.sq_ptr, g_usbg_uring.sq_sz);
+    }
+    if (g_usbg_uring.fd != -1)
+    {
+        close(g_usbg_uring.fd);
+    }
+
+    memset(&g_usbg_uring, 0, sizeof(g_usbg_uring));
+    g_usbg_uring.fd = -1;
+}
+
+static int usbg_uring_init(void)
+{
+    struct io_uring_params p;
+    uint8_t *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    g_usbg_uring.fd = syscall(__NR_io_uring_setup, 2 * USBG_IO_NR_REQS, &p);
+    if (g_usbg_uring.fd < 0)
+    {
+        g_usbg_uring.fd = -1;
+        return -errno;
+    }
+
+    /* IORING_OP_READ/WRITE came along with fast poll, in 5.6 and 5.7 */
+    if (!(p.features & IORING_FEAT_FAST_POLL))
+    {
+        usbg_uring_exit();
+        return -ENOSYS;
+    }
+
+    g_usbg_uring.sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    g_usbg_uring.cq_sz = p.cq_off.cqes +
+            p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (g_usbg_uring.cq_sz > g_usbg_uring.sq_sz)
+        {
+            g_usbg_uring.sq_sz = g_usbg_uring.cq_sz;
+        }
+        g_usbg_uring.cq_sz = g_usbg_uring.sq_sz;
+    }
+
+    g_usbg_uring.sq_ptr = mmap(NULL, g_usbg_uring.sq_sz,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            g_usbg_uring.fd, IORING_OFF_SQ_RING);
+    if (g_usbg_uring.sq_ptr == MAP_FAILED)
+    {
+        g_usbg_uring.sq_ptr = NULL;
+        goto fail;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        g_usbg_uring.cq_ptr = g_usbg_uring.sq_ptr;
+    }
+    else
+    {
+        g_usbg_uring.cq_ptr = mmap(NULL, g_usbg_uring.cq_sz,
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                g_usbg_uring.fd, IORING_OFF_CQ_RING);
+        if (g_usbg_uring.cq_ptr == MAP_FAILED)
+        {
+            g_usbg_uring.cq_ptr = NULL;
+            goto fail;
+        }
+    }
+
+    g_usbg_uring.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    g_usbg_uring.sqes = mmap(NULL, g_usbg_uring.sqes_sz,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            g_usbg_uring.fd, IORING_OFF_SQES);
+    if (g_usbg_uring.sqes == MAP_FAILED)
+    {
+        g_usbg_uring.sqes = NULL;
+        goto fail;
+    }
+
+    sq = g_usbg_uring.sq_ptr;
+    cq = g_usbg_uring.cq_ptr;
+    g_usbg_uring.sq_head  = (unsigned *)(sq + p.sq_off.head);
+    g_usbg_uring.sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    g_usbg_uring.sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    g_usbg_uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    g_usbg_uring.cq_head  = (unsigned *)(cq + p.cq_off.head);
+    g_usbg_uring.cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    g_usbg_uring.cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    g_usbg_uring.cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    if (syscall(__NR_io_uring_register, g_usbg_uring.fd,
+                IORING_REGISTER_EVENTFD, &g_usbg_io_efd, 1) < 0)
+    {
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    usbg_uring_exit();
+    return -ENOMEM;
+}
+
+/*
+ * Queue one SQE and hand it to the kernel
+ */
+static int usbg_uring_push(uint8_t opcode, int fd, uint64_t addr,
+                           uint32_t len, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+    long     ret;
+
+    tail = *g_usbg_uring.sq_tail;
+    idx  = tail & *g_usbg_uring.sq_mask;
+    sqe  = &g_usbg_uring.sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = opcode;
+    sqe->fd        = fd;
+    sqe->addr      = addr;
+    sqe->len       = len;
+    sqe->user_data = user_data;
+
+    g_usbg_uring.sq_array[idx] = idx;
+    __atomic_store_n(g_usbg_uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ret = syscall(__NR_io_uring_enter, g_usbg_uring.fd, 1, 0, 0, NULL, 0);
+    if (ret != 1)
+    {
+        /* Not consumed, there is no SQ polling thread to race with */
+        __atomic_store_n(g_usbg_uring.sq_tail, tail, __ATOMIC_RELEASE);
+        return (ret < 0) ? -errno : -EAGAIN;
+    }
+
+    return 0;
+}
+
+static void usbg_uring_reap(void)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head;
+
+    head = *g_usbg_uring.cq_head;
+    while (head != __atomic_load_n(g_usbg_uring.cq_tail, __ATOMIC_ACQUIRE))
+    {
+        cqe = &g_usbg_uring.cqes[head & *g_usbg_uring.cq_mask];
+        usbg_io_complete(cqe->user_data, cqe->res);
+        head++;
+    }
+    __atomic_store_n(g_usbg_uring.cq_head, head, __ATOMIC_RELEASE);
+}
+#endif /* USBG_IO_URING */
+
+static int usbg_aio_init(void)
+{
+    g_usbg_aio_ctx = 0;
+    if (syscall(__NR_io_setup, USBG_IO_NR_REQS, &g_usbg_aio_ctx) < 0)
+    {
+        g_usbg_aio_ctx = 0;
+        return -errno;
+    }
+
+    return 0;
+}
+
+static void usbg_aio_reap(const struct timespec *ts, long min_nr)
+{
+    struct io_event ev[USBG_IO_NR_REQS];
+    long            i, n;
+
+    n = syscall(__NR_io_getevents, g_usbg_aio_ctx, min_nr, USBG_IO_NR_REQS,
+            ev, ts);
+    for (i = 0; i < n; i++)
+    {
+        usbg_io_complete(ev[i].data, (int)ev[i].res);
+    }
+}
+
+static void usbg_io_reap(void)
+{
+    struct timespec ts = { 0, 0 };
+
+#ifdef USBG_IO_URING
+    if (g_usbg_io_engine == USBG_IO_ENGINE_URING)
+    {
+        usbg_uring_reap();
+        return;
+    }
+#endif
+
+    usbg_aio_reap(&ts, 0);
+}
+
+/*
+ * Sleep until at least one more request completes
+ */
+static void usbg_io_wait(void)
+{
+#ifdef USBG_IO_URING
+    if (g_usbg_io_engine == USBG_IO_ENGINE_URING)
+    {
+        syscall(__NR_io_uring_enter, g_usbg_uring.fd, 0, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0);
+        usbg_uring_reap();
+        return;
+    }
+#endif
+
+    usbg_aio_reap(NULL, 1);
+}
+
+/*
+ * Completions, called from the event loop
+ */
+static void usbg_io_event(int fd, uint32_t events, void *arg)
+{
+    usbg_io_req_t *req;
+    uint64_t       count;
+    int            i;
+
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+    {
+        return;
+    }
+
+    usbg_io_reap();
+
+    for (i = 0; i < USBG_IO_NR_REQS; i++)
+    {
+        req = &g_usbg_io_reqs[i];
+
+        /* usbg_io_sync() waits for requests without callback itself */
+        if (!req->busy || !req->done || !req->cb)
+        {
+            continue;
+        }
+
+        req->busy = 0;
+        req->done = 0;
+        req->cb(req->result, req->arg);
+    }
+}
+
+int usbg_io_engine(void)
+{
+    return g_usbg_io_engine;
+}
+
+/**
+ * Start the engine, io_uring first, then kernel AIO
+ *
+ * @return 0 - success, <0 - error
+ */
+int usbg_io_init(void)
+{
+    int ret;
+
+    memset(g_usbg_io_reqs, 0, sizeof(g_usbg_io_reqs));
+
+    g_usbg_io_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (g_usbg_io_efd < 0)
+    {
+        perror("eventfd");
+        return -errno;
+    }
+
+#ifdef USBG_IO_URING
+    if (usbg_uring_init() == 0)
+    {
+        g_usbg_io_engine = USBG_IO_ENGINE_URING;
+    }
+#endif
+
+    if ((g_usbg_io_engine == USBG_IO_ENGINE_NONE) && (usbg_aio_init() == 0))
+    {
+        g_usbg_io_engine = USBG_IO_ENGINE_AIO;
+    }
+
+    if (g_usbg_io_engine == USBG_IO_ENGINE_NONE)
+    {
+        printf("No I/O engine (%m)\n");
+        ret = -ENOSYS;
+        goto fail;
+    }
+
+    ret = event_loop_add(g_usbg_io_efd, EPOLLIN, usbg_io_event, NULL);
+    if (ret < 0)
+    {
+        usbg_io_deinit();
+        return ret;
+    }
+
+    printf("I/O engine %s\n",
+            (g_usbg_io_engine == USBG_IO_ENGINE_URING) ? "io_uring" : "aio");
+
+    return 0;
+
+fail:
+    close(g_usbg_io_efd);
+    g_usbg_io_efd = -1;
+    return ret;
+}
+
+/**
+ * Stop the engine, queued requests are canceled without callbacks
+ */
+void usbg_io_deinit(void)
+{
+    int i;
+
+    for (i = 0; i < USBG_IO_NR_REQS; i++)
+    {
+        if (g_usbg_io_reqs[i].busy && !g_usbg_io_reqs[i].done)
+        {
+            usbg_io_cancel(i);
+        }
+    }
+
+    /* Both wait for the requests still in the kernel */
+#ifdef USBG_IO_URING
+    if (g_usbg_io_engine == USBG_IO_ENGINE_URING)
+    {
+        usbg_uring_exit();
+    }
+#endif
+
+    if (g_usbg_aio_ctx)
+    {
+        syscall(__NR_io_destroy, g_usbg_aio_ctx);
+        g_usbg_aio_ctx = 0;
+    }
+
+    g_usbg_io_engine = USBG_IO_ENGINE_NONE;
+    memset(g_usbg_io_reqs, 0, sizeof(g_usbg_io_reqs));
+
+    if (g_usbg_io_efd != -1)
+    {
+        event_loop_del(g_usbg_io_efd);
+        close(g_usbg_io_efd);
+        g_usbg_io_efd = -1;
+    }
+}
+
+int usbg_io_submit(int fd, int write, void * buf, int len,
+                   usbg_io_cb_t cb, void * arg)
+{
+    struct iocb   *iocbs[1];
+    usbg_io_req_t *req;
+    int            id, ret;
+
+    for (id = 0; id < USBG_IO_NR_REQS; id++)
+    {
+        if (!g_usbg_io_reqs[id].busy)
+        {
+            break;
+        }
+    }
+
+    if (id == USBG_IO_NR_REQS)
+    {
+        return -EBUSY;
+    }
+
+    req = &g_usbg_io_reqs[id];
+    memset(req, 0, sizeof(*req));
+    req->cb  = cb;
+    req->arg = arg;
+
+    switch (g_usbg_io_engine)
+    {
+#ifdef USBG_IO_URING
+    case USBG_IO_ENGINE_URING:
+        ret = usbg_uring_push(write ? IORING_OP_WRITE : IORING_OP_READ, fd,
+                (uintptr_t)buf, len, id);
+        break;
+#endif
+
+    case USBG_IO_ENGINE_AIO:
+        req->iocb.aio_data       = id;
+        req->iocb.aio_fildes     = fd;
+        req->iocb.aio_lio_opcode = write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+        req->iocb.aio_buf        = (uintptr_t)buf;
+        req->iocb.aio_nbytes     = len;
+        req->iocb.aio_flags      = IOCB_FLAG_RESFD;
+        req->iocb.aio_resfd      = g_usbg_io_efd;
+
+        iocbs[0] = &req->iocb;
+        ret = (syscall(__NR_io_submit, g_usbg_aio_ctx, 1, iocbs) == 1) ?
+                0 : -errno;
+        break;
+
+    default:
+        ret = -ENODEV;
+        break;
+    }
+
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    req->busy = 1;
+
+    return id;
+}
+
+int usbg_io_sync(int fd, int write, void * buf, int len)
+{
+    usbg_io_req_t *req;
+    int            id, result;
+
+    id = usbg_io_submit(fd, write, buf, len, NULL, NULL);
+    if (id < 0)
+    {
+        return id;
+    }
+
+    req = &g_usbg_io_reqs[id];
+    while (!req->done && (g_usbg_io_engine != USBG_IO_ENGINE_NONE))
+    {
+        usbg_io_wait();
+    }
+
+    result = req->done ? req->result : -ECANCELED;
+    req->busy = 0;
+    req->done = 0;
+
+    return result;
+}
+
+void usbg_io_cancel(int id)
+{
+    struct io_event ev;
+    uint64_t        one = 1;
+
+    if ((id < 0) || (id >= USBG_IO_NR_REQS) || !g_usbg_io_reqs[id].busy)
+    {
+        return;
+    }
+
+    switch (g_usbg_io_engine)
+    {
+#ifdef USBG_IO_URING
+    case USBG_IO_ENGINE_URING:
+        usbg_uring_push(IORING_OP_ASYNC_CANCEL, -1, id, 0, USBG_IO_CANCEL_TAG);
+        break;
+#endif
+
+    case USBG_IO_ENGINE_AIO:
+        /* Older kernels hand the event back here instead of the ring */
+        if (syscall(__NR_io_cancel, g_usbg_aio_ctx,
+                    &g_usbg_io_reqs[id].iocb, &ev) == 0)
+        {
+            usbg_io_complete(id, -ECANCELED);
+            if (write(g_usbg_io_efd, &one, sizeof(one)) < 0)
+            {
+                /* Dispatched with the next completion */
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+}
@@ -0,0 +1,90 @@
+/**
+ * @brief Endpoint and TPM I/O engine
+ *
+ * Reads and writes are queued to io_uring, or to kernel AIO when io_uring
+ * is not available, and complete through an eventfd of the event loop.
+ * Nothing spins, waiting is done in the kernel.
+ *
+ * @file usbg_io.h
+ */
+
+#ifndef USBG_IO_H_
+#define USBG_IO_H_
+
+#include <stdint.h>
+
+#define USBG_IO_NR_REQS             (8)
+
+enum {
+    USBG_IO_ENGINE_NONE = 0,
+    USBG_IO_ENGINE_URING,
+    USBG_IO_ENGINE_AIO,
+};
+
+/**
+ * I/O completion
+ *
+ * @param result  - Bytes transferred, <0 - error
+ *
+ * @param arg     - Argument given with the request
+ */
+typedef void (*usbg_io_cb_t)(int result, void * arg);
+
+/**
+ * Start the engine, io_uring first, then kernel AIO
+ *
+ * @return 0 - success, <0 - error
+ */
+int  usbg_io_init(void);
+
+/**
+ * Stop the engine, queued requests are canceled without callbacks
+ */
+void usbg_io_deinit(void);
+
+/**
+ * Return the engine in use
+ *
+ * @return USBG_IO_ENGINE_*
+ */
+int  usbg_io_engine(void);
+
+/**
+ * Queue a read or write
+ *
+ * Kernel AIO only takes endpoint files, io_uring any file.
+ *
+ * @param fd    - File descriptor
+ *
+ * @param write - 1 - write, 0 - read
+ *
+ * @param buf   - Data, valid until the callback
+ *
+ * @param len   - Length in bytes
+ *
+ * @param cb    - Called from the event loop once the request completes
+ *
+ * @param arg   - Argument to the callback
+ *
+ * @return request id, <0 - error
+ */
+int  usbg_io_submit(int fd, int write, void * buf, int len,
+                    usbg_io_cb_t cb, void * arg);
+
+/**
+ * Read or write, sleeping until the request completes
+ *
+ * Completions of other requests are still delivered by the event loop.
+ *
+ * @return bytes transferred, <0 - error
+ */
+int  usbg_io_sync(int fd, int write, void * buf, int len);
+
+/**
+ * Cancel a queued request, its callback still runs with the outcome
+ *
+ * @param id    - Request id from usbg_io_submit()
+ */
+void usbg_io_cancel(int id);
+
+#endif /* USBG_IO_H_ */
@@ -17,7 +17,6 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/ioctl.h>
-#include <aio.h>
 
 #include <linux/types.h>
 #include <linux/usb/ch9.h>
@@ -28,6 +27,9 @@
 #include <string.h>
 #include "usbg_service.h"
 #include "usbstring.h"
+#include "event_loop.h"
+#include "usbg_io.h"
+#include "usbg_ffs.h"
 
 
 static struct usb_string stringtab [] = {
@@ -62,11 +64,42 @@ struct io_thread_args {
 static struct io_thread_args g_usbg_io_thread_args = \
         { 1, -1, -1, -1, -1 };
 
-static pthread_t g_thread_ep0_handler;
 static int       g_fd_usb_gadget;
 static int       g_aio_read_async = 0;
-struct aiocb     g_aiocb_async_read;
-/* static pthread_t g_usbg_io_thread; */
+static int       g_usbg_max_packet = USBG_FS_MAX_PACKET;
+static int       g_usbg_tun_read_id  = -1;
+static int       g_usbg_tun_read_res = 0;
+static usbg_vendor_handler_t g_usbg_vendor_handler = NULL;
+static usbg_state_handler_t  g_usbg_state_handler  = NULL;
+
+/*
+ * Endpoint files cannot be polled, so reads on the bulk OUT endpoint are
+ * queued to the I/O engine. Several stay queued so the next command never
+ * waits for a read to be submitted. io_uring may hand them to its workers,
+ * which reach the endpoint in any order, so transfers are handed out in
+ * the order the reads complete, not the one they were queued in.
+ */
+typedef struct {
+    uint8_t *buf;
+    int      id;
+    int      done;
+    int      result;
+} usbg_rx_buf_t;
+
+static struct {
+    usbg_rx_buf_t bufs[USBG_RX_NR_BUFS];
+    int           nbufs;
+    int           size;
+    int           order[USBG_RX_NR_BUFS];   /* Completed, oldest first */
+    int           ndone;
+    int           held;                     /* With the consumer, or -1 */
+    int           delivering;
+    usbg_rx_cb_t  cb;
+} g_usbg_rx;
+
+static int       g_usbg_ffs = 0;
+
+static void usbg_rx_done(int result, void *arg);
 
 /**
  * Bringup GadgetFS
@@ -74,6 +107,14 @@ struct aiocb     g_aiocb_async_read;
 void gadgetfs_usb_mount(void)
 {
     int iret;
+    const char *backend = getenv(USBG_BACKEND_ENV);
+
+    g_usbg_ffs = backend && !strcmp(backend, "functionfs");
+    if (g_usbg_ffs)
+    {
+        ffs_usb_mount();
+        return;
+    }
 
     printf("Prepare USB GadgetFS\n");
 
@@ -122,8 +163,6 @@ int gadgetfs_io_is_ready(void)
 int gadgetfs_io_write(void * pdata, int len, int * pexit_req)
 {
     int iret;
-    struct aiocb aiocb;
-    int err;
 
     if (g_usbg_io_thread_args.stop)
     {
@@ -148,41 +187,13 @@ int gadgetfs_io_write(void * pdata, int len, int * pexit_req)
 int gadgetfs_io_write2(void * pdata, int len, int * pexit_req)
 {
     int iret;
-    struct aiocb aiocb;
-    int err;
 
-    if (g_usbg_io_thread_args.stop)
+    if (g_usbg_io_thread_args.stop || *pexit_req)
     {
         return -EPERM;
     }
 
-    memset(&aiocb, 0, sizeof(struct aiocb));
-    aiocb.aio_fildes     = g_usbg_io_thread_args.fd_in;
-    aiocb.aio_buf        = pdata;
-    aiocb.aio_nbytes     = len;
-    aiocb.aio_lio_opcode = LIO_WRITE;
-
-    if (aio_write(&aiocb) == -1) {
-        return 0;
-    }
-
-    /* Wait until end of transaction */
-    while (((err = aio_error (&aiocb)) == EINPROGRESS) && (*pexit_req == 0));
-
-    /**
-     * Exit requested
-     */
-    if (*pexit_req)
-    {
-        return -EPERM;
-    }
-
-    err = aio_error(&aiocb);
-    iret = aio_return(&aiocb);
-
-    if (err != 0) {
-        return 0;
-    }
+    iret = usbg_io_sync(g_usbg_io_thread_args.fd_in, 1, pdata, len);
 
     if (iret != len) {
         return 0;
@@ -203,41 +214,13 @@ int gadgetfs_io_write2(void * pdata, int len, int * pexit_req)
 int gadgetfs_io_tun_write(void * pdata, int len, int * pexit_req)
 {
     int iret;
-    struct aiocb aiocb;
-    int err;
-
-    if (g_usbg_io_thread_args.stop)
-    {
-        return -EPERM;
-    }
 
-    memset(&aiocb, 0, sizeof(struct aiocb));
-    aiocb.aio_fildes     = g_usbg_io_thread_args.fd_tun_in;
-    aiocb.aio_buf        = pdata;
-    aiocb.aio_nbytes     = len;
-    aiocb.aio_lio_opcode = LIO_WRITE;
-
-    if (aio_write(&aiocb) == -1) {
-        return 0;
-    }
-
-    /* Wait until end of transaction */
-    while (((err = aio_error (&aiocb)) == EINPROGRESS) && (*pexit_req == 0));
-
-    /**
-     * Exit requested
-     */
-    if (*pexit_req)
+    if (g_usbg_io_thread_args.stop || *pexit_req)
     {
         return -EPERM;
     }
 
-    err = aio_error(&aiocb);
-    iret = aio_return(&aiocb);
-
-    if (err != 0) {
-        return 0;
-    }
+    iret = usbg_io_sync(g_usbg_io_thread_args.fd_tun_in, 1, pdata, len);
 
     if (iret != len) {
         return 0;
@@ -258,41 +241,13 @@ int gadgetfs_io_tun_write(void * pdata, int len, int * pexit_req)
 int gadgetfs_io_read(void * pdata, int len, int * pexit_req)
 {
     int iret;
-    struct aiocb aiocb;
-    int err;
 
-    if (g_usbg_io_thread_args.stop)
+    if (g_usbg_io_thread_args.stop || *pexit_req)
     {
         return -EPERM;
     }
 
-    memset(&aiocb, 0, sizeof(struct aiocb));
-    aiocb.aio_fildes     = g_usbg_io_thread_args.fd_out;
-    aiocb.aio_buf        = pdata;
-    aiocb.aio_nbytes     = len;
-    aiocb.aio_lio_opcode = LIO_READ;
-
-    if (aio_read(&aiocb) == -1) {
-        return 0;
-    }
-
-    /* Wait until end of transaction */
-    while (((err = aio_error (&aiocb)) == EINPROGRESS) && (*pexit_req == 0));
-
-    /**
-     * Exit requested
-     */
-    if (*pexit_req)
-    {
-        return -EPERM;
-    }
-
-    err = aio_error(&aiocb);
-    iret = aio_return(&aiocb);
-
-    if (err != 0) {
-        return 0;
-    }
+    iret = usbg_io_sync(g_usbg_io_thread_args.fd_out, 0, pdata, len);
 
     if (iret != len) {
         return 0;
@@ -313,8 +268,6 @@ int gadgetfs_io_read(void * pdata, int len, int * pexit_req)
 int gadgetfs_io_tun_read(void * pdata, int len, int * pexit_req)
 {
     int iret;
-    struct aiocb aiocb;
-    int err;
 
     if (g_usbg_io_thread_args.stop)
     {
@@ -326,37 +279,29 @@ int gadgetfs_io_tun_read(void * pdata, int len, int * pexit_req)
         return -EINVAL;
     }
 
-    memset(&aiocb, 0, sizeof(struct aiocb));
-    aiocb.aio_fildes     = g_usbg_io_thread_args.fd_tun_out;
-    aiocb.aio_buf        = pdata;
-    aiocb.aio_nbytes     = len;
-    aiocb.aio_lio_opcode = LIO_READ;
-
-    if (aio_read(&aiocb) == -1) {
-        return 0;
-    }
-
-    /* Wait until end of transaction */
-    while (((err = aio_error (&aiocb)) == EINPROGRESS) && (*pexit_req == 0));
-
-    /**
-     * Exit requested
-     */
     if (*pexit_req)
     {
         return -EPERM;
     }
 
-    err = aio_error(&aiocb);
-    iret = aio_return(&aiocb);
+    iret = usbg_io_sync(g_usbg_io_thread_args.fd_tun_out, 0, pdata, len);
 
-    if (err != 0) {
+    if (iret < 0) {
         return 0;
     }
 
     return iret;
 }
 
+/*
+ * Completion of the TUN read queued by gadgetfs_io_tun_read_async()
+ */
+static void usbg_tun_read_done(int result, void *arg)
+{
+    g_usbg_tun_read_res = result;
+    g_aio_read_async    = 2;
+}
+
 /**
  * USB Gadget IO read TUN async
  *
@@ -369,7 +314,6 @@ int gadgetfs_io_tun_read(void * pdata, int len, int * pexit_req)
 int gadgetfs_io_tun_read_async(void * pdata, int len, int * pexit_req)
 {
     int          iret = 0;
-    int          err;
 
     if (g_usbg_io_thread_args.stop)
     {
@@ -383,13 +327,9 @@ int gadgetfs_io_tun_read_async(void * pdata, int len, int * pexit_req)
 
     if (g_aio_read_async == 0)
     {
-        memset(&g_aiocb_async_read, 0, sizeof(struct aiocb));
-        g_aiocb_async_read.aio_fildes     = g_usbg_io_thread_args.fd_tun_out;
-        g_aiocb_async_read.aio_buf        = pdata;
-        g_aiocb_async_read.aio_nbytes     = len;
-        g_aiocb_async_read.aio_lio_opcode = LIO_READ;
-
-        if (aio_read(&g_aiocb_async_read) == -1) {
+        g_usbg_tun_read_id = usbg_io_submit(g_usbg_io_thread_args.fd_tun_out,
+                0, pdata, len, usbg_tun_read_done, NULL);
+        if (g_usbg_tun_read_id < 0) {
             return 0;
         }
 
@@ -398,27 +338,17 @@ int gadgetfs_io_tun_read_async(void * pdata, int len, int * pexit_req)
 
     if (g_aio_read_async == 1)
     {
-        /* Wait until end of transaction */
-        if (((err = aio_error (&g_aiocb_async_read)) == EINPROGRESS) &&
-             (*pexit_req == 0))
-        {
-            return -EBUSY;
-        }
-
         /**
-         * Exit requested
+         * Exit requested, the completion still comes through the loop
          */
         if (*pexit_req)
         {
-            g_aio_read_async = 0;
-            aio_cancel(
-                    g_usbg_io_thread_args.fd_tun_out,
-                    &g_aiocb_async_read);
-
+            usbg_io_cancel(g_usbg_tun_read_id);
             return -EPERM;
         }
 
-        g_aio_read_async = 2;
+        /* Completed from the event loop */
+        return -EBUSY;
     }
 
     if (g_aio_read_async == 2)
@@ -431,12 +361,11 @@ int gadgetfs_io_tun_read_async(void * pdata, int len, int * pexit_req)
             return -EPERM;
         }
 
-        err = aio_error(&g_aiocb_async_read);
-        iret = aio_return(&g_aiocb_async_read);
+        iret = g_usbg_tun_read_res;
 
         g_aio_read_async = 0;
 
-        if (err != 0) {
+        if (iret < 0) {
             return 0;
         }
     }
@@ -459,6 +388,241 @@ int  gadgetfs_io_get_write_fd(void)
     return g_usbg_io_thread_args.fd_in;
 }
 
+int  gadgetfs_io_get_max_packet(void)
+{
+    return g_usbg_max_packet;
+}
+
+void gadgetfs_set_vendor_handler(usbg_vendor_handler_t handler)
+{
+    g_usbg_vendor_handler = handler;
+}
+
+void gadgetfs_set_state_handler(usbg_state_handler_t handler)
+{
+    g_usbg_state_handler = handler;
+}
+
+/*
+ * Queue the read of one receive buffer
+ */
+static void usbg_rx_post(usbg_rx_buf_t *rx)
+{
+    if (g_usbg_io_thread_args.stop || (rx->id >= 0) || rx->done)
+    {
+        return;
+    }
+
+    rx->id = usbg_io_submit(g_usbg_io_thread_args.fd_out, 0, rx->buf,
+            g_usbg_rx.size, usbg_rx_done, rx);
+    if (rx->id < 0)
+    {
+        usbsg_debug("Read submit error %d\n", rx->id);
+        rx->id = -1;
+    }
+}
+
+/*
+ * Hand the completed reads to the consumer in completion order, one at a time
+ */
+static void usbg_rx_deliver(void)
+{
+    usbg_rx_buf_t *rx;
+    int            idx;
+
+    /* gadgetfs_io_rx_release() from the callback continues this loop */
+    if (g_usbg_rx.delivering)
+    {
+        return;
+    }
+
+    g_usbg_rx.delivering = 1;
+
+    while (g_usbg_rx.cb && (g_usbg_rx.held < 0) && (g_usbg_rx.ndone > 0))
+    {
+        idx = g_usbg_rx.order[0];
+        g_usbg_rx.ndone--;
+        memmove(&g_usbg_rx.order[0], &g_usbg_rx.order[1],
+                g_usbg_rx.ndone * sizeof(g_usbg_rx.order[0]));
+
+        rx = &g_usbg_rx.bufs[idx];
+        g_usbg_rx.held = idx;
+        g_usbg_rx.cb(rx->result, rx->buf);
+    }
+
+    g_usbg_rx.delivering = 0;
+}
+
+static void usbg_rx_done(int result, void *arg)
+{
+    usbg_rx_buf_t *rx = arg;
+
+    rx->id     = -1;
+    rx->done   = 1;
+    rx->result = result;
+
+    g_usbg_rx.order[g_usbg_rx.ndone++] = rx - g_usbg_rx.bufs;
+
+    usbg_rx_deliver();
+}
+
+/*
+ * Queue every idle receive buffer
+ */
+static void usbg_rx_post_all(void)
+{
+    int i;
+
+    for (i = 0; i < g_usbg_rx.nbufs; i++)
+    {
+        usbg_rx_post(&g_usbg_rx.bufs[i]);
+    }
+}
+
+/**
+ * Keep USBG_RX_NR_BUFS reads queued on the USB OUT endpoint
+ *
+ * @param size  - Size of each receive buffer
+ *
+ * @param cb    - Gets each transfer from the event loop, in completion order
+ *
+ * @return 0 - success, <0 - error
+ */
+int gadgetfs_io_rx_start(int size, usbg_rx_cb_t cb)
+{
+    int i;
+
+    memset(&g_usbg_rx, 0, sizeof(g_usbg_rx));
+    g_usbg_rx.held = -1;
+
+    for (i = 0; i < USBG_RX_NR_BUFS; i++)
+    {
+        g_usbg_rx.bufs[i].id  = -1;
+        g_usbg_rx.bufs[i].buf = malloc(size);
+        if (!g_usbg_rx.bufs[i].buf)
+        {
+            gadgetfs_io_rx_stop();
+            return -ENOMEM;
+        }
+        g_usbg_rx.nbufs++;
+    }
+
+    g_usbg_rx.size = size;
+    g_usbg_rx.cb   = cb;
+
+    usbg_rx_post_all();
+
+    return 0;
+}
+
+/**
+ * Give back the buffer of the last transfer, the next one follows
+ */
+void gadgetfs_io_rx_release(void)
+{
+    usbg_rx_buf_t *rx;
+
+    if (g_usbg_rx.held < 0)
+    {
+        return;
+    }
+
+    rx = &g_usbg_rx.bufs[g_usbg_rx.held];
+    rx->done = 0;
+    g_usbg_rx.held = -1;
+
+    /* Queued behind the others, unless the host is gone */
+    usbg_rx_post(rx);
+
+    usbg_rx_deliver();
+}
+
+/**
+ * Stop handing out transfers, the reads still queued are dropped
+ */
+void gadgetfs_io_rx_stop(void)
+{
+    int i;
+
+    for (i = 0; i < USBG_RX_NR_BUFS; i++)
+    {
+        if (g_usbg_rx.bufs[i].id >= 0)
+        {
+            usbg_io_cancel(g_usbg_rx.bufs[i].id);
+        }
+    }
+
+    g_usbg_rx.cb = NULL;
+}
+
+/*
+ * The buffers stay allocated until the engine is gone
+ */
+static void usbg_rx_free(void)
+{
+    int i;
+
+    for (i = 0; i < USBG_RX_NR_BUFS; i++)
+    {
+        free(g_usbg_rx.bufs[i].buf);
+    }
+
+    memset(&g_usbg_rx, 0, sizeof(g_usbg_rx));
+    g_usbg_rx.held = -1;
+}
+
+/*
+ * Track the configured state and tell the state handler about changes
+ */
+void usbg_set_ready(int ready)
+{
+    if (g_usbg_io_thread_args.stop == !ready)
+    {
+        return;
+    }
+
+    g_usbg_io_thread_args.stop = !ready;
+
+    /* Reads are queued before the host sends its first command */
+    if (ready)
+    {
+        usbg_rx_post_all();
+    }
+
+    if (g_usbg_state_handler)
+    {
+        g_usbg_state_handler(ready);
+    }
+}
+
+/*
+ * Bulk packet size of the connected speed
+ */
+void usbg_set_speed(enum usb_device_speed speed)
+{
+    switch (speed)
+    {
+    case USB_SPEED_HIGH:
+        g_usbg_max_packet = 512;
+        break;
+    case USB_SPEED_SUPER:
+        g_usbg_max_packet = 1024;
+        break;
+    default:
+        g_usbg_max_packet = USBG_FS_MAX_PACKET;
+        break;
+    }
+}
+
+void usbg_set_ep_fds(int fd_in, int fd_out, int fd_tun_in, int fd_tun_out)
+{
+    g_usbg_io_thread_args.fd_in      = fd_in;
+    g_usbg_io_thread_args.fd_out     = fd_out;
+    g_usbg_io_thread_args.fd_tun_in  = fd_tun_in;
+    g_usbg_io_thread_args.fd_tun_out = fd_tun_out;
+}
+
+
 void gadgetfs_io_tun_read_async_cancel(void)
 {
 
@@ -680,6 +844,59 @@ end:
     return ret;
 }
 
+/*
+ * Vendor requests go to the registered handler, see usbg_vendor_handler_t
+ */
+void usbg_vendor_request(int fd, struct usb_ctrlrequest* setup)
+{
+    int     status, len;
+    int     dir_in = (setup->bRequestType & USB_DIR_IN) ? 1 : 0;
+    uint8_t buffer[512];
+    usbg_vendor_handler_t handler = g_usbg_vendor_handler;
+
+    len = setup->wLength;
+    if (len > (int)sizeof(buffer))
+    {
+        len = sizeof(buffer);
+    }
+
+    if (!handler)
+    {
+        goto stall;
+    }
+
+    /* Host to device data comes first */
+    if (!dir_in && len && (read(fd, buffer, len) != len))
+    {
+        usbsg_debug("Vendor request %d data error (%m)\n", setup->bRequest);
+        return;
+    }
+
+    status = handler(setup->bRequest, setup->wValue, dir_in, buffer, len);
+    if (status < 0)
+    {
+        goto stall;
+    }
+
+    if (dir_in)
+    {
+        write(fd, buffer, status);
+    }
+    else if (!len)
+    {
+        // ACK
+        status = read(fd, &status, 0);
+    }
+    return;
+
+stall:
+    usbsg_debug("Vendor request %d stalled\n", setup->bRequest);
+    if (dir_in)
+        read(fd, &status, 0);
+    else
+        write(fd, &status, 0);
+}
+
 static void handle_setup_request(int fd, struct usb_ctrlrequest* setup)
 {
     int     status;
@@ -687,6 +904,12 @@ static void handle_setup_request(int fd, struct usb_ctrlrequest* setup)
 
     usbsg_debug("Setup request %d\n", setup->bRequest);
 
+    if ((setup->bRequestType & USB_TYPE_MASK) == USB_TYPE_VENDOR)
+    {
+        usbg_vendor_request(fd, setup);
+        return;
+    }
+
     switch (setup->bRequest)
     {
     case USB_REQ_GET_DESCRIPTOR:
@@ -737,17 +960,14 @@ static void handle_setup_request(int fd, struct usb_ctrlrequest* setup)
 
             if ((!status) && (g_usbg_io_thread_args.stop))
             {
-                /* usbg_io_prepare(&g_usbg_io_thread_args); */
                 printf("usbg xcomm started\n");
-                g_usbg_io_thread_args.stop = 0;
-                /* pthread_create(&g_usbg_io_thread, NULL,
-                        usbg_io_thread, &g_usbg_io_thread_args); */
+                usbg_set_ready(1);
             }
 
             break;
         case 0:
-            usbsg_debug("Disable threads\n");
-            g_usbg_io_thread_args.stop = 1;
+            usbsg_debug("Disable IO\n");
+            usbg_set_ready(0);
             break;
         default:
             usbsg_debug("Unhandled configuration value %d\n", setup->wValue);
@@ -779,65 +999,49 @@ stall:
         write (fd, &status, 0);
 }
 
-static void *handle_ep0_thread(void *arg)
+/*
+ * ep0 events, called from the event loop
+ */
+static void handle_ep0_event(int fd, uint32_t events, void *arg)
 {
     int    ret, nevents, i;
-    fd_set read_set;
-    struct usb_gadgetfs_event events[5];
-    int    fd = 0;
+    struct usb_gadgetfs_event ep0_events[5];
 
-    printf("handle_ep0_thread+\n");
+    ret = read(fd, &ep0_events, sizeof(ep0_events));
 
-    if (arg)
+    if (ret < 0)
     {
-        fd = *(int *)arg;
-    } else {
-        printf("Fail to get fd\n");
-        return NULL;
+        usbsg_debug("Read error %d (%m)\n", ret);
+        printf("ep0 closed\n");
+        event_loop_del(fd);
+        return;
     }
+    nevents = ret / sizeof(ep0_events[0]);
 
-    while (1)
-    {
-        FD_ZERO(&read_set);
-        FD_SET(fd, &read_set);
+    usbsg_debug("%d event(s)\n", nevents);
 
-        select(fd + 1, &read_set, NULL, NULL, NULL);
-
-        ret = read(fd, &events, sizeof(events));
-
-        if (ret < 0)
-        {
-            usbsg_debug("Read error %d (%m)\n", ret);
-            goto end;
-        }
-        nevents = ret / sizeof(events[0]);
-
-        usbsg_debug("%d event(s)\n", nevents);
-
-        for (i = 0; i < nevents; i++)
+    for (i = 0; i < nevents; i++)
+    {
+        switch (ep0_events[i].type)
         {
-            switch (events[i].type)
-            {
-            case GADGETFS_CONNECT:
-                usbsg_debug("EP0 CONNECT\n");
-                break;
-            case GADGETFS_DISCONNECT:
-                usbsg_debug("EP0 DISCONNECT\n");
-                break;
-            case GADGETFS_SETUP:
-                usbsg_debug("EP0 SETUP\n");
-                handle_setup_request(fd, &events[i].u.setup);
-                break;
-            case GADGETFS_NOP:
-            case GADGETFS_SUSPEND:
-                break;
-            }
+        case GADGETFS_CONNECT:
+            usbsg_debug("EP0 CONNECT, speed %d\n", ep0_events[i].u.speed);
+            usbg_set_speed(ep0_events[i].u.speed);
+            break;
+        case GADGETFS_DISCONNECT:
+            usbsg_debug("EP0 DISCONNECT\n");
+            usbg_set_speed(USB_SPEED_UNKNOWN);
+            usbg_set_ready(0);
+            break;
+        case GADGETFS_SETUP:
+            usbsg_debug("EP0 SETUP\n");
+            handle_setup_request(fd, &ep0_events[i].u.setup);
+            break;
+        case GADGETFS_NOP:
+        case GADGETFS_SUSPEND:
+            break;
         }
     }
-
-end:
-    printf("handle_ep0_thread-\n");
-    return NULL;
 }
 
 
@@ -857,14 +1061,23 @@ void gadgetfs_usb_init(void)
 
     printf("USB device setup\n");
 
-    memset(&g_aiocb_async_read, 0, sizeof(struct aiocb));
-
     g_aio_read_async  = 0;
     g_fd_usb_gadget   = -1;
     g_usbg_io_thread_args.fd_in  = -1;
     g_usbg_io_thread_args.fd_out = -1;
     g_usbg_io_thread_args.stop   = 1;
 
+    g_usbg_max_packet = USBG_FS_MAX_PACKET;
+
+    if (g_usbg_ffs)
+    {
+        if ((usbg_io_init() < 0) || (ffs_usb_init() < 0))
+        {
+            usbg_io_deinit();
+        }
+        return;
+    }
+
     g_fd_usb_gadget = open(USB_DEV_NAME, O_RDWR|O_SYNC);
 
     if (g_fd_usb_gadget <= 0)
@@ -976,14 +1189,28 @@ void gadgetfs_usb_init(void)
     usbsg_debug("ep0 configured\n");
 
     /**
-     * Create EP0 handler thread
+     * Endpoint reads and writes complete through the I/O engine
+     */
+    if (usbg_io_init() < 0)
+    {
+        goto fail_end;
+    }
+
+    /**
+     * Handle EP0 from the event loop
      */
-    pthread_create(&g_thread_ep0_handler, NULL, &handle_ep0_thread, &g_fd_usb_gadget);
+    if (event_loop_add(g_fd_usb_gadget, EPOLLIN, handle_ep0_event, NULL) < 0)
+    {
+        printf("ep0 event error (%m)\n");
+        goto fail_end;
+    }
 
     return;
 
 fail_end:
+    usbg_io_deinit();
     if (g_fd_usb_gadget != -1) close(g_fd_usb_gadget);
+    g_fd_usb_gadget = -1;
 
 }
 
@@ -992,47 +1219,17 @@ fail_end:
  */
 void gadgetfs_usb_stop(void)
 {
-    int    ires;
-    void * vres;
-
     printf("GadgetFS USB Stop\n");
 
-#ifdef USBG_IO_THREAD
-    ires = pthread_cancel(g_usbg_io_thread);
-    if (ires != 0)
-    {
-        printf("g_usbg_io_thread cancel problem\n");
-    }
-
-
-    ires = pthread_join(g_usbg_io_thread, &vres);
-    if (ires != 0)
-    {
-        printf("g_usbg_io_thread pthread_join problem\n");
-    }
-
-    if (vres == PTHREAD_CANCELED)
-        printf("g_usbg_io_thread thread was canceled\n");
-    else
-        printf("g_usbg_io_thread thread wasn't canceled (shouldn't happen!)\n");
-#endif
-
-    ires = pthread_cancel(g_thread_ep0_handler);
-    if (ires != 0)
+    if (g_fd_usb_gadget != -1)
     {
-        printf("g_thread_ep0_handler cancel problem\n");
+        event_loop_del(g_fd_usb_gadget);
     }
 
-    ires = pthread_join(g_thread_ep0_handler, &vres);
-    if (ires != 0)
-    {
-        printf("g_thread_ep0_handler pthread_join problem\n");
-    }
-
-    if (vres != PTHREAD_CANCELED)
-    {
-        printf("g_thread_ep0_handler thread wasn't canceled (shouldn't happen!)\n");
-    }
+    /* Waits for the requests still queued, if any */
+    usbg_io_deinit();
+    usbg_rx_free();
+    g_aio_read_async = 0;
 
     if (g_usbg_io_thread_args.fd_in != -1)
         {
@@ -1056,6 +1253,12 @@ void gadgetfs_usb_stop(void)
 
     if (g_fd_usb_gadget != -1) close(g_fd_usb_gadget);
 
+    if (g_usbg_ffs)
+    {
+        ffs_usb_stop();
+        return;
+    }
+
     gadgetfs_usb_dismount();
 
 }
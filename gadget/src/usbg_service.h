@@ -9,6 +9,10 @@
 #ifndef USBG_SERVICE_H_
 #define USBG_SERVICE_H_
 
+#include <stdint.h>
+
+#include "usbg_io.h"
+
 #define FETCH(_var_)                            \
     memcpy(cp, &_var_, _var_.bLength);          \
     cp += _var_.bLength;
@@ -34,6 +38,14 @@
 #define USBG_VID     0x2FE0
 #define USBG_PID     0x7B01
 
+// "gadgetfs" (default) or "functionfs", see usbg_ffs.h
+#define USBG_BACKEND_ENV  "USBG_BACKEND"
+
+#define USBG_RX_NR_BUFS   (4)
+
+/* Full speed bulk packets, every faster speed uses a multiple of it */
+#define USBG_FS_MAX_PACKET (64)
+
 enum {
     STRINGID_MANUFACTURER = 1,
     STRINGID_PRODUCT,
@@ -45,13 +57,47 @@ enum {
 };
 
 
+/**
+ * Vendor control request handler
+ *
+ * @param request - bRequest
+ *
+ * @param value   - wValue
+ *
+ * @param dir_in  - 1 for device to host requests
+ *
+ * @param buf     - Data stage, to be filled for device to host requests
+ *
+ * @param len     - Length of the data stage
+ *
+ * @return bytes to send for device to host requests, 0 otherwise, <0 - stall
+ */
+typedef int (*usbg_vendor_handler_t)(uint8_t request, uint16_t value,
+                                     int dir_in, uint8_t * buf, int len);
+
+/**
+ * Configured state handler
+ *
+ * @param ready   - 1 once the host set the configuration, 0 when it is gone
+ */
+typedef void (*usbg_state_handler_t)(int ready);
+
+/**
+ * Transfer received on the USB OUT endpoint
+ *
+ * @param result  - Bytes received, <0 - error
+ *
+ * @param buf     - Receive buffer, valid until gadgetfs_io_rx_release()
+ */
+typedef void (*usbg_rx_cb_t)(int result, uint8_t * buf);
+
 /**
  * Bringup GadgetFS
  */
 void gadgetfs_usb_mount(void);
 
 /**
- * Init USB gadget device
+ * Init USB gadget device, ep0 is handled from the event loop
  */
 void gadgetfs_usb_init(void);
 
@@ -136,5 +182,54 @@ int  gadgetfs_io_get_read_fd(void);
  */
 int  gadgetfs_io_get_write_fd(void);
 
+/**
+ * Return the packet size of the USB IN endpoint at the connected speed
+ *
+ * FunctionFS does not tell the speed, it is read from the current_speed
+ * attribute of the UDC once the function is enabled. USBG_FS_MAX_PACKET is
+ * used until then, and for speeds not known here.
+ *
+ * @return packet size in bytes
+ */
+int  gadgetfs_io_get_max_packet(void);
+
+/**
+ * Set the handler of vendor control requests, NULL stalls them
+ *
+ * @param handler - Handler to call from the event loop
+ */
+void gadgetfs_set_vendor_handler(usbg_vendor_handler_t handler);
+
+/**
+ * Set the handler of configured state changes
+ *
+ * @param handler - Handler to call from the event loop
+ */
+void gadgetfs_set_state_handler(usbg_state_handler_t handler);
+
+/**
+ * Keep USBG_RX_NR_BUFS reads queued on the USB OUT endpoint
+ *
+ * Transfers are handed out one at a time in the order their reads
+ * complete, the next one follows gadgetfs_io_rx_release().
+ *
+ * @param size  - Size of each receive buffer
+ *
+ * @param cb    - Gets each transfer from the event loop
+ *
+ * @return 0 - success, <0 - error
+ */
+int  gadgetfs_io_rx_start(int size, usbg_rx_cb_t cb);
+
+/**
+ * Give back the buffer of the last transfer and queue its read again
+ */
+void gadgetfs_io_rx_release(void);
+
+/**
+ * Stop handing out transfers
+ */
+void gadgetfs_io_rx_stop(void);
+
 
 #endif /* USBG_SERVICE_H_ */
@@ -0,0 +1,262 @@
+/**
+ * @brief Unit tests of the frame and record codecs
+ *
+ * The bytes are checked against the structures of the host driver in
+ * host/tpmproxy-proto.h, so the two ends cannot drift apart unnoticed.
+ *
+ * @file test_tpm_proto.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <endian.h>
+
+#include <stdint.h>
+
+#include "tpm_proto.h"
+#include "tpm_proxy.h"
+
+#define __packed    __attribute__((packed))
+#include "tpmproxy-proto.h"
+
+static int g_failures = 0;
+
+#define CHECK(_cond_)                                                       \
+    do                                                                      \
+    {                                                                       \
+        if (!(_cond_))                                                      \
+        {                                                                   \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #_cond_);             \
+            g_failures++;                                                   \
+        }                                                                   \
+    } while (0)
+
+static void test_layout(void)
+{
+    CHECK(TPM_PROTO_MAGIC == TPMP_FRAME_MAGIC);
+    CHECK(TPM_PROTO_FRAME_SZ == TPMP_FRAME_SIZE);
+    CHECK(offsetof(tpm_proto_frame_t, type) == offsetof(struct tpmp_frame, type));
+    CHECK(offsetof(tpm_proto_frame_t, seq) == offsetof(struct tpmp_frame, seq));
+    CHECK(offsetof(tpm_proto_frame_t, len) == offsetof(struct tpmp_frame, len));
+
+    CHECK(TPM_PROTO_HELLO == TPMP_FRAME_HELLO);
+    CHECK(TPM_PROTO_CMD == TPMP_FRAME_CMD);
+    CHECK(TPM_PROTO_RSP == TPMP_FRAME_RSP);
+    CHECK(TPM_PROTO_BATCH_CMD == TPMP_FRAME_BATCH_CMD);
+    CHECK(TPM_PROTO_BATCH_RSP == TPMP_FRAME_BATCH_RSP);
+    CHECK(TPM_PROTO_STOP_ON_ERROR == TPMP_FRAME_STOP_ON_ERROR);
+
+    CHECK(TPM_PROTO_REC_SZ == TPMP_REC_SIZE);
+    CHECK(TPM_PROTO_REC_ALIGN == TPMP_REC_ALIGN);
+    CHECK(TPM_PROTO_REC_OK == TPMP_REC_OK);
+    CHECK(TPM_PROTO_REC_FAILED == TPMP_REC_FAILED);
+    CHECK(TPM_PROTO_REC_TRUNCATED == TPMP_REC_TRUNCATED);
+
+    CHECK(sizeof(tpm_proto_caps_t) == sizeof(struct tpmp_caps));
+    CHECK(sizeof(tpm_proto_stats_t) == sizeof(struct tpmp_gadget_stats));
+}
+
+static void test_frame(void)
+{
+    static const uint8_t tpm_cmd[] = {
+        0x80, 0x01, 0x00, 0x00, 0x00, 0x0c, 0x00, 0x00, 0x01, 0x7b, 0x00, 0x08
+    };
+    uint8_t           buf[64];
+    tpm_proto_frame_t frame;
+    struct tpmp_frame host;
+
+    memset(buf, 0xaa, sizeof(buf));
+    tpm_proto_put_frame(buf, TPM_PROTO_RSP, 0x0102, 0x11223344, 40);
+
+    /* What the host reads */
+    memcpy(&host, buf, sizeof(host));
+    CHECK(le32toh(host.magic) == TPMP_FRAME_MAGIC);
+    CHECK(le16toh(host.type) == TPMP_FRAME_RSP);
+    CHECK(le16toh(host.flags) == 0x0102);
+    CHECK(le32toh(host.seq) == 0x11223344);
+    CHECK(le32toh(host.len) == 40);
+    CHECK(buf[TPM_PROTO_FRAME_SZ] == 0xaa);
+
+    CHECK(tpm_proto_get_frame(buf, sizeof(buf), &frame) == 1);
+    CHECK(frame.type == TPM_PROTO_RSP);
+    CHECK(frame.flags == 0x0102);
+    CHECK(frame.seq == 0x11223344);
+    CHECK(frame.len == 40);
+
+    /* Header cut short */
+    CHECK(tpm_proto_get_frame(buf, TPM_PROTO_FRAME_SZ - 1, &frame) == 0);
+
+    /* Raw TPM command */
+    CHECK(tpm_proto_get_frame(tpm_cmd, sizeof(tpm_cmd), &frame) == 0);
+}
+
+/*
+ * Lay out records the way tpmp_batch_pack() does
+ */
+static int host_pack(uint8_t *buf, const uint32_t *lens, int n, int pad_last)
+{
+    struct tpmp_frame_rec rec;
+    int                   i, off = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        rec.len    = htole32(lens[i]);
+        rec.status = 0;
+        memcpy(&buf[off], &rec, sizeof(rec));
+        off += TPMP_REC_SIZE;
+        memset(&buf[off], 0x10 + i, lens[i]);
+        off += lens[i];
+
+        if (pad_last || (i < n - 1))
+        {
+            while (off % TPMP_REC_ALIGN)
+            {
+                buf[off++] = 0;
+            }
+        }
+    }
+
+    return off;
+}
+
+static void test_get_rec(void)
+{
+    static const uint32_t lens[] = { 10, 12, 1 };
+    uint8_t  buf[128];
+    uint32_t data_len;
+    int      len, off, data;
+
+    len = host_pack(buf, lens, 3, 0);
+    off = 0;
+
+    CHECK(tpm_proto_get_rec(buf, len, &off, &data, &data_len) == 1);
+    CHECK((data == (int)TPM_PROTO_REC_SZ) && (data_len == 10));
+    CHECK(buf[data] == 0x10 && buf[data + 9] == 0x10);
+    CHECK(off == (int)(TPM_PROTO_REC_SZ + 12));
+
+    CHECK(tpm_proto_get_rec(buf, len, &off, &data, &data_len) == 1);
+    CHECK((data_len == 12) && (buf[data] == 0x11));
+
+    /* The last one without its padding */
+    CHECK(tpm_proto_get_rec(buf, len, &off, &data, &data_len) == 1);
+    CHECK((data_len == 1) && (buf[data] == 0x12));
+    CHECK(off >= len);
+
+    CHECK(tpm_proto_get_rec(buf, len, &off, &data, &data_len) == 0);
+
+    /* No records at all, or a header cut short */
+    off = 0;
+    CHECK(tpm_proto_get_rec(buf, 0, &off, &data, &data_len) == 0);
+    off = 0;
+    CHECK(tpm_proto_get_rec(buf, TPM_PROTO_REC_SZ - 1, &off, &data,
+                            &data_len) == 0);
+
+    /* A record longer than what is left */
+    off = 0;
+    CHECK(tpm_proto_get_rec(buf, TPM_PROTO_REC_SZ + 9, &off, &data,
+                            &data_len) == -1);
+
+    /* A length that wraps around */
+    buf[0] = buf[1] = buf[2] = buf[3] = 0xff;
+    off = 0;
+    CHECK(tpm_proto_get_rec(buf, len, &off, &data, &data_len) == -1);
+}
+
+static void test_put_rec(void)
+{
+    static const uint8_t rsp[] = { 1, 2, 3, 4, 5, 6, 7 };
+    struct tpmp_frame_rec rec;
+    uint8_t  buf[64];
+    int      off;
+
+    memset(buf, 0xaa, sizeof(buf));
+
+    off = tpm_proto_put_rec(buf, sizeof(buf), 0, TPM_PROTO_REC_OK,
+                            rsp, sizeof(rsp));
+    CHECK(off == (int)(TPM_PROTO_REC_SZ + 8));
+
+    /* What tpmp_batch_unpack() reads */
+    memcpy(&rec, buf, sizeof(rec));
+    CHECK(le32toh(rec.len) == sizeof(rsp));
+    CHECK(le32toh(rec.status) == TPMP_REC_OK);
+    CHECK(memcmp(&buf[TPMP_REC_SIZE], rsp, sizeof(rsp)) == 0);
+    CHECK(buf[TPMP_REC_SIZE + sizeof(rsp)] == 0);
+
+    off = tpm_proto_put_rec(buf, sizeof(buf), off, TPM_PROTO_REC_FAILED,
+                            NULL, 0);
+    CHECK(off == (int)(2 * TPM_PROTO_REC_SZ + 8));
+    memcpy(&rec, &buf[TPM_PROTO_REC_SZ + 8], sizeof(rec));
+    CHECK((le32toh(rec.len) == 0) &&
+          (le32toh(rec.status) == TPMP_REC_FAILED));
+
+    /* No room for the padded record */
+    CHECK(tpm_proto_put_rec(buf, 24, 0, TPM_PROTO_REC_OK, rsp,
+                            sizeof(rsp)) == (int)(TPM_PROTO_REC_SZ + 8));
+    CHECK(tpm_proto_put_rec(buf, 15, 0, TPM_PROTO_REC_OK, rsp,
+                            sizeof(rsp)) == -1);
+    CHECK(tpm_proto_put_rec(buf, sizeof(buf), 60, TPM_PROTO_REC_OK,
+                            NULL, 0) == -1);
+}
+
+static void test_cmd_size(void)
+{
+    uint8_t  cmd[64];
+    uint32_t i;
+
+    for (i = 0; i < sizeof(cmd); i++)
+    {
+        cmd[i] = i;
+    }
+    cmd[0] = 0x80;
+    cmd[1] = 0x01;
+
+    /* Exact, and with bytes after it */
+    tpm_put_be32(&cmd[2], 12);
+    CHECK(tpm_proto_cmd_size(cmd, 12, 4096) == 12);
+    CHECK(tpm_proto_cmd_size(cmd, 20, 4096) == 12);
+    CHECK(tpm_proto_msg_len(cmd, 20) == 12);
+
+    /* Cut short by a short packet, or above what the TPM takes */
+    CHECK(tpm_proto_cmd_size(cmd, 11, 4096) == 0);
+    CHECK(tpm_proto_cmd_size(cmd, 12, 11) == 0);
+
+    /* Shorter than its own header */
+    tpm_put_be32(&cmd[2], TPM_HEADER_SZ - 1);
+    CHECK(tpm_proto_cmd_size(cmd, 20, 4096) == 0);
+    tpm_put_be32(&cmd[2], 0);
+    CHECK(tpm_proto_cmd_size(cmd, 20, 4096) == 0);
+    tpm_put_be32(&cmd[2], TPM_HEADER_SZ);
+    CHECK(tpm_proto_cmd_size(cmd, TPM_HEADER_SZ, 4096) == TPM_HEADER_SZ);
+    CHECK(tpm_proto_cmd_size(cmd, TPM_HEADER_SZ - 1, 4096) == 0);
+    CHECK(tpm_proto_msg_len(cmd, TPM_HEADER_SZ - 1) == TPM_HEADER_SZ - 1);
+
+    /* Far above any buffer */
+    tpm_put_be32(&cmd[2], 0xfffffff0);
+    CHECK(tpm_proto_cmd_size(cmd, sizeof(cmd), UINT32_MAX) == 0);
+    CHECK(tpm_proto_msg_len(cmd, sizeof(cmd)) == 0xfffffff0);
+
+    /* Frames, the length must not wrap */
+    tpm_proto_put_frame(cmd, TPM_PROTO_CMD, 0, 1, 12);
+    CHECK(tpm_proto_msg_len(cmd, sizeof(cmd)) == TPM_PROTO_FRAME_SZ + 12);
+    tpm_proto_put_frame(cmd, TPM_PROTO_CMD, 0, 1, UINT32_MAX - 4);
+    CHECK(tpm_proto_msg_len(cmd, sizeof(cmd)) == UINT32_MAX);
+}
+
+int main(void)
+{
+    test_layout();
+    test_frame();
+    test_get_rec();
+    test_put_rec();
+    test_cmd_size();
+
+    if (g_failures)
+    {
+        printf("%d checks failed\n", g_failures);
+        return 1;
+    }
+
+    printf("all checks passed\n");
+    return 0;
+}
@@ -20,6 +20,8 @@
  */
 
 #include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/compat.h>
 
 #include "tpmproxy-backports.h"
 
@@ -114,4 +116,16 @@ int usb_find_common_endpoints(struct usb_host_interface *alt,
 }
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,5,0) && defined(CONFIG_COMPAT)
+// Backported from the kernel source
+long compat_ptr_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	if (!file->f_op->unlocked_ioctl)
+		return -ENOIOCTLCMD;
+
+	return file->f_op->unlocked_ioctl(file, cmd,
+					  (unsigned long)compat_ptr(arg));
+}
+#endif
+
 MODULE_LICENSE("GPL");
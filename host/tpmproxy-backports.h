@@ -34,4 +34,43 @@ usb_find_common_endpoints(struct usb_host_interface *alt,
                           struct usb_endpoint_descriptor **int_out);
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,16,0)
+#define __poll_t unsigned int
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,6,0)
+#define u64_to_user_ptr(x) ((void __user *)(uintptr_t)(x))
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,2,0)
+#define stream_open nonseekable_open
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,5,0)
+#ifdef CONFIG_COMPAT
+struct file;
+long compat_ptr_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+#else
+#define compat_ptr_ioctl NULL
+#endif
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,9,0)
+#define kfree_sensitive kzfree
+#endif
+
+/* struct tpm_chip is public in <linux/tpm.h> since 5.1 */
+#if IS_ENABLED(CONFIG_TCG_TPM) && LINUX_VERSION_CODE >= KERNEL_VERSION(5,1,0)
+#define TPMP_HAVE_TPM_CHIP
+#endif
+
+#if IS_ENABLED(CONFIG_HW_RANDOM)
+#define TPMP_HAVE_HWRNG
+#endif
+
+/* uring_cmd with SQE accessors and task work taking issue_flags since 6.4 */
+#if IS_ENABLED(CONFIG_IO_URING) && LINUX_VERSION_CODE >= KERNEL_VERSION(6,4,0)
+#define TPMP_HAVE_URING_CMD
+#endif
+
 #endif /* _TPMP_BACKPORTS_H */
@@ -0,0 +1,194 @@
+/*
+ * TPM Proxy driver for Linux
+ *
+ *  Copyright (c) 2018-2019 Xaptum, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+
+#include "tpmproxy.h"
+
+static bool cache;
+module_param(cache, bool, 0644);
+MODULE_PARM_DESC(cache,
+		 "Answer immutable TPM2 queries (fixed properties, public areas of persistent objects) from a cache");
+
+/**
+ * struct tpmp_cache_entry - A cached command and its response
+ * @node: Entry in the cache list, most recently used first
+ * @cmd_len: Length of the command, which is the key
+ * @rsp_len: Length of the response
+ * @data: Command followed by the response
+ */
+struct tpmp_cache_entry {
+	struct list_head	node;
+	size_t			cmd_len;
+	size_t			rsp_len;
+	u8			data[];
+};
+
+void tpmp_cache_init(struct usb_tpmp *dev)
+{
+	spin_lock_init(&dev->cache.lock);
+	INIT_LIST_HEAD(&dev->cache.entries);
+	dev->cache.count = 0;
+}
+
+/**
+ * tpmp_cache_clear() - Drop all cached responses
+ * @dev: Device whose cache to clear
+ */
+void tpmp_cache_clear(struct usb_tpmp *dev)
+{
+	struct tpmp_cache_entry *entry, *tmp;
+	LIST_HEAD(entries);
+
+	spin_lock(&dev->cache.lock);
+	list_splice_init(&dev->cache.entries, &entries);
+	dev->cache.count = 0;
+	spin_unlock(&dev->cache.lock);
+
+	list_for_each_entry_safe(entry, tmp, &entries, node)
+		kfree(entry);
+}
+
+/**
+ * tpmp_cache_enabled() - Check if responses are cached
+ *
+ * Return: true if the cache module parameter is set
+ */
+bool tpmp_cache_enabled(void)
+{
+	return READ_ONCE(cache);
+}
+
+/**
+ * tpmp_cache_key() - Copy a command to use it as cache key
+ * @buf: Command buffer
+ * @len: Length of the command
+ * @key: Buffer of TPMP_CACHE_KEY_MAX bytes to copy the command to
+ *
+ * Return: Length of the key, 0 if caching is off or the command is not
+ * cacheable
+ */
+size_t tpmp_cache_key(const u8 *buf, size_t len, u8 *key)
+{
+	if (!READ_ONCE(cache) || len > TPMP_CACHE_KEY_MAX ||
+	    !tpmp_tpm2_cacheable(buf, len))
+		return 0;
+
+	memcpy(key, buf, len);
+	return len;
+}
+
+/**
+ * tpmp_cache_lookup() - Answer a command from the cache
+ * @dev: Device the command is sent to
+ * @key: Command, as returned by tpmp_cache_key()
+ * @key_len: Length of @key
+ * @buf: Buffer to copy the response to
+ * @bufsiz: Size of @buf
+ *
+ * Return: Length of the response copied to @buf, 0 on a miss
+ */
+int tpmp_cache_lookup(struct usb_tpmp *dev, const u8 *key, size_t key_len,
+		      u8 *buf, size_t bufsiz)
+{
+	struct tpmp_cache_entry *entry;
+	int retval = 0;
+
+	spin_lock(&dev->cache.lock);
+	list_for_each_entry(entry, &dev->cache.entries, node) {
+		if (entry->cmd_len != key_len ||
+		    memcmp(entry->data, key, key_len))
+			continue;
+
+		if (entry->rsp_len <= bufsiz) {
+			memcpy(buf, entry->data + entry->cmd_len,
+			       entry->rsp_len);
+			retval = entry->rsp_len;
+			list_move(&entry->node, &dev->cache.entries);
+		}
+		break;
+	}
+	spin_unlock(&dev->cache.lock);
+
+	tpmp_stats_count_cache(dev, retval > 0);
+	return retval;
+}
+
+/**
+ * tpmp_cache_insert() - Cache the response to a command
+ * @dev: Device the command was sent to
+ * @key: Command, as returned by tpmp_cache_key()
+ * @key_len: Length of @key
+ * @rsp: Response
+ * @rsp_len: Length of @rsp
+ *
+ * Only successful responses are cached. The least recently used entry is
+ * dropped once the cache holds TPMP_CACHE_ENTRIES. Must be called with
+ * buffer_mutex held, so no command invalidating the response can be sent
+ * between receiving and caching it.
+ */
+void tpmp_cache_insert(struct usb_tpmp *dev, const u8 *key, size_t key_len,
+		       const u8 *rsp, size_t rsp_len)
+{
+	struct tpmp_cache_entry *entry, *old = NULL;
+
+	if (tpmp_tpm_response_size(rsp, rsp_len) != rsp_len ||
+	    tpmp_tpm_response_code(rsp, rsp_len) != TPMP_RC_SUCCESS)
+		return;
+
+	entry = kmalloc(sizeof(*entry) + key_len + rsp_len, GFP_KERNEL);
+	if (!entry)
+		return;
+
+	entry->cmd_len = key_len;
+	entry->rsp_len = rsp_len;
+	memcpy(entry->data, key, key_len);
+	memcpy(entry->data + key_len, rsp, rsp_len);
+
+	spin_lock(&dev->cache.lock);
+	list_add(&entry->node, &dev->cache.entries);
+	if (++dev->cache.count > TPMP_CACHE_ENTRIES) {
+		old = list_last_entry(&dev->cache.entries,
+				      struct tpmp_cache_entry, node);
+		list_del(&old->node);
+		dev->cache.count--;
+	}
+	spin_unlock(&dev->cache.lock);
+
+	kfree(old);
+}
+
+/**
+ * tpmp_cache_snoop() - Drop the cache ahead of commands that may change it
+ * @dev: Device the command is sent to
+ * @buf: Command buffer
+ * @len: Length of the command
+ *
+ * Called for every command sent to the device, by any path.
+ */
+void tpmp_cache_snoop(struct usb_tpmp *dev, const u8 *buf, size_t len)
+{
+	if (tpmp_tpm2_invalidates_cache(buf, len))
+		tpmp_cache_clear(dev);
+}
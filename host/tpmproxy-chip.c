@@ -0,0 +1,196 @@
+/*
+ * TPM Proxy driver for Linux
+ *
+ *  Copyright (c) 2018-2019 Xaptum, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/tpm.h>
+
+#include "tpmproxy.h"
+
+#ifdef TPMP_HAVE_TPM_CHIP
+
+/*
+ * Exported by the TPM core, but only declared in drivers/char/tpm/tpm.h
+ * which is not available to out-of-tree modules.
+ */
+struct tpm_chip *tpm_chip_alloc(struct device *pdev,
+				const struct tpm_class_ops *ops);
+int tpm_chip_register(struct tpm_chip *chip);
+void tpm_chip_unregister(struct tpm_chip *chip);
+int tpm2_probe(struct tpm_chip *chip);
+
+/* Status bit reported once the response of the last command is buffered */
+#define TPMP_STS_DATA_AVAIL	0x01
+
+static inline struct usb_tpmp *to_chip_tpmp(struct tpm_chip *chip)
+{
+	return dev_get_drvdata(&chip->dev);
+}
+
+/**
+ * tpmp_chip_send() - Forward a command from the TPM core to the card TPM
+ * @chip: TPM chip
+ * @buf: Command buffer
+ * @len: Length of the command
+ *
+ * The USB round trip is done synchronously here, so by the time the TPM core
+ * polls the status the response is already sitting in the data buffer.
+ *
+ * Return:
+ *	0 on success
+ *	-E2BIG on command exceeding the buffer size
+ *	-ENODEV if the device was disconnected
+ *	other negative errno on USB errors
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,16,0)
+static int tpmp_chip_send(struct tpm_chip *chip, u8 *buf, size_t bufsiz,
+			  size_t len)
+#else
+static int tpmp_chip_send(struct tpm_chip *chip, u8 *buf, size_t len)
+#endif
+{
+	struct usb_tpmp *dev = to_chip_tpmp(chip);
+	int retval;
+
+	if (len > dev->bufsiz)
+		return -E2BIG;
+
+	mutex_lock(&dev->buffer_mutex);
+	atomic_set(&dev->data_pending, 0);
+	memcpy(dev->data_buffer, buf, len);
+
+	mutex_lock(&dev->usb_mutex);
+	retval = tpmp_transmit(dev, len);
+	mutex_unlock(&dev->usb_mutex);
+
+	if (retval >= 0) {
+		atomic_set(&dev->data_pending, retval);
+		retval = 0;
+	}
+
+	mutex_unlock(&dev->buffer_mutex);
+	return retval;
+}
+
+static int tpmp_chip_recv(struct tpm_chip *chip, u8 *buf, size_t count)
+{
+	struct usb_tpmp *dev = to_chip_tpmp(chip);
+	int len;
+
+	mutex_lock(&dev->buffer_mutex);
+	len = atomic_read(&dev->data_pending);
+	if (len > count) {
+		len = -EIO;
+	} else {
+		memcpy(buf, dev->data_buffer, len);
+		atomic_set(&dev->data_pending, 0);
+	}
+	mutex_unlock(&dev->buffer_mutex);
+
+	return len;
+}
+
+static u8 tpmp_chip_status(struct tpm_chip *chip)
+{
+	struct usb_tpmp *dev = to_chip_tpmp(chip);
+
+	return atomic_read(&dev->data_pending) ? TPMP_STS_DATA_AVAIL : 0;
+}
+
+static void tpmp_chip_cancel(struct tpm_chip *chip)
+{
+	/* Commands complete synchronously in send, nothing to cancel */
+}
+
+static bool tpmp_chip_req_canceled(struct tpm_chip *chip, u8 status)
+{
+	return false;
+}
+
+static const struct tpm_class_ops tpmp_chip_ops = {
+	.flags = TPM_OPS_AUTO_STARTUP,
+	.status = tpmp_chip_status,
+	.recv = tpmp_chip_recv,
+	.send = tpmp_chip_send,
+	.cancel = tpmp_chip_cancel,
+	.req_complete_mask = TPMP_STS_DATA_AVAIL,
+	.req_complete_val = TPMP_STS_DATA_AVAIL,
+	.req_canceled = tpmp_chip_req_canceled,
+};
+
+/**
+ * tpmp_chip_register() - Register the proxied TPM with the kernel TPM core
+ * @dev: Device to register
+ *
+ * tpm2_probe() sets the TPM 2.0 flag first, it picks the auto startup
+ * path. Auto startup then reads the timeouts and, on TPM 2.0, the command
+ * attributes /dev/tpmrmX validates commands against. A card TPM the
+ * embedded side started already is fine, auto startup only sends a startup
+ * to a TPM that asks for one.
+ *
+ * Return: 0 on success, negative errno otherwise
+ */
+int tpmp_chip_register(struct usb_tpmp *dev)
+{
+	struct tpm_chip *chip;
+	int retval;
+
+	chip = tpm_chip_alloc(&dev->interface->dev, &tpmp_chip_ops);
+	if (IS_ERR(chip))
+		return PTR_ERR(chip);
+
+	dev_set_drvdata(&chip->dev, dev);
+
+	retval = tpm2_probe(chip);
+	if (retval)
+		goto error;
+
+	retval = tpm_chip_register(chip);
+	if (retval)
+		goto error;
+
+	dev->chip = chip;
+	return 0;
+
+error:
+	put_device(&chip->dev);
+	return retval;
+}
+
+/**
+ * tpmp_chip_unregister() - Remove the proxied TPM from the kernel TPM core
+ * @dev: Device to unregister
+ *
+ * Waits for any operation in flight through the TPM core to finish. No
+ * further ops are called once this returns.
+ */
+void tpmp_chip_unregister(struct usb_tpmp *dev)
+{
+	if (!dev->chip)
+		return;
+
+	tpm_chip_unregister(dev->chip);
+	put_device(&dev->chip->dev);
+	dev->chip = NULL;
+}
+
+#endif /* TPMP_HAVE_TPM_CHIP */
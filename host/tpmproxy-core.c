@@ -14,8 +14,15 @@
 #include <linux/uaccess.h>
 #include <linux/usb.h>
 #include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/pm_runtime.h>
 
-#include "tpmproxy-backports.h"
+#include "tpmproxy.h"
+#include "tpmproxy-ioctl.h"
+#include "tpmproxy-proto.h"
+
+#define CREATE_TRACE_POINTS
+#include "tpmproxy-trace.h"
 
 /* Define these values to match your devices */
 #define USB_TPMP_VENDOR_ID      0x2FE0
@@ -31,40 +38,63 @@ MODULE_DEVICE_TABLE(usb, tpmp_table);
 /* Get a minor range for your devices from the usb maintainer */
 #define USB_TPMP_MINOR_BASE	 192 + 2
 
-/* arbitrarily chosen */
-
-#define TPM_BUFSIZE 4096
-#define TPMP_USB_TIMEOUT_MS	1000 // msecs
-
-/* Structure to hold all of our device specific stuff */
-struct usb_tpmp {
-	struct usb_device	*udev;			/* the usb device for this device */
-	struct usb_interface 	*interface;		/* the interface for this device */
-	__u8			bulk_in_endpointAddr;	/* the address of the bulk in endpoint */
-	__u8			bulk_out_endpointAddr;	/* the address of the bulk out endpoint */
-	struct kref		kref;			/* Reference counter */
-	struct mutex		usb_mutex;		/* synchronize I/O with disconnect */
-	struct mutex		buffer_mutex;		/* mutex for buffer access */
-	u8 			*data_buffer;		/* Buffer to hold the outgoing and incoming memory in user space */
-	atomic_t 		data_pending;		/* Counter to the number of bytes waiting to be read into userspace */
-	unsigned long 		is_open;		/* Flag for preventing double file access */ 
-};
+/* The autosuspend delay is kept between these, at a few command gaps */
+#define TPMP_AUTOSUSPEND_MIN_MS	100
+#define TPMP_AUTOSUSPEND_GAPS	4
+
+static bool chip_mode;
+module_param(chip_mode, bool, 0444);
+MODULE_PARM_DESC(chip_mode,
+		 "Register with the TPM core as /dev/tpmX and /dev/tpmrmX instead of /dev/tpmpX");
+
+static bool framing;
+module_param(framing, bool, 0444);
+MODULE_PARM_DESC(framing,
+		 "Tag transfers with sequence numbers if the gadget supports it, so late responses are dropped");
+
+/* A gadget with framing answers the HELLO itself, right away */
+#define TPMP_HELLO_TIMEOUT_MS	500
+
+/* The gadget answers control requests on ep0 right away */
+#define TPMP_CTRL_TIMEOUT_MS	100
+
+static unsigned int autosuspend_ms = 2000;
+module_param(autosuspend_ms, uint, 0644);
+MODULE_PARM_DESC(autosuspend_ms,
+		 "Longest autosuspend delay in msecs, tracking the time between commands; 0 leaves autosuspend alone");
+
 #define to_tpmp_dev(d) container_of(d, struct usb_tpmp, kref)
 
 static struct usb_driver tpmp_driver;
 
+/* The data buffer has headroom for a frame header, see tpmp_set_io_buffer() */
+static void tpmp_free_buffer(struct usb_tpmp *dev)
+{
+	if (dev->data_buffer)
+		usb_free_coherent(dev->udev, TPMP_FRAME_SIZE + dev->bufsiz,
+				  dev->data_buffer - TPMP_FRAME_SIZE,
+				  dev->data_dma - TPMP_FRAME_SIZE);
+}
+
 static void tpmp_delete(struct kref *kref)
 {
 	struct usb_tpmp *dev = to_tpmp_dev(kref);
 
+	cancel_work_sync(&dev->tx_work);
+	cancel_delayed_work_sync(&dev->timeout_work);
+	usb_free_urb(dev->bulk_out_urb);
+	usb_free_urb(dev->bulk_in_urb);
+	tpmp_stats_free(dev);
+	tpmp_cache_clear(dev);
+	tpmp_free_buffer(dev);
 	usb_put_dev(dev->udev);
-	kfree(dev->data_buffer);
 	kfree(dev);
 }
 
 static int tpmp_open(struct inode *inode, struct file *file)
 {
 	struct usb_tpmp *dev;
+	struct tpmp_client *client;
 	struct usb_interface *interface;
 	int subminor;
 	int retval = 0;
@@ -85,200 +115,1528 @@ static int tpmp_open(struct inode *inode, struct file *file)
 		goto exit;
 	}
 
-	/* Don't allow multiple opens */
-	if(test_and_set_bit(0,&dev->is_open))
-		return -EBUSY;
-
-	retval = usb_autopm_get_interface(interface);
-	if (retval)
+	client = kzalloc(sizeof(*client), GFP_KERNEL);
+	if (!client) {
+		retval = -ENOMEM;
 		goto exit;
+	}
+
+	client->data_buffer = kmalloc(dev->bufsiz, GFP_KERNEL);
+	if (!client->data_buffer) {
+		retval = -ENOMEM;
+		goto error;
+	}
+
+	client->dev = dev;
+	INIT_LIST_HEAD(&client->node);
+	INIT_LIST_HEAD(&client->cmds);
+	INIT_LIST_HEAD(&client->cmd.node);
+	mutex_init(&client->buffer_mutex);
+	init_waitqueue_head(&client->wait);
 
 	/* increment our usage count for the device */
 	kref_get(&dev->kref);
 
-	/* save our object in the file's private structure */
-	file->private_data = dev;
+	/* save our client in the file's private structure */
+	file->private_data = client;
+	trace_tpmp_open(dev);
+
+	/* Responses are read in sequence, there is no offset to seek to */
+	return stream_open(inode, file);
 
+error:
+	kfree(client->data_buffer);
+	kfree(client);
 exit:
 	return retval;
 }
 
+/* Checked under the queue lock, which completions hold while waking us */
+static bool tpmp_client_idle(struct tpmp_client *client)
+{
+	bool idle;
+
+	spin_lock(&client->dev->queue_lock);
+	idle = !client->cmd_queued && tpmp_ring_idle(client);
+	spin_unlock(&client->dev->queue_lock);
+
+	return idle;
+}
+
 static int tpmp_release(struct inode *inode, struct file *file)
 {
+	struct tpmp_client *client;
 	struct usb_tpmp *dev;
+	struct tpmp_cmd *cmd, *tmp;
+	LIST_HEAD(canceled);
 
-	dev = file->private_data;
-	if (dev == NULL)
+	client = file->private_data;
+	if (client == NULL)
 		return -ENODEV;
+	dev = client->dev;
+	trace_tpmp_release(dev);
+
+	/* drop our queued commands, and cancel the one already in flight */
+	spin_lock(&dev->queue_lock);
+	if (!list_empty(&client->cmd.node)) {
+		list_del_init(&client->cmd.node);
+		WRITE_ONCE(client->cmd_queued, false);
+	}
+	list_splice_init(&client->cmds, &canceled);
+	list_del_init(&client->node);
+	spin_unlock(&dev->queue_lock);
+
+	list_for_each_entry_safe(cmd, tmp, &canceled, node) {
+		list_del_init(&cmd->node);
+		cmd->result = -ECANCELED;
+		cmd->complete(cmd);
+	}
 
-	/* allow the device to be autosuspended */
-	mutex_lock(&dev->usb_mutex);
-	if (dev->interface)
-		usb_autopm_put_interface(dev->interface);
-	mutex_unlock(&dev->usb_mutex);
+	/* nobody reads the response to our command in flight, cancel it */
+	spin_lock_irq(&dev->err_lock);
+	if (dev->io_cmd && dev->io_cmd->client == client)
+		dev->cancel_io = true;
+	spin_unlock_irq(&dev->err_lock);
+	wake_up(&dev->bulk_in_wait);
+
+	wait_event(client->wait, tpmp_client_idle(client));
+	tpmp_ring_free(client);
+
+	kfree(client->data_buffer);
+	kfree(client);
 
 	/* decrement the count on our device */
 	kref_put(&dev->kref, tpmp_delete);
 
-	/* Clear the flag preventing opens */
-	clear_bit(0, &dev->is_open);
+	return 0;
+}
+
+static void tpmp_complete_io(struct usb_tpmp *dev, int status)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->err_lock, flags);
+	if (status && dev->timed_out)
+		status = -ETIMEDOUT;
+	else if (status && dev->cancel_io)
+		status = -ECANCELED;
+	if (status)
+		dev->errors = status;
+	dev->ongoing_io = false;
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+
+	tpmp_stats_complete(dev, status, dev->rsp_received);
+
+	cancel_delayed_work(&dev->timeout_work);
+	wake_up(&dev->bulk_in_wait);
+}
+
+/* Start of the transfer of the command in flight, its frame with framing */
+static inline void *tpmp_io_frame(struct usb_tpmp *dev)
+{
+	return dev->io_buffer - dev->io_hdr;
+}
+
+static bool tpmp_frame_matches(struct usb_tpmp *dev)
+{
+	const struct tpmp_frame *frame = tpmp_io_frame(dev);
+
+	return dev->rsp_received >= TPMP_FRAME_SIZE &&
+	       le32_to_cpu(frame->magic) == TPMP_FRAME_MAGIC &&
+	       le16_to_cpu(frame->type) == dev->rsp_type &&
+	       le32_to_cpu(frame->seq) == dev->seq;
+}
+
+static void tpmp_read_bulk_callback(struct urb *urb)
+{
+	struct usb_tpmp *dev = urb->context;
+	unsigned long flags;
+	int status = urb->status;
+
+	if (status) {
+		if (!(status == -ENOENT ||
+		      status == -ECONNRESET ||
+		      status == -ESHUTDOWN))
+			dev_err(&urb->dev->dev,
+				"%s - nonzero read bulk status received: %d\n",
+				__func__, status);
+		goto done;
+	}
+
+	/*
+	 * The gadget ends responses filling their last packet with a zero
+	 * length packet, which is left over if the response filled the whole
+	 * transfer. It is no response to this command.
+	 */
+	if (!urb->actual_length && !dev->rsp_received)
+		goto read_more;
+
+	dev->rsp_received += urb->actual_length;
+	if (dev->io_hdr && !dev->rsp_expected) {
+		/* Drop late responses to commands we gave up on, and anything else */
+		if (!tpmp_frame_matches(dev)) {
+			tpmp_stats_count_stale(dev);
+			dev->rsp_received = 0;
+			goto read_more;
+		}
+		dev->rsp_expected = dev->io_hdr + le32_to_cpu(tpmp_io_frame(dev)->len);
+	} else if (!dev->rsp_expected) {
+		dev->rsp_expected = tpmp_tpm_response_size(dev->io_buffer,
+							    dev->rsp_received);
+	}
+	if (dev->rsp_expected > dev->bufsiz + dev->io_hdr) {
+		dev_err(&urb->dev->dev, "%s - response of %zu bytes too large\n",
+			__func__, dev->rsp_expected);
+		status = -EMSGSIZE;
+		goto done;
+	}
+
+	/* The response spans several transfers, read the rest of it */
+	if (!dev->rsp_expected || dev->rsp_received < dev->rsp_expected) {
+		if (urb->actual_length)
+			goto read_more;
+
+		/* A zero length packet ended it before its header said */
+		dev_err(&urb->dev->dev, "%s - response cut short at %zu bytes\n",
+			__func__, dev->rsp_received);
+		status = -EIO;
+		goto done;
+	}
+
+	atomic_set(&dev->data_pending, dev->rsp_received - dev->io_hdr);
+	goto done;
+
+read_more:
+	spin_lock_irqsave(&dev->err_lock, flags);
+	if (dev->timed_out || dev->cancel_io)
+		status = -ECONNRESET;
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+	if (status)
+		goto done;
+
+	urb->transfer_buffer = tpmp_io_frame(dev) + dev->rsp_received;
+	urb->transfer_dma = dev->data_dma - dev->io_hdr + dev->rsp_received;
+	urb->transfer_buffer_length = dev->bufsiz + dev->io_hdr - dev->rsp_received;
+
+	usb_anchor_urb(urb, &dev->submitted);
+	status = usb_submit_urb(urb, GFP_ATOMIC);
+	if (!status)
+		return;
+
+	dev_err(&urb->dev->dev,
+		"%s - failed resubmitting read urb, error %d\n",
+		__func__, status);
+	usb_unanchor_urb(urb);
+
+done:
+	trace_tpmp_in_complete(dev, status, tpmp_tpm_response_code(dev->io_buffer,
+								  dev->rsp_received),
+			       dev->rsp_received);
+	tpmp_complete_io(dev, status);
+}
+
+static void tpmp_write_bulk_callback(struct urb *urb)
+{
+	struct usb_tpmp *dev = urb->context;
+	unsigned long flags;
+	int status = urb->status;
+
+	trace_tpmp_out_complete(dev, status, urb->actual_length);
+
+	if (status) {
+		if (!(status == -ENOENT ||
+		      status == -ECONNRESET ||
+		      status == -ESHUTDOWN))
+			dev_err(&urb->dev->dev,
+				"%s - nonzero write bulk status received: %d\n",
+				__func__, status);
+		goto error;
+	}
+
+	/* Don't post the read if the command was unlinked */
+	spin_lock_irqsave(&dev->err_lock, flags);
+	if (dev->timed_out || dev->cancel_io || dev->resetting)
+		status = -ECONNRESET;
+	spin_unlock_irqrestore(&dev->err_lock, flags);
+	if (status)
+		goto error;
+
+	tpmp_stats_out_done(dev);
+
+	usb_anchor_urb(dev->bulk_in_urb, &dev->submitted);
+	status = usb_submit_urb(dev->bulk_in_urb, GFP_ATOMIC);
+	if (status) {
+		dev_err(&urb->dev->dev,
+			"%s - failed submitting read urb, error %d\n",
+			__func__, status);
+		usb_unanchor_urb(dev->bulk_in_urb);
+		goto error;
+	}
+
+	return;
+
+error:
+	tpmp_complete_io(dev, status);
+}
+
+static void tpmp_timeout_work(struct work_struct *work)
+{
+	struct usb_tpmp *dev = container_of(to_delayed_work(work),
+					    struct usb_tpmp, timeout_work);
+
+	spin_lock_irq(&dev->err_lock);
+	/* The command we were armed for may have completed already */
+	if (!dev->ongoing_io || time_before(jiffies, dev->io_deadline)) {
+		spin_unlock_irq(&dev->err_lock);
+		return;
+	}
+	dev->timed_out = true;
+	spin_unlock_irq(&dev->err_lock);
+
+	trace_tpmp_timeout(dev, dev->ordinal);
+
+	usb_unlink_anchored_urbs(&dev->submitted);
+}
+
+/*
+ * Point both URBs at the buffer of the next command, or at the frame header
+ * in front of it with framing. The coherent data buffer is premapped, any
+ * other buffer is mapped by the USB core.
+ */
+static void tpmp_set_io_buffer(struct usb_tpmp *dev, u8 *buf)
+{
+	struct urb *urbs[] = { dev->bulk_out_urb, dev->bulk_in_urb };
+	int i;
+
+	dev->io_buffer = buf;
+	dev->io_hdr = dev->framing ? TPMP_FRAME_SIZE : 0;
+	for (i = 0; i < ARRAY_SIZE(urbs); i++) {
+		urbs[i]->transfer_buffer = tpmp_io_frame(dev);
+		if (buf == dev->data_buffer) {
+			urbs[i]->transfer_dma = dev->data_dma - dev->io_hdr;
+			urbs[i]->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		} else {
+			urbs[i]->transfer_flags &= ~URB_NO_TRANSFER_DMA_MAP;
+		}
+	}
+}
+
+/*
+ * Submit the transfer in @buf over the bulk out endpoint, in a frame of
+ * @type with framing, and arm the timeout. The caller must hold both
+ * buffer_mutex and usb_mutex.
+ */
+static int tpmp_submit_io(struct usb_tpmp *dev, u8 *buf, size_t len,
+			  u16 type, u16 flags, unsigned int timeout_ms)
+{
+	unsigned long timeout = msecs_to_jiffies(timeout_ms);
+	int retval;
+
+	//Make sure the USB device is still open
+	if(!dev->interface)
+		return -ENODEV;
+
+	/* The urbs are preallocated, only refresh the buffer and lengths */
+	tpmp_set_io_buffer(dev, buf);
+	dev->bulk_out_urb->transfer_buffer_length = dev->io_hdr + len;
+	dev->bulk_in_urb->transfer_buffer_length = dev->io_hdr + dev->bufsiz;
+	if (dev->io_hdr) {
+		struct tpmp_frame *frame = tpmp_io_frame(dev);
+
+		frame->magic = cpu_to_le32(TPMP_FRAME_MAGIC);
+		frame->type = cpu_to_le16(type);
+		frame->flags = cpu_to_le16(flags);
+		frame->seq = cpu_to_le32(++dev->seq);
+		frame->len = cpu_to_le32(len);
+	}
+	dev->rsp_type = type == TPMP_FRAME_BATCH_CMD ? TPMP_FRAME_BATCH_RSP :
+						      TPMP_FRAME_RSP;
+	dev->rsp_received = 0;
+	dev->rsp_expected = 0;
+
+	atomic_set(&dev->data_pending, 0);
+	spin_lock_irq(&dev->err_lock);
+	dev->errors = 0;
+	dev->timed_out = false;
+	dev->ongoing_io = true;
+	dev->io_deadline = jiffies + timeout;
+	spin_unlock_irq(&dev->err_lock);
+
+	mod_delayed_work(system_wq, &dev->timeout_work, timeout);
+	tpmp_stats_submit(dev, len);
+	trace_tpmp_submit(dev, dev->ordinal, len, timeout_ms);
+
+	usb_anchor_urb(dev->bulk_out_urb, &dev->submitted);
+	retval = usb_submit_urb(dev->bulk_out_urb, GFP_KERNEL);
+	if (retval) {
+		dev_err(&dev->interface->dev,
+			"%s - failed submitting write urb, error %d\n",
+			__func__, retval);
+		usb_unanchor_urb(dev->bulk_out_urb);
+
+		spin_lock_irq(&dev->err_lock);
+		dev->ongoing_io = false;
+		spin_unlock_irq(&dev->err_lock);
+		cancel_delayed_work(&dev->timeout_work);
+		return retval;
+	}
 
 	return 0;
 }
 
 /**
- * tpmp_read() - Copy the last uncopied response from USB (if any) to userspace.
+ * tpmp_submit_buffer() - Start sending a command to USB
+ * @dev: Device to talk to
+ * @buf: DMA-able buffer of at least dev->bufsiz bytes holding the command,
+ *	 with TPMP_FRAME_SIZE bytes of headroom for the frame header
+ * @len: Length of the command
+ *
+ * Submits the command in @buf over the bulk out endpoint. Once it is out, the
+ * completion handler posts the read of the response into the same buffer.
+ * Waiters on bulk_in_wait are woken when the response arrived, the command
+ * failed or it timed out. The timeout is picked from the command ordinal
+ * unless overridden through the timeout_ms sysfs attribute. The caller must
+ * hold both buffer_mutex and usb_mutex.
+ *
+ * Return:
+	0 if the command was submitted
+	-ENODEV if the device was disconnected
+	-ENOMEM on allocation failure
+	other negative errno on USB errors
+ */
+static int tpmp_submit_buffer(struct usb_tpmp *dev, u8 *buf, size_t len)
+{
+	unsigned int timeout_ms;
+	u16 tag;
+
+	if (!tpmp_tpm_parse_header(buf, len, &tag, &dev->ordinal))
+		dev->ordinal = 0;
+
+	/*
+	 * A ring slot stays writable from userspace while it is sent, what
+	 * the cache and the replay go by could change under them. Such a
+	 * command is never replayed and drops the cache, see tpmp_send_cmd().
+	 */
+	dev->replay_len = 0;
+	if (buf != dev->data_buffer) {
+		tpmp_cache_clear(dev);
+		goto submit;
+	}
+
+	tpmp_cache_snoop(dev, buf, len);
+
+	/* Keep what we need to send the command again after a reset or stall */
+	if (len <= sizeof(dev->replay_cmd) && tpmp_tpm2_idempotent(buf, len)) {
+		memcpy(dev->replay_cmd, buf, len);
+		dev->replay_len = len;
+	}
+
+submit:
+	/* Short commands fail fast, key generation gets all the time it needs */
+	timeout_ms = READ_ONCE(dev->timeout_ms);
+	if (!timeout_ms)
+		timeout_ms = tpmp_tpm_timeout_ms(buf, len);
+
+	return tpmp_submit_io(dev, buf, len, TPMP_FRAME_CMD, 0, timeout_ms);
+}
+
+/**
+ * tpmp_submit() - Start sending the command in the data buffer to USB
+ * @dev: Device to talk to
+ * @len: Length of the command held in dev->data_buffer
+ *
+ * See tpmp_submit_buffer().
+ */
+int tpmp_submit(struct usb_tpmp *dev, size_t len)
+{
+	return tpmp_submit_buffer(dev, dev->data_buffer, len);
+}
+
+/**
+ * tpmp_wait() - Wait for the command in flight to complete
+ * @dev: Device to wait on
+ *
+ * If the client of the command gives up on it meanwhile, the command is
+ * unlinked.
+ *
+ * Return:
+	Number of bytes received if >=0
+	-ETIMEDOUT if the command timed out
+	-ECANCELED if the client gave up on the command
+	other negative errno on USB errors
+ */
+int tpmp_wait(struct usb_tpmp *dev)
+{
+	int retval;
+
+	wait_event(dev->bulk_in_wait, !READ_ONCE(dev->ongoing_io) ||
+				      READ_ONCE(dev->cancel_io));
+	if (READ_ONCE(dev->ongoing_io)) {
+		usb_unlink_anchored_urbs(&dev->submitted);
+		wait_event(dev->bulk_in_wait, !READ_ONCE(dev->ongoing_io));
+	}
+
+	spin_lock_irq(&dev->err_lock);
+	retval = dev->errors;
+	dev->errors = 0;
+	spin_unlock_irq(&dev->err_lock);
+
+	return retval ? retval : atomic_read(&dev->data_pending);
+}
+
+/*
+ * Have the gadget cancel the command the host gave up on, so the card TPM
+ * is free for the next one right away instead of finishing it.
+ */
+static void tpmp_cancel_card(struct usb_tpmp *dev)
+{
+	int retval;
+
+	if (!(dev->gadget_features & TPMP_FEAT_CANCEL))
+		return;
+
+	retval = tpmp_vendor_request(dev, TPMP_REQ_CANCEL, NULL, 0);
+	if (retval < 0)
+		dev_dbg(&dev->udev->dev, "%s - cancel failed: %d\n",
+			__func__, retval);
+	else
+		tpmp_stats_count_cancel(dev);
+}
+
+static int tpmp_clear_halts(struct usb_tpmp *dev)
+{
+	int retval;
+
+	retval = usb_clear_halt(dev->udev,
+				usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr));
+	if (retval)
+		return retval;
+
+	return usb_clear_halt(dev->udev,
+			      usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr));
+}
+
+/**
+ * tpmp_recover() - Bring the device back after the command in flight failed
+ * @dev: Device the command was sent to
+ * @buf: Buffer the command was sent from
+ * @error: Error the command failed with
+ *
+ * If a USB reset killed the command, waits for the reset to finish. The reset
+ * needs usb_mutex, so it is dropped meanwhile; buffer_mutex keeps other
+ * commands out. If an endpoint stalled, clears the halts on both endpoints.
+ * Idempotent commands are then sent once more, others fail with -ECONNRESET
+ * so the caller knows the command may be resent. Commands that timed out
+ * or were given up on are canceled on the card TPM. The caller must hold
+ * both buffer_mutex and usb_mutex.
+ *
+ * Return:
+	Number of bytes received if >=0
+	-ECONNRESET if the command was lost and may be resent
+	@error or other negative errno if the device could not be recovered
+ */
+static int tpmp_recover(struct usb_tpmp *dev, u8 *buf, int error)
+{
+	bool resetting;
+	int retval;
+
+	spin_lock_irq(&dev->err_lock);
+	resetting = dev->resetting;
+	spin_unlock_irq(&dev->err_lock);
+
+	if (resetting) {
+		mutex_unlock(&dev->usb_mutex);
+		wait_event(dev->reset_wait, !READ_ONCE(dev->resetting));
+		mutex_lock(&dev->usb_mutex);
+	} else if (error == -EPIPE) {
+		dev->recovery_start = ktime_get();
+		retval = tpmp_clear_halts(dev);
+		if (retval) {
+			dev_err(&dev->udev->dev, "%s - failed clearing halts, error %d\n",
+				__func__, retval);
+			return error;
+		}
+		WRITE_ONCE(dev->recovery_ms,
+			   ktime_ms_delta(ktime_get(), dev->recovery_start));
+	} else {
+		if (error == -ETIMEDOUT || error == -ECANCELED)
+			tpmp_cancel_card(dev);
+		return error;
+	}
+
+	if (!dev->replay_len)
+		return -ECONNRESET;
+
+	memcpy(buf, dev->replay_cmd, dev->replay_len);
+	retval = tpmp_submit_buffer(dev, buf, dev->replay_len);
+	if (retval)
+		return retval;
+
+	return tpmp_wait(dev);
+}
+
+/*
+ * Tracks the time between commands and sets the autosuspend delay to a few
+ * times its average, so the card stays resumed through a burst of commands
+ * but suspends soon after it. The caller must hold usb_mutex.
+ */
+static void tpmp_pm_update_delay(struct usb_tpmp *dev)
+{
+	unsigned int max_ms = READ_ONCE(autosuspend_ms);
+	ktime_t now = ktime_get();
+	u64 gap_us;
+	int delay_ms;
+
+	if (!max_ms)
+		return;
+
+	gap_us = min_t(u64, ktime_us_delta(now, dev->pm_last_cmd),
+		       (u64)max_ms * USEC_PER_MSEC);
+	dev->pm_last_cmd = now;
+	dev->pm_gap_us = dev->pm_gap_us ?
+		(dev->pm_gap_us * 7 + gap_us) / 8 : gap_us;
+
+	delay_ms = clamp_t(u64, div_u64(TPMP_AUTOSUSPEND_GAPS * dev->pm_gap_us,
+					USEC_PER_MSEC),
+			   TPMP_AUTOSUSPEND_MIN_MS, max_ms);
+	if (delay_ms != dev->pm_delay_ms) {
+		dev->pm_delay_ms = delay_ms;
+		pm_runtime_set_autosuspend_delay(&dev->udev->dev, delay_ms);
+	}
+}
+
+/**
+ * tpmp_transmit() - Send a command to USB and wait for the response
+ * @dev: Device to talk to
+ * @len: Length of the command held in dev->data_buffer
+ *
+ * Synchronous wrapper around tpmp_submit() and tpmp_wait(). The response is
+ * read back into the data buffer. A command lost to a reset or stall is
+ * recovered by tpmp_recover(). The caller must hold both buffer_mutex and
+ * usb_mutex.
+ *
+ * Return:
+	Number of bytes received if >=0
+	-ENODEV if the device was disconnected
+	-ECONNRESET if the command was lost to a reset or stall and may be resent
+	other negative errno on USB errors
+ */
+int tpmp_transmit(struct usb_tpmp *dev, size_t len)
+{
+	return tpmp_transmit_buffer(dev, dev->data_buffer, len);
+}
+
+/**
+ * tpmp_transmit_buffer() - Send a command to USB from a buffer of the caller
+ * @dev: Device to talk to
+ * @buf: DMA-able buffer of at least dev->bufsiz bytes holding the command,
+ *	 with TPMP_FRAME_SIZE bytes of headroom for the frame header
+ * @len: Length of the command
+ *
+ * Like tpmp_transmit(), but transfers from and into @buf directly.
+ */
+int tpmp_transmit_buffer(struct usb_tpmp *dev, u8 *buf, size_t len)
+{
+	int retval;
+
+	if (!dev->interface)
+		return -ENODEV;
+
+	/* The card may autosuspend whenever no command is in flight */
+	retval = usb_autopm_get_interface(dev->interface);
+	if (retval)
+		return retval;
+	tpmp_pm_update_delay(dev);
+
+	retval = tpmp_submit_buffer(dev, buf, len);
+	if (!retval)
+		retval = tpmp_wait(dev);
+	if (retval < 0 && retval != -ENODEV)
+		retval = tpmp_recover(dev, buf, retval);
+
+	if (dev->interface)
+		usb_autopm_put_interface_async(dev->interface);
+
+	return retval;
+}
+
+/*
+ * Send the records of a batch held in the data buffer in one BATCH_CMD frame.
+ * Commands lost to a reset or stall are not replayed. The caller must hold
+ * both buffer_mutex and usb_mutex.
+ */
+static int tpmp_transmit_batch(struct usb_tpmp *dev, size_t len, u16 flags,
+			       unsigned int timeout_ms)
+{
+	int retval;
+
+	if (!dev->interface)
+		return -ENODEV;
+
+	retval = usb_autopm_get_interface(dev->interface);
+	if (retval)
+		return retval;
+	tpmp_pm_update_delay(dev);
+
+	dev->ordinal = 0;
+	dev->replay_len = 0;
+	retval = tpmp_submit_io(dev, dev->data_buffer, len, TPMP_FRAME_BATCH_CMD,
+				flags, timeout_ms);
+	if (!retval)
+		retval = tpmp_wait(dev);
+	if (retval < 0 && retval != -ENODEV)
+		retval = tpmp_recover(dev, dev->data_buffer, retval);
+
+	if (dev->interface)
+		usb_autopm_put_interface_async(dev->interface);
+
+	return retval;
+}
+
+/**
+ * tpmp_vendor_request() - Send a vendor control request to the gadget
+ * @dev: Device to talk to
+ * @request: TPMP_REQ_* request
+ * @data: Buffer for the data stage, NULL for requests without one
+ * @size: Size of @data
+ *
+ * The gadget answers control requests on ep0, so they don't wait for the
+ * command in flight on the bulk endpoints. Requests with a data stage are
+ * device to host, see tpmproxy-proto.h.
+ *
+ * Return:
+	Number of bytes received if >=0
+	-ENODEV if the device was disconnected
+	-EPIPE if the gadget does not know the request
+	-ENOMEM on allocation failure
+	other negative errno on USB errors
+ */
+int tpmp_vendor_request(struct usb_tpmp *dev, u8 request, void *data, u16 size)
+{
+	void *buf = NULL;
+	int retval;
+
+	if (size) {
+		buf = kmalloc(size, GFP_KERNEL);
+		if (!buf)
+			return -ENOMEM;
+	}
+
+	mutex_lock(&dev->ctrl_mutex);
+	if (!dev->interface) {
+		retval = -ENODEV;
+		goto exit;
+	}
+
+	retval = usb_autopm_get_interface(dev->interface);
+	if (retval)
+		goto exit;
+
+	if (size)
+		retval = usb_control_msg(dev->udev, usb_rcvctrlpipe(dev->udev, 0),
+					 request,
+					 USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+					 0, 0, buf, size, TPMP_CTRL_TIMEOUT_MS);
+	else
+		retval = usb_control_msg(dev->udev, usb_sndctrlpipe(dev->udev, 0),
+					 request,
+					 USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE,
+					 0, 0, NULL, 0, TPMP_CTRL_TIMEOUT_MS);
+	if (retval > 0)
+		memcpy(data, buf, retval);
+
+	usb_autopm_put_interface(dev->interface);
+
+	exit:
+	mutex_unlock(&dev->ctrl_mutex);
+	kfree(buf);
+	return retval;
+}
+
+static struct tpmp_cmd *tpmp_dequeue_cmd(struct usb_tpmp *dev)
+{
+	struct tpmp_client *client;
+	struct tpmp_cmd *cmd = NULL;
+
+	spin_lock(&dev->queue_lock);
+	client = list_first_entry_or_null(&dev->ready_clients,
+					  struct tpmp_client, node);
+	if (client) {
+		cmd = list_first_entry(&client->cmds, struct tpmp_cmd, node);
+		list_del_init(&cmd->node);
+
+		/* round-robin: a client with more work goes to the back */
+		if (list_empty(&client->cmds))
+			list_del_init(&client->node);
+		else
+			list_move_tail(&client->node, &dev->ready_clients);
+	}
+	spin_unlock(&dev->queue_lock);
+
+	return cmd;
+}
+
+/*
+ * Send a queued command and copy the response back. Responses to cacheable
+ * commands are added to the cache on the way.
+ *
+ * Ring commands are sent straight from their slot, which userspace can
+ * still write to. While the cache is on they go through the data buffer
+ * like the others, so the key and the cached response are what the TPM
+ * really got and answered.
+ */
+static int tpmp_send_cmd(struct usb_tpmp *dev, struct tpmp_cmd *cmd)
+{
+	u8 key[TPMP_CACHE_KEY_MAX];
+	size_t key_len = 0;
+	bool bounce;
+	u8 *buf;
+	int retval;
+
+	mutex_lock(&dev->buffer_mutex);
+	bounce = !cmd->dma || tpmp_cache_enabled();
+	if (bounce) {
+		memcpy(dev->data_buffer, cmd->buf, cmd->len);
+		key_len = tpmp_cache_key(dev->data_buffer, cmd->len, key);
+	}
+	buf = bounce ? dev->data_buffer : cmd->buf;
+
+	mutex_lock(&dev->usb_mutex);
+	retval = tpmp_transmit_buffer(dev, buf, cmd->len);
+	mutex_unlock(&dev->usb_mutex);
+
+	if (retval > (int)cmd->bufsiz)
+		retval = -EIO;
+	if (retval > 0 && key_len)
+		tpmp_cache_insert(dev, key, key_len, buf, retval);
+	if (retval > 0 && bounce)
+		memcpy(cmd->buf, dev->data_buffer, retval);
+	mutex_unlock(&dev->buffer_mutex);
+
+	return retval;
+}
+
+static void tpmp_tx_work(struct work_struct *work)
+{
+	struct usb_tpmp *dev = container_of(work, struct usb_tpmp, tx_work);
+	u8 key[TPMP_CACHE_KEY_MAX];
+	struct tpmp_cmd *cmd;
+	size_t key_len;
+	int retval = 0;
+
+	while ((cmd = tpmp_dequeue_cmd(dev))) {
+		/* A hit only hands the client the answer to the key it copied */
+		key_len = tpmp_cache_key(cmd->buf, cmd->len, key);
+		if (key_len)
+			retval = tpmp_cache_lookup(dev, key, key_len, cmd->buf,
+						   cmd->bufsiz);
+		if (!key_len || !retval) {
+			spin_lock_irq(&dev->err_lock);
+			dev->io_cmd = cmd;
+			spin_unlock_irq(&dev->err_lock);
+
+			retval = tpmp_send_cmd(dev, cmd);
+
+			spin_lock_irq(&dev->err_lock);
+			dev->io_cmd = NULL;
+			dev->cancel_io = false;
+			spin_unlock_irq(&dev->err_lock);
+		}
+
+		cmd->result = retval;
+		cmd->complete(cmd);
+	}
+}
+
+/**
+ * tpmp_queue_cmd() - Queue a command for the worker
+ * @dev: Device to send the command to
+ * @cmd: Command to queue
+ *
+ * Commands of one client are sent in order, clients are served round-robin.
+ * cmd->complete is called from the worker once the command is done.
+ */
+void tpmp_queue_cmd(struct usb_tpmp *dev, struct tpmp_cmd *cmd)
+{
+	struct tpmp_client *client = cmd->client;
+
+	spin_lock(&dev->queue_lock);
+	list_add_tail(&cmd->node, &client->cmds);
+	if (list_empty(&client->node))
+		list_add_tail(&client->node, &dev->ready_clients);
+	spin_unlock(&dev->queue_lock);
+
+	queue_work(system_long_wq, &dev->tx_work);
+}
+
+static void tpmp_client_complete(struct tpmp_cmd *cmd)
+{
+	struct tpmp_client *client = cmd->client;
+
+	mutex_lock(&client->buffer_mutex);
+	if (cmd->result < 0)
+		client->errors = cmd->result;
+	else
+		client->response_length = cmd->result;
+	client->response_off = 0;
+	mutex_unlock(&client->buffer_mutex);
+
+	/* Under the queue lock, so release cannot free the client in between */
+	spin_lock(&client->dev->queue_lock);
+	WRITE_ONCE(client->cmd_queued, false);
+	wake_up(&client->wait);
+	spin_unlock(&client->dev->queue_lock);
+}
+
+/**
+ * tpmp_read() - Copy the response of the last command to userspace.
  * @file: File pointer
  * @buffer: Userspace buffer to copy to
- * @count: Not used
+ * @count: Maximum number of bytes to copy
  * @ppos: Not used
  *
- * Reads the tpmp response from the last usb communication into userspace.
- * Will read up to 4096 bytes and return, reads will never be larger and
- * won't need a second call to complete a partial read.
+ * Sleeps until the command queued by this file (if any) completes, then
+ * reads its response into userspace. With O_NONBLOCK, returns -EAGAIN instead
+ * of sleeping. A response larger than @count is returned over several reads,
+ * each continuing where the last one stopped. The file is a stream, @ppos
+ * is not used.
  *
  * Return:
 		Number of bytes copied if >=0
+		-EAGAIN if the command is still queued and O_NONBLOCK is set
+		-ERESTARTSYS if interrupted by a signal
 		-EFAULT on memory copy error
+		other negative errno if the command failed on USB
  */
 static ssize_t tpmp_read(struct file *file, char __user *buffer, size_t count,
 			 loff_t *ppos)
 {
-	struct usb_tpmp *dev;
+	struct tpmp_client *client;
 	ssize_t bytes_copied;
-	ssize_t bytes_to_copy;
+	int retval;
 
-	dev = file->private_data;
+	client = file->private_data;
 	bytes_copied = 0;
 
+	if (file->f_flags & O_NONBLOCK) {
+		if (READ_ONCE(client->cmd_queued))
+			return -EAGAIN;
+	} else {
+		retval = wait_event_interruptible(client->wait,
+						  !READ_ONCE(client->cmd_queued));
+		if (retval < 0)
+			return retval;
+	}
+
 	/* Lock the buffer memory mutex */
-	mutex_lock(&dev->buffer_mutex);
-	bytes_to_copy = atomic_read(&dev->data_pending);
+	mutex_lock(&client->buffer_mutex);
+
+	/* Report a failed command once */
+	if (client->errors) {
+		bytes_copied = client->errors;
+		client->errors = 0;
+		goto exit;
+	}
 
 	/* If we have anything to copy */
-	if (bytes_to_copy != 0) {
+	if (client->response_length != 0) {
+		bytes_copied = min_t(ssize_t, count, client->response_length);
+
 		/* Copy data into userspace */
 		if (copy_to_user(buffer,
-				 dev->data_buffer,
-				 bytes_to_copy)) {
+				 client->data_buffer + client->response_off,
+				 bytes_copied)) {
+			client->response_length = 0;
 			bytes_copied = -EFAULT;
 		}
 		else {
-			bytes_copied = bytes_to_copy;
+			trace_tpmp_read(client->dev, bytes_copied,
+					client->response_off);
+			client->response_length -= bytes_copied;
+			client->response_off += bytes_copied;
 		}
-
-		/* Clear data pending flag */
-		atomic_set(&dev->data_pending, 0);
 	} 
 
-	mutex_unlock(&dev->buffer_mutex);
+exit:
+	/* The whole response was consumed, the next one starts over */
+	if (!client->response_length)
+		client->response_off = 0;
+
+	mutex_unlock(&client->buffer_mutex);
 	return bytes_copied;
 }
 
-
-
 /**
- * tpmp_write() - Write data to USB and copy the response into kernel space memory
+ * tpmp_write() - Queue a command for USB
  * @file: File pointer
  * @buffer: Userspace buffer to send to USB
  * @count: Number of byes to send
  * @ppos: Not used
  *
- * Writes the given buffer to USB then reads the response and stores it. The response 
- * can be read via tpmp_read. Will not overwrite data from a previous call. 
+ * Queues the given buffer on the device and returns without waiting for the
+ * response. The response can be read via tpmp_read once it arrives, which
+ * tpmp_poll reports as readable. Will not overwrite data from a previous call.
  *
  * Return: 
- 	Number of bytes copied if >=0
+ 	Number of bytes queued if >=0
 	-E2BIG on count exceeding max write size
-	-EBUSY on buffer already being occupied
+	-EINVAL if the command header does not announce count bytes
+	-EBUSY on a command queued or a response not read yet
 	-EFAULT on memory copy error
+	-ENODEV if the device was disconnected
  */
 static ssize_t tpmp_write(struct file *file, const char __user *user_buffer,
 			  size_t count, loff_t *ppos)
 {
+	struct tpmp_client *client;
 	struct usb_tpmp *dev;
-	int retval = 0;
-	unsigned int pipe;
-	int actual_len_recvd;
-	int actual_len_sent;
+	ssize_t actual_len_sent;
 
 	/* Initialize local variables */
-	dev = file->private_data;
-	actual_len_recvd=0;
-	actual_len_sent=0;
+	client = file->private_data;
+	dev = client->dev;
+	actual_len_sent = count;
 
 
 	/* Verify the requested data isnt too large */
-	if (count > TPM_BUFSIZE) {
+	if (count > dev->bufsiz) {
 		actual_len_sent = -E2BIG;
 		goto err;
 	}
 
+	if (!READ_ONCE(dev->interface)) {
+		actual_len_sent = -ENODEV;
+		goto err;
+	}
+
 	/* Lock the buffer memory mutex */
-	mutex_lock(&dev->buffer_mutex);
+	mutex_lock(&client->buffer_mutex);
 
 	/* Make sure we aren't overriding anything */
-	if (atomic_read(&dev->data_pending) != 0) {
+	if (client->cmd_queued || client->errors ||
+	    client->response_length != 0) {
+		tpmp_stats_count_busy(dev);
 		actual_len_sent = -EBUSY;
 		goto err_unlock_buffer;
 	}
 
 	/* Copy message to kernel space */
-	if (copy_from_user(dev->data_buffer, user_buffer, count)) {
+	if (copy_from_user(client->data_buffer, user_buffer, count)) {
 		actual_len_sent = -EFAULT;
 		goto err_unlock_buffer;
 	}
 
-	/* Write to the USB device */
-	mutex_lock(&dev->usb_mutex);
+	if (!tpmp_tpm_command_size_ok(client->data_buffer, count)) {
+		actual_len_sent = -EINVAL;
+		goto err_unlock_buffer;
+	}
 
-	//Make sure the USB device is still open
-	if(!dev->interface) {
-		actual_len_sent = -ENODEV;
-		goto err_unlock_usb;
+	client->cmd.client = client;
+	client->cmd.buf = client->data_buffer;
+	client->cmd.len = count;
+	client->cmd.bufsiz = dev->bufsiz;
+	client->cmd.complete = tpmp_client_complete;
+	client->cmd_queued = true;
+	tpmp_queue_cmd(dev, &client->cmd);
+
+	err_unlock_buffer:
+	mutex_unlock(&client->buffer_mutex);
+
+	err:
+	return actual_len_sent;
+}
+
+/**
+ * tpmp_poll() - Report whether a response can be read or a command written
+ * @file: File pointer
+ * @wait: Poll table
+ *
+ * Return: EPOLLIN once the queued command completed, EPOLLOUT while no
+ * command is queued and no response is waiting, EPOLLHUP after disconnect.
+ */
+static __poll_t tpmp_poll(struct file *file, poll_table *wait)
+{
+	struct tpmp_client *client = file->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(file, &client->wait, wait);
+
+	mutex_lock(&client->buffer_mutex);
+	if (!client->cmd_queued) {
+		if (client->errors || client->response_length)
+			mask |= EPOLLIN | EPOLLRDNORM;
+		else
+			mask |= EPOLLOUT | EPOLLWRNORM;
 	}
+	mutex_unlock(&client->buffer_mutex);
+
+	mask |= tpmp_ring_poll(client);
+
+	if (!READ_ONCE(client->dev->interface))
+		mask |= EPOLLHUP | EPOLLERR;
+
+	return mask;
+}
+
+/**
+ * tpmp_ioctl_transact() - Send one command and copy back its response
+ * @client: Client issuing the command
+ * @argp: Userspace struct tpmp_transaction
+ *
+ * Does what a write() followed by a blocking read() does, in one call. If
+ * interrupted by a signal, the command still completes and its response is
+ * left to be read().
+ *
+ * Return:
+ 	0 if the response was copied back
+	-E2BIG on a command exceeding max write size
+	-EINVAL on a nonzero reserved field, or a header not announcing
+	 command_size bytes
+	-EBUSY on a command queued or a response not read yet
+	-ENOSPC if the response does not fit, it is left to be read()
+	-ERESTARTSYS if interrupted by a signal
+	-EFAULT on memory copy error
+	other negative errno if the command failed on USB
+ */
+static long tpmp_ioctl_transact(struct tpmp_client *client,
+				struct tpmp_transaction __user *argp)
+{
+	struct usb_tpmp *dev = client->dev;
+	struct tpmp_transaction xfer;
+	long retval;
 
-	pipe = usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr);
-	retval = usb_bulk_msg(dev->udev, pipe, dev->data_buffer, count, &actual_len_sent,
-		TPMP_USB_TIMEOUT_MS);
+	if (copy_from_user(&xfer, argp, sizeof(xfer)))
+		return -EFAULT;
 
-	if(retval) {
-		actual_len_sent=retval;
-		goto err_unlock_usb;
+	if (xfer.reserved)
+		return -EINVAL;
+
+	if (xfer.command_size > dev->bufsiz)
+		return -E2BIG;
+
+	if (!READ_ONCE(dev->interface))
+		return -ENODEV;
+
+	mutex_lock(&client->buffer_mutex);
+	if (client->cmd_queued || client->errors ||
+	    client->response_length != 0) {
+		tpmp_stats_count_busy(dev);
+		mutex_unlock(&client->buffer_mutex);
+		return -EBUSY;
+	}
+
+	if (copy_from_user(client->data_buffer,
+			   u64_to_user_ptr(xfer.command), xfer.command_size)) {
+		mutex_unlock(&client->buffer_mutex);
+		return -EFAULT;
 	}
 
-	/* Read from the device into our buffer */
-	pipe = usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr);
-	retval = usb_bulk_msg(dev->udev, pipe, dev->data_buffer, TPM_BUFSIZE, &actual_len_recvd,
-		TPMP_USB_TIMEOUT_MS);
+	if (!tpmp_tpm_command_size_ok(client->data_buffer, xfer.command_size)) {
+		mutex_unlock(&client->buffer_mutex);
+		return -EINVAL;
+	}
 
-	if(retval) {
-		actual_len_sent=retval;
-		goto err_unlock_usb;
+	client->cmd.client = client;
+	client->cmd.buf = client->data_buffer;
+	client->cmd.len = xfer.command_size;
+	client->cmd.bufsiz = dev->bufsiz;
+	client->cmd.complete = tpmp_client_complete;
+	client->cmd_queued = true;
+	tpmp_queue_cmd(dev, &client->cmd);
+	mutex_unlock(&client->buffer_mutex);
+
+	retval = wait_event_interruptible(client->wait,
+					  !READ_ONCE(client->cmd_queued));
+	if (retval < 0)
+		return retval;
+
+	mutex_lock(&client->buffer_mutex);
+	if (client->errors) {
+		retval = client->errors;
+		client->errors = 0;
+		goto exit;
 	}
 
-	/* Record the number of bytes recieved */
-	atomic_set(&dev->data_pending, actual_len_recvd);
+	if (client->response_length > xfer.response_size) {
+		retval = -ENOSPC;
+		goto exit;
+	}
 
-	err_unlock_usb:
-	mutex_unlock(&dev->usb_mutex);
+	xfer.response_size = client->response_length;
+	xfer.status = 0;
+	client->response_length = 0;
+	if (copy_to_user(u64_to_user_ptr(xfer.response),
+			 client->data_buffer + client->response_off,
+			 xfer.response_size) ||
+	    copy_to_user(argp, &xfer, sizeof(xfer)))
+		retval = -EFAULT;
+	client->response_off = 0;
+
+	exit:
+	mutex_unlock(&client->buffer_mutex);
+	return retval;
+}
 
-	err_unlock_buffer:
+/**
+ * tpmp_batch_one() - Run one entry of a batch
+ * @dev: Device, with buffer_mutex and usb_mutex held
+ * @xfer: Entry to run, its response_size and status are updated
+ */
+static void tpmp_batch_one(struct usb_tpmp *dev, struct tpmp_transaction *xfer)
+{
+	int retval;
+
+	if (xfer->command_size > dev->bufsiz) {
+		xfer->status = -E2BIG;
+		return;
+	}
+
+	if (copy_from_user(dev->data_buffer, u64_to_user_ptr(xfer->command),
+			   xfer->command_size)) {
+		xfer->status = -EFAULT;
+		return;
+	}
+
+	if (!tpmp_tpm_command_size_ok(dev->data_buffer, xfer->command_size)) {
+		xfer->status = -EINVAL;
+		return;
+	}
+
+	retval = tpmp_transmit(dev, xfer->command_size);
+	if (retval < 0) {
+		xfer->status = retval;
+		return;
+	}
+
+	if (retval > xfer->response_size) {
+		xfer->status = -ENOSPC;
+		return;
+	}
+
+	if (copy_to_user(u64_to_user_ptr(xfer->response), dev->data_buffer,
+			 retval)) {
+		xfer->status = -EFAULT;
+		return;
+	}
+
+	xfer->response_size = retval;
+	xfer->status = 0;
+}
+
+/*
+ * Pack entries into the data buffer as the records of a batch frame, for as
+ * long as their commands fit and their response buffers would too. Batches
+ * are kept to TPM_BUFSIZE, which any gadget taking them can receive.
+ *
+ * Return: number of entries packed, the batch length in @len
+ */
+static u32 tpmp_batch_pack(struct usb_tpmp *dev,
+			   struct tpmp_transaction *entries, u32 count,
+			   size_t *len, unsigned int *timeout_ms)
+{
+	size_t cap = min_t(size_t, dev->bufsiz, TPM_BUFSIZE);
+	size_t cmd_len = 0, rsp_len = 0, cmd_pad, rsp_pad;
+	struct tpmp_frame_rec *rec;
+	unsigned int fixed_ms = READ_ONCE(dev->timeout_ms);
+	u8 *cmd;
+	u32 n;
+
+	*timeout_ms = 0;
+	for (n = 0; n < count; n++) {
+		if (entries[n].command_size > cap)
+			break;
+
+		cmd_pad = ALIGN(entries[n].command_size, TPMP_REC_ALIGN);
+		rsp_pad = ALIGN(min_t(size_t, entries[n].response_size, cap),
+				TPMP_REC_ALIGN);
+		if (cmd_len + TPMP_REC_SIZE + cmd_pad > cap ||
+		    rsp_len + TPMP_REC_SIZE + rsp_pad > cap)
+			break;
+
+		rec = (struct tpmp_frame_rec *)(dev->data_buffer + cmd_len);
+		cmd = dev->data_buffer + cmd_len + TPMP_REC_SIZE;
+		if (copy_from_user(cmd, u64_to_user_ptr(entries[n].command),
+				   entries[n].command_size) ||
+		    !tpmp_tpm_command_size_ok(cmd, entries[n].command_size))
+			break;
+
+		rec->len = cpu_to_le32(entries[n].command_size);
+		rec->status = 0;
+		memset(cmd + entries[n].command_size, 0,
+		       cmd_pad - entries[n].command_size);
+		tpmp_cache_snoop(dev, cmd, entries[n].command_size);
+		*timeout_ms += fixed_ms ? fixed_ms :
+			tpmp_tpm_timeout_ms(cmd, entries[n].command_size);
+
+		cmd_len += TPMP_REC_SIZE + cmd_pad;
+		rsp_len += TPMP_REC_SIZE + rsp_pad;
+	}
+
+	*len = cmd_len;
+	return n;
+}
+
+/* Hand the responses of a batch frame of @received bytes to its entries */
+static void tpmp_batch_unpack(struct usb_tpmp *dev,
+			      struct tpmp_transaction *entries, u32 count,
+			      size_t received)
+{
+	const struct tpmp_frame_rec *rec;
+	size_t off = 0, len;
+	u32 n;
+
+	for (n = 0; n < count; n++) {
+		/* The gadget skips the commands after a failed one if asked */
+		if (received - off < TPMP_REC_SIZE) {
+			entries[n].status = -ECANCELED;
+			continue;
+		}
+
+		rec = (const struct tpmp_frame_rec *)(dev->data_buffer + off);
+		len = le32_to_cpu(rec->len);
+		off += TPMP_REC_SIZE;
+		if (len > received - off) {
+			entries[n].status = -EIO;
+			off = received;
+			continue;
+		}
+
+		switch (le32_to_cpu(rec->status)) {
+		case TPMP_REC_OK:
+			if (len > entries[n].response_size) {
+				entries[n].status = -ENOSPC;
+			} else if (copy_to_user(u64_to_user_ptr(entries[n].response),
+						dev->data_buffer + off, len)) {
+				entries[n].status = -EFAULT;
+			} else {
+				entries[n].response_size = len;
+				entries[n].status = 0;
+			}
+			break;
+		case TPMP_REC_TRUNCATED:
+			entries[n].status = -ENOSPC;
+			break;
+		default:
+			entries[n].status = -EIO;
+			break;
+		}
+
+		off += min_t(size_t, ALIGN(len, TPMP_REC_ALIGN), received - off);
+	}
+}
+
+static bool tpmp_batch_stop(const struct tpmp_transaction *xfer, u32 flags)
+{
+	return xfer->status == -ENODEV ||
+	       (xfer->status && flags & TPMP_BATCH_STOP_ON_ERROR);
+}
+
+/**
+ * tpmp_ioctl_batch() - Send several commands back-to-back
+ * @client: Client issuing the commands
+ * @argp: Userspace struct tpmp_batch
+ *
+ * Holds the device for the whole batch, so commands of other clients cannot
+ * run in between, e.g. inside a session the batch sets up and flushes. Each
+ * entry gets its own status; after a failed entry the batch goes on unless
+ * TPMP_BATCH_STOP_ON_ERROR is set, and always stops once the device is gone.
+ *
+ * If the gadget takes batch frames, consecutive entries are sent together in
+ * one bulk transfer each way. A failed batch frame fails all its entries, and
+ * entries the gadget skipped after a failed one get -ECANCELED.
+ *
+ * Return:
+ 	0 if the entries were run, see their status and batch.completed
+	-EINVAL on an empty or too long batch, unknown flags or a nonzero
+	 reserved field, also in an entry
+	-EBUSY on a command queued or a response not read yet
+	-ENOMEM on allocation failure
+	-EFAULT on memory copy error
+ */
+static long tpmp_ioctl_batch(struct tpmp_client *client,
+			     struct tpmp_batch __user *argp)
+{
+	struct usb_tpmp *dev = client->dev;
+	struct tpmp_transaction *entries;
+	struct tpmp_batch batch;
+	unsigned int timeout_ms;
+	long retval = 0;
+	size_t len;
+	u32 i, n, end;
+	u16 frame_flags;
+	int ret;
+
+	if (copy_from_user(&batch, argp, sizeof(batch)))
+		return -EFAULT;
+
+	if (!batch.count || batch.count > TPMP_BATCH_MAX ||
+	    batch.flags & ~TPMP_BATCH_STOP_ON_ERROR || batch.reserved)
+		return -EINVAL;
+
+	entries = memdup_user(u64_to_user_ptr(batch.entries),
+			      batch.count * sizeof(*entries));
+	if (IS_ERR(entries))
+		return PTR_ERR(entries);
+
+	for (i = 0; i < batch.count; i++) {
+		if (entries[i].reserved) {
+			kfree(entries);
+			return -EINVAL;
+		}
+	}
+
+	/* Keep this client from queueing a write() while the batch runs */
+	mutex_lock(&client->buffer_mutex);
+	if (client->cmd_queued || client->errors ||
+	    client->response_length != 0) {
+		tpmp_stats_count_busy(dev);
+		retval = -EBUSY;
+		goto exit;
+	}
+
+	frame_flags = batch.flags & TPMP_BATCH_STOP_ON_ERROR ?
+		      TPMP_FRAME_STOP_ON_ERROR : 0;
+	mutex_lock(&dev->buffer_mutex);
+	mutex_lock(&dev->usb_mutex);
+	i = 0;
+	while (i < batch.count) {
+		n = 0;
+		if (dev->batching)
+			n = tpmp_batch_pack(dev, &entries[i], batch.count - i,
+					    &len, &timeout_ms);
+		if (n > 1) {
+			ret = tpmp_transmit_batch(dev, len, frame_flags,
+						  timeout_ms);
+			if (ret < 0) {
+				for (end = i; end < i + n; end++)
+					entries[end].status = ret;
+			} else {
+				tpmp_batch_unpack(dev, &entries[i], n, ret);
+			}
+		} else {
+			n = 1;
+			tpmp_batch_one(dev, &entries[i]);
+		}
+
+		for (end = i + n; i < end; i++) {
+			if (tpmp_batch_stop(&entries[i], batch.flags)) {
+				i++;
+				goto done;
+			}
+		}
+	}
+	done:
+	atomic_set(&dev->data_pending, 0);
+	mutex_unlock(&dev->usb_mutex);
 	mutex_unlock(&dev->buffer_mutex);
 
-	err:
-	return actual_len_sent;
+	batch.completed = i;
+	if (copy_to_user(u64_to_user_ptr(batch.entries), entries,
+			 batch.count * sizeof(*entries)) ||
+	    copy_to_user(argp, &batch, sizeof(batch)))
+		retval = -EFAULT;
+
+	exit:
+	mutex_unlock(&client->buffer_mutex);
+	kfree(entries);
+	return retval;
+}
+
+static long tpmp_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct tpmp_client *client = file->private_data;
+
+	switch (cmd) {
+	case TPMP_IOC_TRANSACT:
+		return tpmp_ioctl_transact(client, (void __user *)arg);
+	case TPMP_IOC_BATCH:
+		return tpmp_ioctl_batch(client, (void __user *)arg);
+	case TPMP_IOC_RING_SETUP:
+		return tpmp_ring_setup(client, (void __user *)arg);
+	case TPMP_IOC_RING_ENTER:
+		return tpmp_ring_enter(client);
+	default:
+		return -ENOTTY;
+	}
 }
 
 static const struct file_operations tpmp_fops = {
 	.owner =	THIS_MODULE,
 	.read =	tpmp_read,
 	.write =	tpmp_write,
+	.poll =		tpmp_poll,
+	.unlocked_ioctl = tpmp_ioctl,
+	.compat_ioctl =	compat_ptr_ioctl,
+	.mmap =		tpmp_ring_mmap,
+#ifdef TPMP_HAVE_URING_CMD
+	.uring_cmd =	tpmp_uring_cmd,
+#endif
 	.open =	tpmp_open,
 	.release =	tpmp_release,
 	.llseek =	no_llseek,
 };
 
+static ssize_t timeout_ms_show(struct device *d,
+			       struct device_attribute *attr, char *buf)
+{
+	struct usb_tpmp *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sprintf(buf, "%u\n", READ_ONCE(dev->timeout_ms));
+}
+
+static ssize_t timeout_ms_store(struct device *d,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct usb_tpmp *dev = usb_get_intfdata(to_usb_interface(d));
+	unsigned int val;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &val);
+	if (retval)
+		return retval;
+
+	WRITE_ONCE(dev->timeout_ms, val);
+	return count;
+}
+static DEVICE_ATTR_RW(timeout_ms);
+
+static ssize_t recovery_ms_show(struct device *d,
+				struct device_attribute *attr, char *buf)
+{
+	struct usb_tpmp *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sprintf(buf, "%u\n", READ_ONCE(dev->recovery_ms));
+}
+static DEVICE_ATTR_RO(recovery_ms);
+
+/* Round trip of a control request to the gadget, a health check */
+static ssize_t ping_us_show(struct device *d,
+			    struct device_attribute *attr, char *buf)
+{
+	struct usb_tpmp *dev = usb_get_intfdata(to_usb_interface(d));
+	ktime_t start = ktime_get();
+	int retval;
+
+	retval = tpmp_vendor_request(dev, TPMP_REQ_PING, NULL, 0);
+	if (retval < 0)
+		return retval;
+
+	return sprintf(buf, "%lld\n", ktime_us_delta(ktime_get(), start));
+}
+static DEVICE_ATTR_RO(ping_us);
+
+static struct attribute *tpmp_attrs[] = {
+	&dev_attr_timeout_ms.attr,
+	&dev_attr_recovery_ms.attr,
+	&dev_attr_ping_us.attr,
+	NULL,
+};
+
+static const struct attribute_group tpmp_attr_group = {
+	.attrs = tpmp_attrs,
+};
+
 /*
  * usb class driver info in order to get a minor number from the usb core,
  * and to have the device registered with the driver core
@@ -289,11 +1647,165 @@ static struct usb_class_driver tpmp_class = {
 	.minor_base = USB_TPMP_MINOR_BASE,
 };
 
+static int tpmp_alloc_buffer(struct usb_tpmp *dev, size_t bufsiz)
+{
+	u8 *buffer;
+	dma_addr_t dma;
+
+	buffer = usb_alloc_coherent(dev->udev, TPMP_FRAME_SIZE + bufsiz,
+				    GFP_KERNEL, &dma);
+	if (!buffer)
+		return -ENOMEM;
+
+	tpmp_free_buffer(dev);
+	dev->data_buffer = buffer + TPMP_FRAME_SIZE;
+	dev->data_dma = dma + TPMP_FRAME_SIZE;
+	dev->io_buffer = dev->data_buffer;
+	dev->bufsiz = bufsiz;
+
+	usb_fill_bulk_urb(dev->bulk_out_urb, dev->udev,
+			  usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
+			  dev->data_buffer, 0, tpmp_write_bulk_callback, dev);
+	dev->bulk_out_urb->transfer_dma = dev->data_dma;
+	/* The gadget reads commands up to a short packet, end them with one */
+	dev->bulk_out_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP |
+					     URB_ZERO_PACKET;
+
+	usb_fill_bulk_urb(dev->bulk_in_urb, dev->udev,
+			  usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
+			  dev->data_buffer, dev->bufsiz, tpmp_read_bulk_callback, dev);
+	dev->bulk_in_urb->transfer_dma = dev->data_dma;
+	dev->bulk_in_urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+	return 0;
+}
+
+/*
+ * Ask the gadget for its capabilities. Gadgets without vendor requests stall
+ * it and are left with gadget_version 0.
+ */
+static void tpmp_read_caps(struct usb_tpmp *dev)
+{
+	struct tpmp_caps caps;
+	int retval;
+
+	retval = tpmp_vendor_request(dev, TPMP_REQ_CAPS, &caps, sizeof(caps));
+	if (retval < (int)sizeof(caps)) {
+		dev_dbg(&dev->interface->dev,
+			"gadget does not report its capabilities: %d\n", retval);
+		return;
+	}
+
+	dev->gadget_version = le16_to_cpu(caps.version);
+	dev->gadget_features = le16_to_cpu(caps.features);
+	dev->gadget_max_cmd = le32_to_cpu(caps.max_cmd);
+	dev->tpm_family = caps.tpm_family;
+	dev_info(&dev->interface->dev,
+		 "gadget protocol %u, features 0x%x, commands up to %u bytes, TPM family %u\n",
+		 dev->gadget_version, dev->gadget_features,
+		 dev->gadget_max_cmd, dev->tpm_family);
+}
+
+/*
+ * Offer framing to the gadget with a HELLO frame, see tpmproxy-proto.h.
+ * Called at probe, before any other command is sent.
+ *
+ * An older gadget hands the HELLO to its TPM as a command and returns the
+ * TPM's error response. Should that come after TPMP_HELLO_TIMEOUT_MS, it
+ * would be read as the response to the next command, so it is waited for
+ * as long as for a command of unknown duration before framing is given up.
+ */
+static void tpmp_negotiate_framing(struct usb_tpmp *dev, size_t maxp)
+{
+	struct tpmp_frame *frame;
+	size_t len = max_t(size_t, maxp, TPMP_FRAME_SIZE);
+	unsigned int late_ms;
+	int actual;
+	int retval;
+
+	/* The gadget said it has no framing, the HELLO would only reach its TPM */
+	if (dev->gadget_version && !(dev->gadget_features & TPMP_FEAT_FRAMING)) {
+		dev_warn(&dev->interface->dev,
+			 "gadget does not support framing, using raw transfers\n");
+		return;
+	}
+
+	frame = kzalloc(len, GFP_KERNEL);
+	if (!frame)
+		return;
+
+	frame->magic = cpu_to_le32(TPMP_FRAME_MAGIC);
+	frame->type = cpu_to_le16(TPMP_FRAME_HELLO);
+	frame->flags = cpu_to_le16(TPMP_FEAT_FRAMING | TPMP_FEAT_BATCH);
+	late_ms = tpmp_tpm_timeout_ms((const u8 *)frame, TPMP_FRAME_SIZE);
+
+	retval = usb_bulk_msg(dev->udev,
+			      usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
+			      frame, TPMP_FRAME_SIZE, &actual,
+			      TPMP_HELLO_TIMEOUT_MS);
+	if (!retval)
+		retval = usb_bulk_msg(dev->udev,
+				      usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
+				      frame, len, &actual, TPMP_HELLO_TIMEOUT_MS);
+	if (retval == -ETIMEDOUT)
+		retval = usb_bulk_msg(dev->udev,
+				      usb_rcvbulkpipe(dev->udev, dev->bulk_in_endpointAddr),
+				      frame, len, &actual, late_ms);
+
+	if (!retval && actual >= TPMP_FRAME_SIZE &&
+	    le32_to_cpu(frame->magic) == TPMP_FRAME_MAGIC &&
+	    le16_to_cpu(frame->type) == TPMP_FRAME_HELLO &&
+	    le16_to_cpu(frame->flags) & TPMP_FEAT_FRAMING) {
+		dev->framing = true;
+		dev->batching = le16_to_cpu(frame->flags) & TPMP_FEAT_BATCH;
+	} else {
+		dev_warn(&dev->interface->dev,
+			 "gadget does not support framing, using raw transfers\n");
+	}
+
+	kfree(frame);
+}
+
+/*
+ * Ask the card TPM for its max command and response sizes. TPM 1.2 and
+ * cards that don't answer keep the default buffer size.
+ */
+static size_t tpmp_query_bufsiz(struct usb_tpmp *dev)
+{
+	size_t bufsiz = 0;
+	int retval;
+
+	mutex_lock(&dev->buffer_mutex);
+	mutex_lock(&dev->usb_mutex);
+	retval = tpmp_transmit(dev, tpmp_tpm2_max_size_cmd(dev->data_buffer));
+	mutex_unlock(&dev->usb_mutex);
+	if (retval > 0)
+		bufsiz = tpmp_tpm2_parse_max_size(dev->data_buffer, retval);
+	atomic_set(&dev->data_pending, 0);
+	mutex_unlock(&dev->buffer_mutex);
+
+	return bufsiz;
+}
+
+/*
+ * Called once probe can no longer fail, so the error paths need not undo it.
+ */
+static void tpmp_enable_autosuspend(struct usb_tpmp *dev)
+{
+	if (!autosuspend_ms)
+		return;
+
+	dev->pm_delay_ms = autosuspend_ms;
+	pm_runtime_set_autosuspend_delay(&dev->udev->dev, autosuspend_ms);
+	usb_enable_autosuspend(dev->udev);
+}
+
 static int tpmp_probe(struct usb_interface *interface,
 		      const struct usb_device_id *id)
 {
 	struct usb_tpmp *dev;
 	struct usb_endpoint_descriptor *bulk_in, *bulk_out;
+	size_t bufsiz;
 	int retval;
 
 	/* allocate memory for our device state and initialize it */
@@ -304,10 +1816,23 @@ static int tpmp_probe(struct usb_interface *interface,
 	kref_init(&dev->kref);
 	mutex_init(&dev->usb_mutex);
 	mutex_init(&dev->buffer_mutex);
+	mutex_init(&dev->ctrl_mutex);
+	spin_lock_init(&dev->err_lock);
+	init_usb_anchor(&dev->submitted);
+	init_waitqueue_head(&dev->bulk_in_wait);
+	init_waitqueue_head(&dev->reset_wait);
+	INIT_DELAYED_WORK(&dev->timeout_work, tpmp_timeout_work);
+	spin_lock_init(&dev->queue_lock);
+	INIT_LIST_HEAD(&dev->ready_clients);
+	INIT_WORK(&dev->tx_work, tpmp_tx_work);
 
 	dev->udev = usb_get_dev(interface_to_usbdev(interface));
 	dev->interface = interface;
-	dev->is_open=0;
+
+	tpmp_cache_init(dev);
+	retval = tpmp_stats_init(dev);
+	if (retval)
+		goto error;
 
 	/* set up the endpoint information */
 	/* use only the first bulk-in and bulk-out endpoints */
@@ -320,33 +1845,103 @@ static int tpmp_probe(struct usb_interface *interface,
 	}
 
 	dev->bulk_in_endpointAddr = bulk_in->bEndpointAddress;
-	dev->data_buffer = kmalloc(TPM_BUFSIZE,GFP_KERNEL);
-	if (!dev->data_buffer) {
+	dev->bulk_out_endpointAddr = bulk_out->bEndpointAddress;
+
+	/*
+	 * Allocate the urbs and the DMA buffer for the life of the device so
+	 * commands don't pay for allocation and mapping on every transfer.
+	 */
+	dev->bulk_out_urb = usb_alloc_urb(0, GFP_KERNEL);
+	dev->bulk_in_urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!dev->bulk_out_urb || !dev->bulk_in_urb) {
 		retval = -ENOMEM;
 		goto error;
 	}
 
-	dev->bulk_out_endpointAddr = bulk_out->bEndpointAddress;
+	retval = tpmp_alloc_buffer(dev, TPM_BUFSIZE);
+	if (retval)
+		goto error;
+
+	tpmp_read_caps(dev);
+	if (framing)
+		tpmp_negotiate_framing(dev, usb_endpoint_maxp(bulk_in));
+
+	/* Grow the buffer to what the card TPM advertises and the gadget takes */
+	bufsiz = 0;
+	if (dev->tpm_family != TPMP_FAMILY_TPM12)
+		bufsiz = tpmp_query_bufsiz(dev);
+	if (dev->gadget_max_cmd)
+		bufsiz = min_t(size_t, bufsiz, dev->gadget_max_cmd);
+	if (bufsiz > dev->bufsiz) {
+		bufsiz = round_up(min_t(size_t, bufsiz, TPMP_MAX_BUFSIZE),
+				  usb_endpoint_maxp(bulk_in));
+		retval = tpmp_alloc_buffer(dev, bufsiz);
+		if (retval)
+			goto error;
+	}
+	dev_dbg(&interface->dev, "using %zu byte buffers\n", dev->bufsiz);
 
 	/* save our data pointer in this interface device */
 	usb_set_intfdata(interface, dev);
 
+	retval = sysfs_create_group(&interface->dev.kobj, &tpmp_attr_group);
+	if (retval) {
+		dev_err(&interface->dev,
+			"Not able to create sysfs attributes: %d\n", retval);
+		usb_set_intfdata(interface, NULL);
+		goto error;
+	}
+
+	retval = tpmp_stats_register(dev);
+	if (retval) {
+		dev_err(&interface->dev,
+			"Not able to create statistics: %d\n", retval);
+		goto error_attrs;
+	}
+
+	if (chip_mode) {
+		retval = tpmp_chip_register(dev);
+		if (retval) {
+			dev_err(&interface->dev,
+				"Not able to register with the TPM core: %d\n",
+				retval);
+			goto error_sysfs;
+		}
+
+		tpmp_enable_autosuspend(dev);
+		dev_info(&interface->dev,
+			 "USB TPM proxy device now registered with the TPM core");
+		return 0;
+	}
+
 	/* we can register the device now, as it is ready */
 	retval = usb_register_dev(interface, &tpmp_class);
 	if (retval) {
 		/* something prevented us from registering this driver */
 		dev_err(&interface->dev,
 			"Not able to get a minor for this device.\n");
-		usb_set_intfdata(interface, NULL);
-		goto error;
+		goto error_sysfs;
 	}
 
+	tpmp_enable_autosuspend(dev);
+
+	/* the TPM core registers its own hwrng in chip mode, so only here */
+	retval = tpmp_rng_register(dev);
+	if (retval)
+		dev_warn(&interface->dev,
+			 "Not able to register as hwrng: %d\n", retval);
+
 	/* let the user know what node this device is now attached to */
 	dev_info(&interface->dev,
 		 "USB TPM proxy device now attached to tpmp%d",
 		 interface->minor);
 	return 0;
 
+error_sysfs:
+	tpmp_stats_unregister(dev);
+error_attrs:
+	sysfs_remove_group(&interface->dev.kobj, &tpmp_attr_group);
+	usb_set_intfdata(interface, NULL);
 error:
 	/* this frees allocated memory */
 	kref_put(&dev->kref, tpmp_delete);
@@ -360,16 +1955,35 @@ static void tpmp_disconnect(struct usb_interface *interface)
 	int minor = interface->minor;
 
 	dev = usb_get_intfdata(interface);
+	trace_tpmp_disconnect(dev);
+	tpmp_rng_unregister(dev);
+	tpmp_stats_unregister(dev);
+	sysfs_remove_group(&interface->dev.kobj, &tpmp_attr_group);
 	usb_set_intfdata(interface, NULL);
 
-	/* give back our minor */
-	usb_deregister_dev(interface, &tpmp_class);
+	/* give back our minor or leave the TPM core */
+	if (dev->chip)
+		tpmp_chip_unregister(dev);
+	else
+		usb_deregister_dev(interface, &tpmp_class);
+
+	/* a reset that never finished must not keep a command waiting */
+	spin_lock_irq(&dev->err_lock);
+	dev->resetting = false;
+	spin_unlock_irq(&dev->err_lock);
+	wake_up(&dev->reset_wait);
 
 	/* prevent more I/O from starting */
 	mutex_lock(&dev->usb_mutex);
+	mutex_lock(&dev->ctrl_mutex);
 	dev->interface = NULL;
+	mutex_unlock(&dev->ctrl_mutex);
 	mutex_unlock(&dev->usb_mutex);
 
+	usb_kill_anchored_urbs(&dev->submitted);
+	wake_up(&dev->bulk_in_wait);
+	tpmp_cache_clear(dev);
+
 	/* decrement our usage count */
 	kref_put(&dev->kref, tpmp_delete);
 
@@ -382,11 +1996,18 @@ static int tpmp_suspend(struct usb_interface *intf, pm_message_t message)
 
 	if (!dev)
 		return 0;
+
+	/* commands hold a PM reference, this only catches a racing submit */
+	if (PMSG_IS_AUTO(message) && READ_ONCE(dev->ongoing_io))
+		return -EBUSY;
+
+	usb_kill_anchored_urbs(&dev->submitted);
 	return 0;
 }
 
 static int tpmp_resume(struct usb_interface *intf)
 {
+	/* commands are only submitted with the card resumed, nothing to restart */
 	return 0;
 }
 
@@ -394,7 +2015,21 @@ static int tpmp_pre_reset(struct usb_interface *intf)
 {
 	struct usb_tpmp *dev = usb_get_intfdata(intf);
 
+	trace_tpmp_pre_reset(dev);
+	dev->recovery_start = ktime_get();
+
+	/*
+	 * Fail the command in flight first, its sender then drops usb_mutex
+	 * and waits for post_reset to send it again.
+	 */
+	spin_lock_irq(&dev->err_lock);
+	dev->resetting = true;
+	spin_unlock_irq(&dev->err_lock);
+	usb_kill_anchored_urbs(&dev->submitted);
+
 	mutex_lock(&dev->usb_mutex);
+	tpmp_stats_count_reset(dev);
+	tpmp_cache_clear(dev);
 
 	return 0;
 }
@@ -403,8 +2038,17 @@ static int tpmp_post_reset(struct usb_interface *intf)
 {
 	struct usb_tpmp *dev = usb_get_intfdata(intf);
 
+	WRITE_ONCE(dev->recovery_ms,
+		   ktime_ms_delta(ktime_get(), dev->recovery_start));
+
+	spin_lock_irq(&dev->err_lock);
+	dev->resetting = false;
+	spin_unlock_irq(&dev->err_lock);
+
 	/* we are sure no URBs are active - no locking needed */
 	mutex_unlock(&dev->usb_mutex);
+	wake_up(&dev->reset_wait);
+	trace_tpmp_post_reset(dev);
 
 	return 0;
 }
@@ -421,6 +2065,26 @@ static struct usb_driver tpmp_driver = {
 	.supports_autosuspend = 1,
 };
 
-module_usb_driver(tpmp_driver);
+static int __init tpmp_init(void)
+{
+	int retval;
+
+	tpmp_debugfs_init();
+
+	retval = usb_register(&tpmp_driver);
+	if (retval)
+		tpmp_debugfs_exit();
+
+	return retval;
+}
+
+static void __exit tpmp_exit(void)
+{
+	usb_deregister(&tpmp_driver);
+	tpmp_debugfs_exit();
+}
+
+module_init(tpmp_init);
+module_exit(tpmp_exit);
 
 MODULE_LICENSE("GPL v2");
@@ -0,0 +1,130 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ *  Copyright (c) 2018-2019 Xaptum, Inc.
+ *
+ * Userspace interface of the TPM proxy character device
+ */
+
+#ifndef _TPMPROXY_IOCTL_H
+#define _TPMPROXY_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define TPMP_IOC_MAGIC		0xA3
+
+/**
+ * struct tpmp_transaction - One TPM command and its response
+ * @command: Pointer to the command
+ * @response: Pointer to the buffer receiving the response
+ * @command_size: Length of the command
+ * @response_size: Size of the response buffer, set to the response length
+ * @status: Set to 0 or a negative errno for this command
+ * @reserved: Must be 0
+ */
+struct tpmp_transaction {
+	__u64 command;
+	__u64 response;
+	__u32 command_size;
+	__u32 response_size;
+	__s32 status;
+	__u32 reserved;
+};
+
+/* Stop a batch at the first entry that fails */
+#define TPMP_BATCH_STOP_ON_ERROR	(1 << 0)
+
+#define TPMP_BATCH_MAX			64
+
+/**
+ * struct tpmp_batch - Commands to run back-to-back
+ * @entries: Pointer to an array of struct tpmp_transaction
+ * @count: Number of entries, at most TPMP_BATCH_MAX
+ * @flags: TPMP_BATCH_* flags
+ * @completed: Set to the number of entries that were run
+ * @reserved: Must be 0
+ */
+struct tpmp_batch {
+	__u64 entries;
+	__u32 count;
+	__u32 flags;
+	__u32 completed;
+	__u32 reserved;
+};
+
+/*
+ * Command ring
+ *
+ * TPMP_IOC_RING_SETUP allocates params.slots slots of params.slot_size bytes
+ * each, to be mapped with mmap() over params.ring_size bytes at offset 0. The
+ * mapping starts with a struct tpmp_ring_ctrl page, followed by the slots.
+ * Each slot starts with a struct tpmp_ring_slot, its command or response is
+ * at TPMP_RING_DATA_OFFSET into the slot.
+ *
+ * To send a command, write it into a free slot, set slot.len, put the slot
+ * index at sq[sq_tail % slots] and increment sq_tail. TPMP_IOC_RING_ENTER
+ * queues all submitted slots and advances sq_head. Once a command is done,
+ * its slot holds the response and slot.len and slot.status are set, the
+ * slot index is put at cq[cq_tail % slots] and cq_tail is incremented.
+ * Userspace consumes completions by incrementing cq_head, after which the
+ * slot is free again. TPMP_IOC_RING_ENTER stops with -EBUSY at a slot that
+ * is not free. poll() reports EPOLLIN while cq_head != cq_tail.
+ * The commands and responses are transferred from and into the slots
+ * directly.
+ */
+#define TPMP_RING_MAX_SLOTS	256
+#define TPMP_RING_DATA_OFFSET	256
+
+/**
+ * struct tpmp_ring_params - Ring geometry
+ * @slots: Number of slots, a power of two up to TPMP_RING_MAX_SLOTS
+ * @slot_size: Set to the size of a slot
+ * @ring_size: Set to the size of the mapping
+ * @reserved: Must be 0
+ */
+struct tpmp_ring_params {
+	__u32 slots;
+	__u32 slot_size;
+	__u32 ring_size;
+	__u32 reserved;
+};
+
+/**
+ * struct tpmp_ring_ctrl - Submission and completion queues
+ * @sq_head: Next submission the driver consumes, written by the driver
+ * @sq_tail: Next free submission entry, written by userspace
+ * @cq_head: Next completion userspace consumes, written by userspace
+ * @cq_tail: Next free completion entry, written by the driver
+ * @sq: Indexes of submitted slots
+ * @cq: Indexes of completed slots
+ */
+struct tpmp_ring_ctrl {
+	__u32 sq_head;
+	__u32 sq_tail;
+	__u32 cq_head;
+	__u32 cq_tail;
+	__u32 sq[TPMP_RING_MAX_SLOTS];
+	__u32 cq[TPMP_RING_MAX_SLOTS];
+};
+
+/**
+ * struct tpmp_ring_slot - Header of a slot
+ * @len: Length of the command, set to the length of the response
+ * @status: Set to 0 or a negative errno for the command
+ */
+struct tpmp_ring_slot {
+	__u32 len;
+	__s32 status;
+};
+
+/* Send a command and wait for its response */
+#define TPMP_IOC_TRANSACT	_IOWR(TPMP_IOC_MAGIC, 0x00, struct tpmp_transaction)
+/* Send several commands with no other client interleaving */
+#define TPMP_IOC_BATCH		_IOWR(TPMP_IOC_MAGIC, 0x01, struct tpmp_batch)
+
+/* Allocate the command ring of this file */
+#define TPMP_IOC_RING_SETUP	_IOWR(TPMP_IOC_MAGIC, 0x02, struct tpmp_ring_params)
+/* Queue the commands submitted on the ring */
+#define TPMP_IOC_RING_ENTER	_IO(TPMP_IOC_MAGIC, 0x03)
+
+#endif /* _TPMPROXY_IOCTL_H */
@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ *  Copyright (c) 2018-2019 Xaptum, Inc.
+ *
+ * Framing of the transfers between the host driver and the gadget
+ *
+ * Keep in sync with gadget/src/tpm_proto.h.
+ */
+
+#ifndef _TPMPROXY_PROTO_H
+#define _TPMPROXY_PROTO_H
+
+#include <linux/types.h>
+
+/*
+ * With framing, every transfer starts with a struct tpmp_frame. Its magic
+ * reads "TPMF", which no TPM command or response starts with, so the gadget
+ * tells framed and raw transfers apart by their first bytes.
+ *
+ * At probe the host sends a HELLO frame. A gadget supporting framing answers
+ * with a HELLO carrying its TPMP_FEAT_* flags. An older one passes the 16
+ * bytes to its TPM as a command and returns the TPM's error response, which
+ * the host reads and drops.
+ * Each command is then sent as a CMD frame with a new sequence number and
+ * answered by a RSP frame echoing it, so responses to commands the host
+ * gave up on are recognized and dropped.
+ *
+ * A gadget offering TPMP_FEAT_BATCH also takes BATCH_CMD frames, in the
+ * spirit of an NCM transfer block: the payload is a run of records, each a
+ * struct tpmp_frame_rec followed by a command and padded to TPMP_REC_ALIGN.
+ * The gadget runs the commands in order and answers with one BATCH_RSP frame
+ * holding a record per command run, each followed by its response.
+ */
+#define TPMP_FRAME_MAGIC	0x464d5054	/* "TPMF" */
+
+#define TPMP_FRAME_HELLO	0x0000
+#define TPMP_FRAME_CMD		0x0001
+#define TPMP_FRAME_RSP		0x0002
+#define TPMP_FRAME_BATCH_CMD	0x0003
+#define TPMP_FRAME_BATCH_RSP	0x0004
+
+#define TPMP_FEAT_FRAMING	(1 << 0)
+#define TPMP_FEAT_BATCH		(1 << 1)
+#define TPMP_FEAT_CANCEL	(1 << 2)	/* takes TPMP_REQ_CANCEL */
+
+/* Flags of BATCH_CMD frames: skip the commands after one that failed */
+#define TPMP_FRAME_STOP_ON_ERROR	(1 << 0)
+
+/**
+ * struct tpmp_frame - Header of a framed transfer, little endian
+ * @magic: TPMP_FRAME_MAGIC
+ * @type: TPMP_FRAME_* type
+ * @flags: TPMP_FEAT_* flags in HELLO frames, TPMP_FRAME_STOP_ON_ERROR in
+ *	   BATCH_CMD frames, 0 otherwise
+ * @seq: Sequence number of the command, echoed in its response
+ * @len: Length of the payload following the header
+ */
+struct tpmp_frame {
+	__le32 magic;
+	__le16 type;
+	__le16 flags;
+	__le32 seq;
+	__le32 len;
+} __packed;
+
+#define TPMP_FRAME_SIZE		sizeof(struct tpmp_frame)
+
+#define TPMP_REC_OK		0	/* the command ran, its response follows */
+#define TPMP_REC_FAILED		1	/* the command could not be run */
+#define TPMP_REC_TRUNCATED	2	/* the response did not fit the BATCH_RSP frame */
+
+/**
+ * struct tpmp_frame_rec - Header of a record of a batch frame, little endian
+ * @len: Length of the command or response following the header
+ * @status: TPMP_REC_* status in BATCH_RSP frames, 0 otherwise
+ */
+struct tpmp_frame_rec {
+	__le32 len;
+	__le32 status;
+} __packed;
+
+#define TPMP_REC_SIZE		sizeof(struct tpmp_frame_rec)
+#define TPMP_REC_ALIGN		4
+
+/*
+ * Vendor control requests, bmRequestType USB_TYPE_VENDOR | USB_RECIP_DEVICE.
+ * The gadget answers them on ep0, never behind a command on the bulk
+ * endpoints. Requests with a data stage are device to host, the others host
+ * to device. Gadgets without them stall every request.
+ */
+#define TPMP_PROTO_VERSION	1
+
+#define TPMP_REQ_PING		0x01	/* no data stage */
+#define TPMP_REQ_CAPS		0x02	/* struct tpmp_caps */
+#define TPMP_REQ_STATS		0x03	/* struct tpmp_gadget_stats */
+#define TPMP_REQ_CANCEL		0x04	/* no data stage, cancel the command on the TPM */
+
+#define TPMP_FAMILY_UNKNOWN	0
+#define TPMP_FAMILY_TPM12	1
+#define TPMP_FAMILY_TPM20	2
+
+/**
+ * struct tpmp_caps - Capabilities of the gadget, little endian
+ * @version: TPMP_PROTO_VERSION
+ * @features: TPMP_FEAT_* flags, also offered in the HELLO
+ * @max_cmd: Longest command the gadget takes in one transfer
+ * @tpm_family: TPMP_FAMILY_* family of the card TPM
+ * @reserved: 0
+ */
+struct tpmp_caps {
+	__le16 version;
+	__le16 features;
+	__le32 max_cmd;
+	__u8 tpm_family;
+	__u8 reserved[7];
+} __packed;
+
+/**
+ * struct tpmp_gadget_stats - Counters of the gadget, little endian
+ * @commands: Commands sent to the card TPM
+ * @batches: BATCH_CMD frames run
+ * @tpm_errors: Commands the card TPM could not run
+ * @usb_errors: Failed bulk reads and writes
+ */
+struct tpmp_gadget_stats {
+	__le32 commands;
+	__le32 batches;
+	__le32 tpm_errors;
+	__le32 usb_errors;
+} __packed;
+
+#endif /* _TPMPROXY_PROTO_H */
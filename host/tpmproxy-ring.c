@@ -0,0 +1,392 @@
+/*
+ * TPM Proxy driver for Linux
+ *
+ *  Copyright (c) 2018-2019 Xaptum, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/uaccess.h>
+#include <linux/poll.h>
+
+#include "tpmproxy.h"
+#include "tpmproxy-ioctl.h"
+
+/**
+ * struct tpmp_ring_entry - Kernel side of a slot
+ * @cmd: Command queued for the worker, @cmd.buf points into @mem
+ * @ring: Ring the slot belongs to
+ * @mem: Slot memory, mapped to userspace
+ * @index: Index of the slot
+ * @cq_pos: Completion queue position of the last completion of the slot
+ * @busy: The slot was submitted and is not completed yet
+ */
+struct tpmp_ring_entry {
+	struct tpmp_cmd		cmd;
+	struct tpmp_ring	*ring;
+	u8			*mem;
+	u32			index;
+	u32			cq_pos;
+	bool			busy;
+};
+
+/**
+ * struct tpmp_ring - Command ring of one open file
+ * @client: Client owning the ring
+ * @ctrl: Submission and completion queues, mapped to userspace
+ * @slots: Number of slots
+ * @slot_size: Size of a slot
+ * @order: Page order of a slot
+ * @sq_head: Next submission to consume, the copy in @ctrl is only reported
+ * @cq_tail: Next completion to post, the copy in @ctrl is only reported
+ * @inflight: Number of slots submitted and not completed
+ * @entries: The slots
+ */
+struct tpmp_ring {
+	struct tpmp_client	*client;
+	struct tpmp_ring_ctrl	*ctrl;
+	u32			slots;
+	u32			slot_size;
+	unsigned int		order;
+	u32			sq_head;
+	u32			cq_tail;
+	atomic_t		inflight;
+	struct tpmp_ring_entry	entries[];
+};
+
+static inline struct tpmp_ring_slot *tpmp_ring_slot(struct tpmp_ring_entry *entry)
+{
+	return (struct tpmp_ring_slot *)entry->mem;
+}
+
+static void tpmp_ring_destroy(struct tpmp_ring *ring)
+{
+	u32 i;
+
+	for (i = 0; i < ring->slots; i++)
+		if (ring->entries[i].mem)
+			free_pages((unsigned long)ring->entries[i].mem,
+				   ring->order);
+	if (ring->ctrl)
+		free_page((unsigned long)ring->ctrl);
+	kfree(ring);
+}
+
+/*
+ * Called from the worker, or on release for slots that were never sent.
+ * Posting the completion and waking the client happen under the queue lock,
+ * so that release cannot free the ring in between.
+ */
+static void tpmp_ring_complete(struct tpmp_cmd *cmd)
+{
+	struct tpmp_ring_entry *entry = container_of(cmd, struct tpmp_ring_entry,
+						     cmd);
+	struct tpmp_ring *ring = entry->ring;
+	struct tpmp_client *client = ring->client;
+	struct tpmp_ring_slot *slot = tpmp_ring_slot(entry);
+
+	WRITE_ONCE(slot->len, cmd->result > 0 ? cmd->result : 0);
+	WRITE_ONCE(slot->status, cmd->result < 0 ? cmd->result : 0);
+
+	spin_lock(&client->dev->queue_lock);
+	entry->cq_pos = ring->cq_tail;
+	smp_store_release(&entry->busy, false);
+	ring->ctrl->cq[ring->cq_tail & (ring->slots - 1)] = entry->index;
+	ring->cq_tail++;
+	smp_store_release(&ring->ctrl->cq_tail, ring->cq_tail);
+	atomic_dec(&ring->inflight);
+	wake_up(&client->wait);
+	spin_unlock(&client->dev->queue_lock);
+}
+
+/*
+ * Userspace frees a slot by consuming its completion. Until then, a new
+ * completion of the slot would overwrite the result it has yet to read.
+ */
+static bool tpmp_ring_slot_free(struct tpmp_ring_entry *entry, u32 cq_head)
+{
+	if (smp_load_acquire(&entry->busy))
+		return false;
+
+	return (s32)(entry->cq_pos - cq_head) < 0;
+}
+
+/**
+ * tpmp_ring_setup() - Allocate the command ring of a client
+ * @client: Client to allocate the ring for
+ * @argp: Userspace struct tpmp_ring_params
+ *
+ * Each slot is physically contiguous so the USB core can map it for DMA.
+ *
+ * Return:
+ 	0 if the ring was allocated, see params.ring_size
+	-EINVAL if slots is not a power of two up to TPMP_RING_MAX_SLOTS, or on
+	 a nonzero reserved field
+	-EBUSY if the client already has a ring
+	-ENOMEM on allocation failure
+	-EFAULT on memory copy error
+ */
+long tpmp_ring_setup(struct tpmp_client *client,
+		     struct tpmp_ring_params __user *argp)
+{
+	struct usb_tpmp *dev = client->dev;
+	struct tpmp_ring_params params;
+	struct tpmp_ring *ring;
+	long retval = 0;
+	u32 i;
+
+	BUILD_BUG_ON(sizeof(struct tpmp_ring_ctrl) > PAGE_SIZE);
+	BUILD_BUG_ON(TPMP_RING_DATA_OFFSET % ARCH_DMA_MINALIGN);
+
+	if (copy_from_user(&params, argp, sizeof(params)))
+		return -EFAULT;
+
+	if (!is_power_of_2(params.slots) ||
+	    params.slots > TPMP_RING_MAX_SLOTS || params.reserved)
+		return -EINVAL;
+
+	ring = kzalloc(struct_size(ring, entries, params.slots), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->client = client;
+	ring->slots = params.slots;
+	ring->slot_size = PAGE_ALIGN(TPMP_RING_DATA_OFFSET + dev->bufsiz);
+	ring->order = get_order(ring->slot_size);
+	atomic_set(&ring->inflight, 0);
+
+	ring->ctrl = (struct tpmp_ring_ctrl *)get_zeroed_page(GFP_KERNEL);
+	if (!ring->ctrl) {
+		retval = -ENOMEM;
+		goto error;
+	}
+
+	for (i = 0; i < ring->slots; i++) {
+		struct tpmp_ring_entry *entry = &ring->entries[i];
+
+		entry->mem = (u8 *)__get_free_pages(GFP_KERNEL | __GFP_ZERO,
+						    ring->order);
+		if (!entry->mem) {
+			retval = -ENOMEM;
+			goto error;
+		}
+
+		entry->ring = ring;
+		entry->index = i;
+		entry->cq_pos = U32_MAX;
+		INIT_LIST_HEAD(&entry->cmd.node);
+		entry->cmd.client = client;
+		entry->cmd.buf = entry->mem + TPMP_RING_DATA_OFFSET;
+		entry->cmd.bufsiz = dev->bufsiz;
+		entry->cmd.dma = true;
+		entry->cmd.complete = tpmp_ring_complete;
+	}
+
+	params.slot_size = ring->slot_size;
+	params.ring_size = PAGE_SIZE + ring->slots * ring->slot_size;
+	if (copy_to_user(argp, &params, sizeof(params))) {
+		retval = -EFAULT;
+		goto error;
+	}
+
+	mutex_lock(&client->buffer_mutex);
+	if (client->ring) {
+		mutex_unlock(&client->buffer_mutex);
+		retval = -EBUSY;
+		goto error;
+	}
+	client->ring = ring;
+	mutex_unlock(&client->buffer_mutex);
+
+	return 0;
+
+	error:
+	tpmp_ring_destroy(ring);
+	return retval;
+}
+
+/**
+ * tpmp_ring_enter() - Queue the commands submitted on the ring
+ * @client: Client owning the ring
+ *
+ * Return:
+ 	Number of slots consumed from the submission queue if >=0
+	-EINVAL if there is no ring, or on a bad slot index
+	-EBUSY on a slot whose completion is not consumed yet, or while the
+	 completion queue has no room for another one
+	-ENODEV if the device was disconnected
+ */
+long tpmp_ring_enter(struct tpmp_client *client)
+{
+	struct usb_tpmp *dev = client->dev;
+	struct tpmp_ring *ring;
+	long retval = 0;
+	long queued = 0;
+	u32 cq_head;
+	u32 tail;
+
+	if (!READ_ONCE(dev->interface))
+		return -ENODEV;
+
+	mutex_lock(&client->buffer_mutex);
+	ring = client->ring;
+	if (!ring) {
+		mutex_unlock(&client->buffer_mutex);
+		return -EINVAL;
+	}
+
+	tail = smp_load_acquire(&ring->ctrl->sq_tail);
+	cq_head = smp_load_acquire(&ring->ctrl->cq_head);
+	while (ring->sq_head != tail) {
+		struct tpmp_ring_entry *entry;
+		u32 index;
+		u32 len;
+
+		index = READ_ONCE(ring->ctrl->sq[ring->sq_head & (ring->slots - 1)]);
+		if (index >= ring->slots) {
+			retval = -EINVAL;
+			break;
+		}
+
+		/* Every slot consumed gets a completion, in flight or posted */
+		if (ring->sq_head - cq_head >= ring->slots) {
+			retval = -EBUSY;
+			break;
+		}
+
+		entry = &ring->entries[index];
+		if (!tpmp_ring_slot_free(entry, cq_head)) {
+			retval = -EBUSY;
+			break;
+		}
+
+		ring->sq_head++;
+		queued++;
+
+		entry->busy = true;
+		atomic_inc(&ring->inflight);
+
+		len = READ_ONCE(tpmp_ring_slot(entry)->len);
+		if (len > dev->bufsiz) {
+			entry->cmd.result = -E2BIG;
+			tpmp_ring_complete(&entry->cmd);
+			continue;
+		}
+
+		if (!tpmp_tpm_command_size_ok(entry->cmd.buf, len)) {
+			entry->cmd.result = -EINVAL;
+			tpmp_ring_complete(&entry->cmd);
+			continue;
+		}
+
+		entry->cmd.len = len;
+		tpmp_queue_cmd(dev, &entry->cmd);
+	}
+	WRITE_ONCE(ring->ctrl->sq_head, ring->sq_head);
+	mutex_unlock(&client->buffer_mutex);
+
+	return queued ? queued : retval;
+}
+
+/**
+ * tpmp_ring_mmap() - Map the command ring of a client
+ * @file: File pointer
+ * @vma: Mapping of at most params.ring_size bytes at offset 0
+ *
+ * Return:
+ 	0 on success
+	-EINVAL if there is no ring or the mapping does not fit it
+	other negative errno if mapping failed
+ */
+int tpmp_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct tpmp_client *client = file->private_data;
+	unsigned long addr = vma->vm_start;
+	struct tpmp_ring *ring;
+	int retval = 0;
+	u32 i;
+
+	mutex_lock(&client->buffer_mutex);
+	ring = client->ring;
+	if (!ring || vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start >
+	    PAGE_SIZE + ring->slots * ring->slot_size) {
+		retval = -EINVAL;
+		goto exit;
+	}
+
+	retval = remap_pfn_range(vma, addr,
+				 page_to_pfn(virt_to_page(ring->ctrl)),
+				 PAGE_SIZE, vma->vm_page_prot);
+	addr += PAGE_SIZE;
+
+	for (i = 0; !retval && i < ring->slots && addr < vma->vm_end; i++) {
+		unsigned long size = min_t(unsigned long, ring->slot_size,
+					   vma->vm_end - addr);
+
+		retval = remap_pfn_range(vma, addr,
+					 page_to_pfn(virt_to_page(ring->entries[i].mem)),
+					 size, vma->vm_page_prot);
+		addr += size;
+	}
+
+	exit:
+	mutex_unlock(&client->buffer_mutex);
+	return retval;
+}
+
+/**
+ * tpmp_ring_poll() - Report pending completions
+ * @client: Client owning the ring
+ *
+ * Return: EPOLLIN while userspace did not consume all completions
+ */
+__poll_t tpmp_ring_poll(struct tpmp_client *client)
+{
+	struct tpmp_ring *ring = READ_ONCE(client->ring);
+
+	if (ring && READ_ONCE(ring->ctrl->cq_head) != READ_ONCE(ring->cq_tail))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+/**
+ * tpmp_ring_idle() - Check that no slot is queued or in flight
+ * @client: Client owning the ring
+ *
+ * Must be called with the queue lock held.
+ */
+bool tpmp_ring_idle(struct tpmp_client *client)
+{
+	return !client->ring || !atomic_read(&client->ring->inflight);
+}
+
+/**
+ * tpmp_ring_free() - Free the command ring of a client
+ * @client: Client owning the ring, must be idle and no longer mapped
+ */
+void tpmp_ring_free(struct tpmp_client *client)
+{
+	if (client->ring)
+		tpmp_ring_destroy(client->ring);
+	client->ring = NULL;
+}
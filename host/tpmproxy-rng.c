@@ -0,0 +1,217 @@
+/*
+ * TPM Proxy driver for Linux
+ *
+ *  Copyright (c) 2018-2019 Xaptum, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/hw_random.h>
+#include <linux/kfifo.h>
+
+#include "tpmproxy.h"
+
+#ifdef TPMP_HAVE_HWRNG
+
+#define TPMP_RNG_POOL_SIZE	512		/* power of two for the kfifo */
+#define TPMP_RNG_BATCH_MAX	64
+#define TPMP_RNG_BACKOFF	(HZ / 50)	/* retry delay while user commands are queued */
+#define TPMP_RNG_RETRY		HZ		/* retry delay after a failed refill */
+
+static unsigned int rng_batch = 32;
+module_param(rng_batch, uint, 0644);
+MODULE_PARM_DESC(rng_batch,
+		 "Bytes requested per TPM2_GetRandom to refill the hwrng pool, 0 to not register an hwrng");
+
+static unsigned int rng_rate = 4096;
+module_param(rng_rate, uint, 0644);
+MODULE_PARM_DESC(rng_rate,
+		 "Maximum bytes per second pulled from the TPM into the hwrng pool, 0 for no limit");
+
+/**
+ * struct tpmp_rng - hwrng served from a pool of TPM random bytes
+ * @hwrng: Registered hwrng
+ * @name: Name of @hwrng
+ * @dev: Device the random bytes come from
+ * @pool: Random bytes not handed out yet
+ * @lock: Lock for @pool
+ * @wait: Waiters for the pool to be refilled
+ * @refill_work: Work refilling the pool
+ * @next_refill: Earliest time of the next refill under the rate cap
+ */
+struct tpmp_rng {
+	struct hwrng		hwrng;
+	char			name[32];
+	struct usb_tpmp		*dev;
+	DECLARE_KFIFO(pool, u8, TPMP_RNG_POOL_SIZE);
+	spinlock_t		lock;
+	wait_queue_head_t	wait;
+	struct delayed_work	refill_work;
+	unsigned long		next_refill;
+};
+
+static void tpmp_rng_kick(struct tpmp_rng *rng)
+{
+	unsigned long next = READ_ONCE(rng->next_refill);
+	unsigned long delay = 0;
+
+	if (time_after(next, jiffies))
+		delay = next - jiffies;
+
+	queue_delayed_work(system_long_wq, &rng->refill_work, delay);
+}
+
+/*
+ * Pulls one batch of random bytes from the TPM, backing off while user
+ * commands are queued or in flight, and reschedules itself until the pool is
+ * full, no faster than rng_rate allows.
+ */
+static void tpmp_rng_refill(struct work_struct *work)
+{
+	struct tpmp_rng *rng = container_of(to_delayed_work(work),
+					    struct tpmp_rng, refill_work);
+	struct usb_tpmp *dev = rng->dev;
+	unsigned int batch = min_t(unsigned int, READ_ONCE(rng_batch),
+				   TPMP_RNG_BATCH_MAX);
+	unsigned int rate = READ_ONCE(rng_rate);
+	u8 random[TPMP_RNG_BATCH_MAX];
+	unsigned long delay = 0;
+	size_t count = 0;
+	bool idle;
+	int retval;
+
+	if (!batch || kfifo_avail(&rng->pool) < batch)
+		return;
+
+	/* User commands go first */
+	spin_lock(&dev->queue_lock);
+	idle = list_empty(&dev->ready_clients);
+	spin_unlock(&dev->queue_lock);
+	if (!idle || !mutex_trylock(&dev->buffer_mutex)) {
+		queue_delayed_work(system_long_wq, &rng->refill_work,
+				   TPMP_RNG_BACKOFF);
+		return;
+	}
+
+	mutex_lock(&dev->usb_mutex);
+	retval = tpmp_transmit(dev, tpmp_tpm2_get_random_cmd(dev->data_buffer,
+							     batch));
+	mutex_unlock(&dev->usb_mutex);
+	if (retval > 0)
+		count = tpmp_tpm2_parse_random(dev->data_buffer, retval,
+					       random, sizeof(random));
+	atomic_set(&dev->data_pending, 0);
+	mutex_unlock(&dev->buffer_mutex);
+
+	if (!count) {
+		if (retval != -ENODEV)
+			WRITE_ONCE(rng->next_refill, jiffies + TPMP_RNG_RETRY);
+		return;
+	}
+
+	kfifo_in_spinlocked(&rng->pool, random, count, &rng->lock);
+	memzero_explicit(random, sizeof(random));
+	wake_up(&rng->wait);
+
+	if (rate)
+		delay = DIV_ROUND_UP(count * HZ, rate);
+	WRITE_ONCE(rng->next_refill, jiffies + delay);
+	queue_delayed_work(system_long_wq, &rng->refill_work, delay);
+}
+
+static int tpmp_rng_read(struct hwrng *hwrng, void *data, size_t max, bool wait)
+{
+	struct tpmp_rng *rng = container_of(hwrng, struct tpmp_rng, hwrng);
+	unsigned int count;
+
+	count = kfifo_out_spinlocked(&rng->pool, data, max, &rng->lock);
+	if (!count && wait) {
+		tpmp_rng_kick(rng);
+		wait_event_interruptible_timeout(rng->wait,
+						 !kfifo_is_empty(&rng->pool),
+						 HZ);
+		count = kfifo_out_spinlocked(&rng->pool, data, max, &rng->lock);
+	}
+
+	tpmp_rng_kick(rng);
+	return count;
+}
+
+/**
+ * tpmp_rng_register() - Register the TPM of a device as hwrng
+ * @dev: Device to register
+ *
+ * The pool is prefilled in the background right away. A TPM 1.2 does not
+ * know TPM2_GetRandom and is not registered.
+ *
+ * Return: 0 on success, if disabled by rng_batch or for a TPM 1.2,
+ * negative errno otherwise
+ */
+int tpmp_rng_register(struct usb_tpmp *dev)
+{
+	struct tpmp_rng *rng;
+	int retval;
+
+	if (!READ_ONCE(rng_batch) || dev->tpm_family == TPMP_FAMILY_TPM12)
+		return 0;
+
+	rng = kzalloc(sizeof(*rng), GFP_KERNEL);
+	if (!rng)
+		return -ENOMEM;
+
+	rng->dev = dev;
+	INIT_KFIFO(rng->pool);
+	spin_lock_init(&rng->lock);
+	init_waitqueue_head(&rng->wait);
+	INIT_DELAYED_WORK(&rng->refill_work, tpmp_rng_refill);
+	rng->next_refill = jiffies;
+
+	snprintf(rng->name, sizeof(rng->name), "tpmproxy-%s",
+		 dev_name(&dev->interface->dev));
+	rng->hwrng.name = rng->name;
+	rng->hwrng.read = tpmp_rng_read;
+	/* the default since 5.18, older kernels credit no entropy for 0 */
+	rng->hwrng.quality = 1024;
+
+	retval = hwrng_register(&rng->hwrng);
+	if (retval) {
+		kfree(rng);
+		return retval;
+	}
+
+	dev->rng = rng;
+	tpmp_rng_kick(rng);
+	return 0;
+}
+
+void tpmp_rng_unregister(struct usb_tpmp *dev)
+{
+	struct tpmp_rng *rng = dev->rng;
+
+	if (!rng)
+		return;
+
+	hwrng_unregister(&rng->hwrng);
+	cancel_delayed_work_sync(&rng->refill_work);
+	kfree_sensitive(rng);
+	dev->rng = NULL;
+}
+
+#endif /* TPMP_HAVE_HWRNG */
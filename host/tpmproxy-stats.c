@@ -0,0 +1,360 @@
+/*
+ * TPM Proxy driver for Linux
+ *
+ *  Copyright (c) 2018-2019 Xaptum, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
+
+#include "tpmproxy.h"
+#include "tpmproxy-proto.h"
+
+static struct dentry *tpmp_debugfs_root;
+
+static unsigned int tpmp_hist_slot(u32 ordinal)
+{
+	if (ordinal < TPMP_CC_FIRST || ordinal > TPMP_CC_LAST)
+		return TPMP_HIST_SLOTS - 1;
+
+	return ordinal - TPMP_CC_FIRST;
+}
+
+static unsigned int tpmp_hist_bucket(ktime_t start, ktime_t end)
+{
+	s64 usecs = ktime_us_delta(end, start);
+
+	if (usecs <= 0)
+		return 0;
+
+	return min_t(unsigned int, fls64(usecs), TPMP_HIST_BUCKETS - 1);
+}
+
+int tpmp_stats_init(struct usb_tpmp *dev)
+{
+	spin_lock_init(&dev->stats.lock);
+
+	dev->stats.hist = vzalloc(TPMP_HIST_SLOTS * sizeof(*dev->stats.hist));
+	if (!dev->stats.hist)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void tpmp_stats_free(struct usb_tpmp *dev)
+{
+	vfree(dev->stats.hist);
+}
+
+/**
+ * tpmp_stats_submit() - Account a command being submitted
+ * @dev: Device the command is sent to
+ * @len: Length of the command
+ */
+void tpmp_stats_submit(struct usb_tpmp *dev, size_t len)
+{
+	struct tpmp_stats *stats = &dev->stats;
+	unsigned long flags;
+
+	spin_lock_irqsave(&stats->lock, flags);
+	stats->commands++;
+	stats->bytes_out += len;
+	stats->submitted = ktime_get();
+	stats->out_done = stats->submitted;
+	spin_unlock_irqrestore(&stats->lock, flags);
+}
+
+void tpmp_stats_out_done(struct usb_tpmp *dev)
+{
+	struct tpmp_stats *stats = &dev->stats;
+	unsigned long flags;
+
+	spin_lock_irqsave(&stats->lock, flags);
+	stats->out_done = ktime_get();
+	spin_unlock_irqrestore(&stats->lock, flags);
+}
+
+/**
+ * tpmp_stats_complete() - Account the completion of the command in flight
+ * @dev: Device the command was sent to
+ * @status: 0 or the negative errno the command failed with
+ * @received: Number of response bytes received
+ *
+ * Only successful commands are added to the latency histograms.
+ */
+void tpmp_stats_complete(struct usb_tpmp *dev, int status, size_t received)
+{
+	struct tpmp_stats *stats = &dev->stats;
+	u32 (*slot)[TPMP_HIST_BUCKETS];
+	unsigned long flags;
+	ktime_t now = ktime_get();
+
+	spin_lock_irqsave(&stats->lock, flags);
+	switch (status) {
+	case 0:
+		stats->bytes_in += received;
+		slot = stats->hist[tpmp_hist_slot(dev->ordinal)];
+		slot[TPMP_HIST_OUT][tpmp_hist_bucket(stats->submitted,
+						      stats->out_done)]++;
+		slot[TPMP_HIST_IN][tpmp_hist_bucket(stats->out_done, now)]++;
+		slot[TPMP_HIST_TOTAL][tpmp_hist_bucket(stats->submitted, now)]++;
+		break;
+	case -ETIMEDOUT:
+		stats->timeouts++;
+		break;
+	case -EPIPE:
+		stats->pipe_errors++;
+		break;
+	}
+	spin_unlock_irqrestore(&stats->lock, flags);
+}
+
+void tpmp_stats_count_busy(struct usb_tpmp *dev)
+{
+	spin_lock_irq(&dev->stats.lock);
+	dev->stats.busy_errors++;
+	spin_unlock_irq(&dev->stats.lock);
+}
+
+void tpmp_stats_count_reset(struct usb_tpmp *dev)
+{
+	spin_lock_irq(&dev->stats.lock);
+	dev->stats.resets++;
+	spin_unlock_irq(&dev->stats.lock);
+}
+
+void tpmp_stats_count_cache(struct usb_tpmp *dev, bool hit)
+{
+	spin_lock_irq(&dev->stats.lock);
+	if (hit)
+		dev->stats.cache_hits++;
+	else
+		dev->stats.cache_misses++;
+	spin_unlock_irq(&dev->stats.lock);
+}
+
+/* Called from the bulk in completion handler */
+void tpmp_stats_count_stale(struct usb_tpmp *dev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->stats.lock, flags);
+	dev->stats.stale_responses++;
+	spin_unlock_irqrestore(&dev->stats.lock, flags);
+}
+
+void tpmp_stats_count_cancel(struct usb_tpmp *dev)
+{
+	spin_lock_irq(&dev->stats.lock);
+	dev->stats.cancels++;
+	spin_unlock_irq(&dev->stats.lock);
+}
+
+#define TPMP_STATS_ATTR(_name)						\
+static ssize_t _name##_show(struct device *d,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct usb_tpmp *dev = usb_get_intfdata(to_usb_interface(d));	\
+	u64 val;							\
+									\
+	spin_lock_irq(&dev->stats.lock);				\
+	val = dev->stats._name;						\
+	spin_unlock_irq(&dev->stats.lock);				\
+									\
+	return sprintf(buf, "%llu\n", val);				\
+}									\
+static DEVICE_ATTR_RO(_name)
+
+TPMP_STATS_ATTR(commands);
+TPMP_STATS_ATTR(bytes_out);
+TPMP_STATS_ATTR(bytes_in);
+TPMP_STATS_ATTR(timeouts);
+TPMP_STATS_ATTR(busy_errors);
+TPMP_STATS_ATTR(pipe_errors);
+TPMP_STATS_ATTR(resets);
+TPMP_STATS_ATTR(cache_hits);
+TPMP_STATS_ATTR(cache_misses);
+TPMP_STATS_ATTR(stale_responses);
+TPMP_STATS_ATTR(cancels);
+
+static struct attribute *tpmp_stats_attrs[] = {
+	&dev_attr_commands.attr,
+	&dev_attr_bytes_out.attr,
+	&dev_attr_bytes_in.attr,
+	&dev_attr_timeouts.attr,
+	&dev_attr_busy_errors.attr,
+	&dev_attr_pipe_errors.attr,
+	&dev_attr_resets.attr,
+	&dev_attr_cache_hits.attr,
+	&dev_attr_cache_misses.attr,
+	&dev_attr_stale_responses.attr,
+	&dev_attr_cancels.attr,
+	NULL,
+};
+
+static const struct attribute_group tpmp_stats_group = {
+	.name = "stats",
+	.attrs = tpmp_stats_attrs,
+};
+
+static const char * const tpmp_hist_phase_names[TPMP_HIST_PHASES] = {
+	[TPMP_HIST_OUT]		= "out",
+	[TPMP_HIST_IN]		= "in",
+	[TPMP_HIST_TOTAL]	= "total",
+};
+
+/*
+ * One line per command code and phase that saw any command. Bucket 0 counts
+ * round trips under 1 usec, bucket n those in [2^(n-1), 2^n) usecs and the
+ * last bucket everything slower.
+ */
+static int tpmp_latency_show(struct seq_file *s, void *unused)
+{
+	struct usb_tpmp *dev = s->private;
+	u32 row[TPMP_HIST_BUCKETS];
+	unsigned int slot, phase, i;
+	bool used;
+
+	seq_puts(s, "# cc phase log2(usecs) buckets\n");
+
+	for (slot = 0; slot < TPMP_HIST_SLOTS; slot++) {
+		for (phase = 0; phase < TPMP_HIST_PHASES; phase++) {
+			used = false;
+
+			spin_lock_irq(&dev->stats.lock);
+			memcpy(row, dev->stats.hist[slot][phase], sizeof(row));
+			spin_unlock_irq(&dev->stats.lock);
+
+			for (i = 0; i < TPMP_HIST_BUCKETS; i++)
+				used |= row[i] != 0;
+			if (!used)
+				continue;
+
+			if (slot == TPMP_HIST_SLOTS - 1)
+				seq_puts(s, "other");
+			else
+				seq_printf(s, "0x%03x", TPMP_CC_FIRST + slot);
+			seq_printf(s, " %s", tpmp_hist_phase_names[phase]);
+			for (i = 0; i < TPMP_HIST_BUCKETS; i++)
+				seq_printf(s, " %u", row[i]);
+			seq_putc(s, '\n');
+		}
+	}
+
+	return 0;
+}
+
+static int tpmp_latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tpmp_latency_show, inode->i_private);
+}
+
+static const struct file_operations tpmp_latency_fops = {
+	.owner =	THIS_MODULE,
+	.open =		tpmp_latency_open,
+	.read =		seq_read,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
+
+/* Capabilities read at probe, and the counters of the gadget right now */
+static int tpmp_gadget_show(struct seq_file *s, void *unused)
+{
+	struct usb_tpmp *dev = s->private;
+	struct tpmp_gadget_stats stats;
+	int retval;
+
+	seq_printf(s, "version %u\n", dev->gadget_version);
+	seq_printf(s, "features 0x%x\n", dev->gadget_features);
+	seq_printf(s, "max_cmd %u\n", dev->gadget_max_cmd);
+	seq_printf(s, "tpm_family %u\n", dev->tpm_family);
+
+	retval = tpmp_vendor_request(dev, TPMP_REQ_STATS, &stats, sizeof(stats));
+	if (retval < (int)sizeof(stats))
+		return 0;
+
+	seq_printf(s, "commands %u\n", le32_to_cpu(stats.commands));
+	seq_printf(s, "batches %u\n", le32_to_cpu(stats.batches));
+	seq_printf(s, "tpm_errors %u\n", le32_to_cpu(stats.tpm_errors));
+	seq_printf(s, "usb_errors %u\n", le32_to_cpu(stats.usb_errors));
+
+	return 0;
+}
+
+static int tpmp_gadget_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, tpmp_gadget_show, inode->i_private);
+}
+
+static const struct file_operations tpmp_gadget_fops = {
+	.owner =	THIS_MODULE,
+	.open =		tpmp_gadget_open,
+	.read =		seq_read,
+	.llseek =	seq_lseek,
+	.release =	single_release,
+};
+
+/**
+ * tpmp_stats_register() - Expose the statistics of a device
+ * @dev: Device to expose
+ *
+ * Counters appear in the stats group of the interface in sysfs, latency
+ * histograms in tpmproxy/<interface>/latency in debugfs, next to the
+ * capabilities and counters of the gadget in tpmproxy/<interface>/gadget.
+ *
+ * Return: 0 on success, negative errno otherwise
+ */
+int tpmp_stats_register(struct usb_tpmp *dev)
+{
+	int retval;
+
+	retval = sysfs_create_group(&dev->interface->dev.kobj,
+				    &tpmp_stats_group);
+	if (retval)
+		return retval;
+
+	/* debugfs is best effort */
+	dev->stats.debugfs = debugfs_create_dir(dev_name(&dev->interface->dev),
+						tpmp_debugfs_root);
+	debugfs_create_file("latency", 0444, dev->stats.debugfs, dev,
+			    &tpmp_latency_fops);
+	debugfs_create_file("gadget", 0444, dev->stats.debugfs, dev,
+			    &tpmp_gadget_fops);
+
+	return 0;
+}
+
+void tpmp_stats_unregister(struct usb_tpmp *dev)
+{
+	debugfs_remove_recursive(dev->stats.debugfs);
+	dev->stats.debugfs = NULL;
+	sysfs_remove_group(&dev->interface->dev.kobj, &tpmp_stats_group);
+}
+
+void tpmp_debugfs_init(void)
+{
+	tpmp_debugfs_root = debugfs_create_dir("tpmproxy", NULL);
+}
+
+void tpmp_debugfs_exit(void)
+{
+	debugfs_remove_recursive(tpmp_debugfs_root);
+}
@@ -0,0 +1,496 @@
+/*
+ * TPM Proxy driver for Linux
+ *
+ *  Copyright (c) 2018-2019 Xaptum, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+
+#include "tpmproxy-tpm.h"
+
+/* Timeout in msecs for each duration class, including the USB round trip */
+static const unsigned int tpmp_duration_ms[TPMP_DURATION_COUNT] = {
+	[TPMP_DURATION_SHORT]	= 200,
+	[TPMP_DURATION_MEDIUM]	= 1000,
+	[TPMP_DURATION_LONG]	= 5000,
+	[TPMP_DURATION_KEYGEN]	= 60000,
+};
+
+struct tpmp_ordinal_duration {
+	u32 ordinal;
+	u8 duration;
+};
+
+/* Commands not listed here are TPMP_DURATION_MEDIUM */
+static const struct tpmp_ordinal_duration tpm1_ordinal_duration[] = {
+	{TPMP_ORD_OIAP, TPMP_DURATION_SHORT},
+	{TPMP_ORD_OSAP, TPMP_DURATION_SHORT},
+	{TPMP_ORD_EXTEND, TPMP_DURATION_SHORT},
+	{TPMP_ORD_PCR_READ, TPMP_DURATION_SHORT},
+	{TPMP_ORD_GET_RANDOM, TPMP_DURATION_SHORT},
+	{TPMP_ORD_GET_CAPABILITY, TPMP_DURATION_SHORT},
+	{TPMP_ORD_READ_PUBEK, TPMP_DURATION_SHORT},
+	{TPMP_ORD_NV_READ_VALUE, TPMP_DURATION_SHORT},
+	{TPMP_ORD_SELF_TEST_FULL, TPMP_DURATION_LONG},
+	{TPMP_ORD_CONTINUE_SELF_TEST, TPMP_DURATION_LONG},
+	{TPMP_ORD_TAKE_OWNERSHIP, TPMP_DURATION_KEYGEN},
+	{TPMP_ORD_CREATE_WRAP_KEY, TPMP_DURATION_KEYGEN},
+	{TPMP_ORD_CREATE_EK_PAIR, TPMP_DURATION_KEYGEN},
+	{TPMP_ORD_MAKE_IDENTITY, TPMP_DURATION_KEYGEN},
+};
+
+static const struct tpmp_ordinal_duration tpm2_ordinal_duration[] = {
+	{TPMP_CC_STARTUP, TPMP_DURATION_SHORT},
+	{TPMP_CC_STIR_RANDOM, TPMP_DURATION_SHORT},
+	{TPMP_CC_CONTEXT_LOAD, TPMP_DURATION_SHORT},
+	{TPMP_CC_CONTEXT_SAVE, TPMP_DURATION_SHORT},
+	{TPMP_CC_FLUSH_CONTEXT, TPMP_DURATION_SHORT},
+	{TPMP_CC_NV_READ_PUBLIC, TPMP_DURATION_SHORT},
+	{TPMP_CC_READ_PUBLIC, TPMP_DURATION_SHORT},
+	{TPMP_CC_GET_CAPABILITY, TPMP_DURATION_SHORT},
+	{TPMP_CC_GET_RANDOM, TPMP_DURATION_SHORT},
+	{TPMP_CC_GET_TEST_RESULT, TPMP_DURATION_SHORT},
+	{TPMP_CC_PCR_READ, TPMP_DURATION_SHORT},
+	{TPMP_CC_POLICY_PCR, TPMP_DURATION_SHORT},
+	{TPMP_CC_READ_CLOCK, TPMP_DURATION_SHORT},
+	{TPMP_CC_PCR_EXTEND, TPMP_DURATION_SHORT},
+	{TPMP_CC_HASH_SEQUENCE_START, TPMP_DURATION_SHORT},
+	{TPMP_CC_POLICY_GET_DIGEST, TPMP_DURATION_SHORT},
+	{TPMP_CC_TEST_PARMS, TPMP_DURATION_SHORT},
+	{TPMP_CC_NV_READ, TPMP_DURATION_SHORT},
+	{TPMP_CC_SHUTDOWN, TPMP_DURATION_MEDIUM},
+	{TPMP_CC_LOAD, TPMP_DURATION_MEDIUM},
+	{TPMP_CC_SIGN, TPMP_DURATION_MEDIUM},
+	{TPMP_CC_QUOTE, TPMP_DURATION_MEDIUM},
+	{TPMP_CC_UNSEAL, TPMP_DURATION_MEDIUM},
+	{TPMP_CC_NV_WRITE, TPMP_DURATION_MEDIUM},
+	{TPMP_CC_START_AUTH_SESSION, TPMP_DURATION_MEDIUM},
+	{TPMP_CC_SELF_TEST, TPMP_DURATION_LONG},
+	{TPMP_CC_INCREMENTAL_SELF_TEST, TPMP_DURATION_LONG},
+	{TPMP_CC_ACTIVATE_CREDENTIAL, TPMP_DURATION_LONG},
+	{TPMP_CC_CERTIFY, TPMP_DURATION_LONG},
+	{TPMP_CC_ECDH_ZGEN, TPMP_DURATION_LONG},
+	{TPMP_CC_IMPORT, TPMP_DURATION_LONG},
+	{TPMP_CC_RSA_DECRYPT, TPMP_DURATION_LONG},
+	{TPMP_CC_ECDH_KEYGEN, TPMP_DURATION_LONG},
+	{TPMP_CC_CLEAR, TPMP_DURATION_LONG},
+	{TPMP_CC_CHANGE_EPS, TPMP_DURATION_KEYGEN},
+	{TPMP_CC_CHANGE_PPS, TPMP_DURATION_KEYGEN},
+	{TPMP_CC_CREATE_PRIMARY, TPMP_DURATION_KEYGEN},
+	{TPMP_CC_CREATE, TPMP_DURATION_KEYGEN},
+	{TPMP_CC_CREATE_LOADED, TPMP_DURATION_KEYGEN},
+};
+
+/**
+ * tpmp_tpm_parse_header() - Extract the tag and ordinal of a TPM command
+ * @buf: Command buffer
+ * @len: Length of the command
+ * @tag: Set to the command tag
+ * @ordinal: Set to the ordinal (TPM 1.2) or command code (TPM 2.0)
+ *
+ * Return: true if @buf holds a complete TPM 1.2 or TPM 2.0 header
+ */
+bool tpmp_tpm_parse_header(const u8 *buf, size_t len, u16 *tag, u32 *ordinal)
+{
+	const struct tpmp_header *header = (const struct tpmp_header *)buf;
+
+	if (len < TPMP_HEADER_SIZE)
+		return false;
+
+	*tag = be16_to_cpu(header->tag);
+	*ordinal = be32_to_cpu(header->ordinal);
+
+	switch (*tag) {
+	case TPMP_TAG_RQU_COMMAND:
+	case TPMP_TAG_RQU_AUTH1_COMMAND:
+	case TPMP_TAG_RQU_AUTH2_COMMAND:
+	case TPMP_ST_NO_SESSIONS:
+	case TPMP_ST_SESSIONS:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static enum tpmp_duration
+tpmp_lookup_duration(const struct tpmp_ordinal_duration *table, size_t count,
+		     u32 ordinal)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		if (table[i].ordinal == ordinal)
+			return table[i].duration;
+
+	return TPMP_DURATION_MEDIUM;
+}
+
+/**
+ * tpmp_tpm_duration() - Classify how long a TPM command takes to execute
+ * @buf: Command buffer
+ * @len: Length of the command
+ *
+ * Return: Duration class of the command, TPMP_DURATION_MEDIUM if unknown
+ */
+enum tpmp_duration tpmp_tpm_duration(const u8 *buf, size_t len)
+{
+	u16 tag;
+	u32 ordinal;
+
+	if (!tpmp_tpm_parse_header(buf, len, &tag, &ordinal))
+		return TPMP_DURATION_MEDIUM;
+
+	if (tag == TPMP_ST_NO_SESSIONS || tag == TPMP_ST_SESSIONS)
+		return tpmp_lookup_duration(tpm2_ordinal_duration,
+					    ARRAY_SIZE(tpm2_ordinal_duration),
+					    ordinal);
+
+	return tpmp_lookup_duration(tpm1_ordinal_duration,
+				    ARRAY_SIZE(tpm1_ordinal_duration),
+				    ordinal);
+}
+
+/**
+ * tpmp_tpm_timeout_ms() - Pick the response timeout for a TPM command
+ * @buf: Command buffer
+ * @len: Length of the command
+ *
+ * Return: Timeout in msecs for the command round trip
+ */
+unsigned int tpmp_tpm_timeout_ms(const u8 *buf, size_t len)
+{
+	return tpmp_duration_ms[tpmp_tpm_duration(buf, len)];
+}
+
+/**
+ * tpmp_tpm_command_size_ok() - Check that a command is as long as it says
+ * @buf: Command buffer
+ * @len: Number of bytes the caller handed in
+ *
+ * The card takes the length of a command from the transfer carrying it.
+ * A header announcing more or fewer bytes never reaches it.
+ *
+ * Return: true if the header is complete and announces @len bytes
+ */
+bool tpmp_tpm_command_size_ok(const u8 *buf, size_t len)
+{
+	const struct tpmp_header *header = (const struct tpmp_header *)buf;
+
+	return len >= TPMP_HEADER_SIZE && be32_to_cpu(header->length) == len;
+}
+
+/**
+ * tpmp_tpm_response_size() - Get the total size of a TPM response
+ * @buf: Start of the response received so far
+ * @len: Number of bytes received so far
+ *
+ * Return: 0 if the header is not complete yet, the size announced by the
+ * header, or @len if @buf does not start with a TPM response header
+ */
+size_t tpmp_tpm_response_size(const u8 *buf, size_t len)
+{
+	const struct tpmp_header *header = (const struct tpmp_header *)buf;
+
+	if (len < TPMP_HEADER_SIZE)
+		return 0;
+
+	switch (be16_to_cpu(header->tag)) {
+	case TPMP_TAG_RSP_COMMAND:
+	case TPMP_TAG_RSP_AUTH1_COMMAND:
+	case TPMP_TAG_RSP_AUTH2_COMMAND:
+	case TPMP_ST_NO_SESSIONS:
+	case TPMP_ST_SESSIONS:
+		return be32_to_cpu(header->length);
+	default:
+		return len;
+	}
+}
+
+/**
+ * tpmp_tpm_response_code() - Get the return code of a TPM response
+ * @buf: Response buffer
+ * @len: Length of the response
+ *
+ * Return: The response code, 0 if @buf doesn't hold a complete header
+ */
+u32 tpmp_tpm_response_code(const u8 *buf, size_t len)
+{
+	const struct tpmp_header *header = (const struct tpmp_header *)buf;
+
+	if (len < TPMP_HEADER_SIZE)
+		return 0;
+
+	return be32_to_cpu(header->ordinal);
+}
+
+struct tpmp_tpm2_get_cap_cmd {
+	struct tpmp_header header;
+	__be32 capability;
+	__be32 property;
+	__be32 property_count;
+} __packed;
+
+struct tpmp_tpm2_read_public_cmd {
+	struct tpmp_header header;
+	__be32 handle;
+} __packed;
+
+struct tpmp_tpm2_get_random_cmd {
+	struct tpmp_header header;
+	__be16 bytes_requested;
+} __packed;
+
+struct tpmp_tpm2_get_random_rsp {
+	struct tpmp_header header;
+	__be16 size;
+	u8 buffer[];
+} __packed;
+
+struct tpmp_tpm2_tagged_property {
+	__be32 property;
+	__be32 value;
+} __packed;
+
+struct tpmp_tpm2_get_max_size_rsp {
+	struct tpmp_header header;
+	u8 more_data;
+	__be32 capability;
+	__be32 count;
+	struct tpmp_tpm2_tagged_property properties[2];
+} __packed;
+
+/**
+ * tpmp_tpm2_max_size_cmd() - Build a query for the TPM buffer limits
+ * @buf: Buffer to build the command in, at least TPMP_HEADER_SIZE + 12 bytes
+ *
+ * Builds a TPM2_GetCapability for TPM_PT_MAX_COMMAND_SIZE and
+ * TPM_PT_MAX_RESPONSE_SIZE.
+ *
+ * Return: Length of the command
+ */
+size_t tpmp_tpm2_max_size_cmd(u8 *buf)
+{
+	struct tpmp_tpm2_get_cap_cmd *cmd = (struct tpmp_tpm2_get_cap_cmd *)buf;
+
+	cmd->header.tag = cpu_to_be16(TPMP_ST_NO_SESSIONS);
+	cmd->header.length = cpu_to_be32(sizeof(*cmd));
+	cmd->header.ordinal = cpu_to_be32(TPMP_CC_GET_CAPABILITY);
+	cmd->capability = cpu_to_be32(TPMP_CAP_TPM_PROPERTIES);
+	cmd->property = cpu_to_be32(TPMP_PT_MAX_COMMAND_SIZE);
+	cmd->property_count = cpu_to_be32(2);
+
+	return sizeof(*cmd);
+}
+
+/**
+ * tpmp_tpm2_parse_max_size() - Parse the response to tpmp_tpm2_max_size_cmd()
+ * @buf: Response buffer
+ * @len: Length of the response
+ *
+ * Return: The larger of the max command and max response sizes, 0 if the
+ * response doesn't carry them
+ */
+size_t tpmp_tpm2_parse_max_size(const u8 *buf, size_t len)
+{
+	const struct tpmp_tpm2_get_max_size_rsp *rsp =
+		(const struct tpmp_tpm2_get_max_size_rsp *)buf;
+	size_t max_size = 0;
+	u32 i, count;
+
+	if (len < sizeof(*rsp) ||
+	    be32_to_cpu(rsp->header.ordinal) != TPMP_RC_SUCCESS ||
+	    be32_to_cpu(rsp->capability) != TPMP_CAP_TPM_PROPERTIES)
+		return 0;
+
+	count = min_t(u32, be32_to_cpu(rsp->count), ARRAY_SIZE(rsp->properties));
+	for (i = 0; i < count; i++) {
+		switch (be32_to_cpu(rsp->properties[i].property)) {
+		case TPMP_PT_MAX_COMMAND_SIZE:
+		case TPMP_PT_MAX_RESPONSE_SIZE:
+			max_size = max_t(size_t, max_size,
+					 be32_to_cpu(rsp->properties[i].value));
+			break;
+		}
+	}
+
+	return max_size;
+}
+
+/**
+ * tpmp_tpm2_get_random_cmd() - Build a TPM2_GetRandom
+ * @buf: Buffer to build the command in, at least TPMP_HEADER_SIZE + 2 bytes
+ * @count: Number of random bytes to request
+ *
+ * Return: Length of the command
+ */
+size_t tpmp_tpm2_get_random_cmd(u8 *buf, u16 count)
+{
+	struct tpmp_tpm2_get_random_cmd *cmd =
+		(struct tpmp_tpm2_get_random_cmd *)buf;
+
+	cmd->header.tag = cpu_to_be16(TPMP_ST_NO_SESSIONS);
+	cmd->header.length = cpu_to_be32(sizeof(*cmd));
+	cmd->header.ordinal = cpu_to_be32(TPMP_CC_GET_RANDOM);
+	cmd->bytes_requested = cpu_to_be16(count);
+
+	return sizeof(*cmd);
+}
+
+/**
+ * tpmp_tpm2_parse_random() - Extract the bytes of a TPM2_GetRandom response
+ * @buf: Response buffer
+ * @len: Length of the response
+ * @out: Buffer to copy the random bytes to
+ * @max: Size of @out
+ *
+ * Return: Number of bytes copied to @out, 0 if the command failed
+ */
+size_t tpmp_tpm2_parse_random(const u8 *buf, size_t len, u8 *out, size_t max)
+{
+	const struct tpmp_tpm2_get_random_rsp *rsp =
+		(const struct tpmp_tpm2_get_random_rsp *)buf;
+	size_t size;
+
+	if (len < sizeof(*rsp) ||
+	    be32_to_cpu(rsp->header.ordinal) != TPMP_RC_SUCCESS)
+		return 0;
+
+	size = min_t(size_t, be16_to_cpu(rsp->size), len - sizeof(*rsp));
+	size = min(size, max);
+	memcpy(out, rsp->buffer, size);
+
+	return size;
+}
+
+/**
+ * tpmp_tpm2_idempotent() - Check if a command can safely be sent twice
+ * @buf: Command buffer
+ * @len: Length of the command
+ *
+ * Commands with sessions never are, as each use rolls the session nonces.
+ *
+ * Return: true for read-only commands without sessions
+ */
+bool tpmp_tpm2_idempotent(const u8 *buf, size_t len)
+{
+	u16 tag;
+	u32 cc;
+
+	if (!tpmp_tpm_parse_header(buf, len, &tag, &cc) ||
+	    tag != TPMP_ST_NO_SESSIONS)
+		return false;
+
+	switch (cc) {
+	case TPMP_CC_GET_CAPABILITY:
+	case TPMP_CC_GET_RANDOM:
+	case TPMP_CC_GET_TEST_RESULT:
+	case TPMP_CC_READ_PUBLIC:
+	case TPMP_CC_NV_READ_PUBLIC:
+	case TPMP_CC_PCR_READ:
+	case TPMP_CC_READ_CLOCK:
+	case TPMP_CC_TEST_PARMS:
+	case TPMP_CC_ECC_PARAMETERS:
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * tpmp_tpm2_cacheable() - Check if the response to a command never changes
+ * @buf: Command buffer
+ * @len: Length of the command
+ *
+ * Only a few side-effect-free commands without sessions qualify:
+ * TPM2_GetCapability for algorithms, commands or fixed properties, and
+ * TPM2_ReadPublic of a persistent object. Their answers only change through
+ * the commands tpmp_tpm2_invalidates_cache() reports.
+ *
+ * Return: true if the response to the command can be cached
+ */
+bool tpmp_tpm2_cacheable(const u8 *buf, size_t len)
+{
+	const struct tpmp_tpm2_get_cap_cmd *cap =
+		(const struct tpmp_tpm2_get_cap_cmd *)buf;
+	const struct tpmp_tpm2_read_public_cmd *pub =
+		(const struct tpmp_tpm2_read_public_cmd *)buf;
+	u32 property;
+	u16 tag;
+	u32 cc;
+
+	if (!tpmp_tpm_parse_header(buf, len, &tag, &cc) ||
+	    tag != TPMP_ST_NO_SESSIONS ||
+	    be32_to_cpu(cap->header.length) != len)
+		return false;
+
+	switch (cc) {
+	case TPMP_CC_GET_CAPABILITY:
+		if (len != sizeof(*cap))
+			return false;
+
+		switch (be32_to_cpu(cap->capability)) {
+		case TPMP_CAP_ALGS:
+		case TPMP_CAP_COMMANDS:
+			return true;
+		case TPMP_CAP_TPM_PROPERTIES:
+			property = be32_to_cpu(cap->property);
+			return property >= TPMP_PT_FIXED &&
+			       (u64)property + be32_to_cpu(cap->property_count) <=
+			       TPMP_PT_VAR;
+		}
+		return false;
+	case TPMP_CC_READ_PUBLIC:
+		return len == sizeof(*pub) &&
+		       (be32_to_cpu(pub->handle) & TPMP_HR_MASK) ==
+		       TPMP_HR_PERSISTENT;
+	}
+
+	return false;
+}
+
+/**
+ * tpmp_tpm2_invalidates_cache() - Check if a command may change cached answers
+ * @buf: Command buffer
+ * @len: Length of the command
+ *
+ * Return: true for commands that can change persistent objects or
+ * hierarchies, or define or undefine NV indices
+ */
+bool tpmp_tpm2_invalidates_cache(const u8 *buf, size_t len)
+{
+	u16 tag;
+	u32 cc;
+
+	if (!tpmp_tpm_parse_header(buf, len, &tag, &cc))
+		return false;
+
+	switch (cc) {
+	case TPMP_CC_EVICT_CONTROL:
+	case TPMP_CC_CLEAR:
+	case TPMP_CC_CHANGE_EPS:
+	case TPMP_CC_CHANGE_PPS:
+	case TPMP_CC_HIERARCHY_CONTROL:
+	case TPMP_CC_NV_DEFINE_SPACE:
+	case TPMP_CC_NV_UNDEFINE_SPACE:
+	case TPMP_CC_NV_UNDEFINE_SPACE_SPECIAL:
+		return true;
+	}
+
+	return false;
+}
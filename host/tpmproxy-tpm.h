@@ -0,0 +1,166 @@
+/*
+ * TPM Proxy driver for Linux
+ *
+ *  Copyright (c) 2018-2019 Xaptum, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _TPMPROXY_TPM_H
+#define _TPMPROXY_TPM_H
+
+#include <linux/module.h>
+#include <linux/types.h>
+
+/* Command header common to TPM 1.2 and TPM 2.0, all fields big endian */
+struct tpmp_header {
+	__be16 tag;
+	__be32 length;
+	__be32 ordinal;		/* response code in responses */
+} __packed;
+
+#define TPMP_HEADER_SIZE	sizeof(struct tpmp_header)
+
+/* TPM 1.2 tags */
+#define TPMP_TAG_RQU_COMMAND		0x00C1
+#define TPMP_TAG_RQU_AUTH1_COMMAND	0x00C2
+#define TPMP_TAG_RQU_AUTH2_COMMAND	0x00C3
+
+#define TPMP_TAG_RSP_COMMAND		0x00C4
+#define TPMP_TAG_RSP_AUTH1_COMMAND	0x00C5
+#define TPMP_TAG_RSP_AUTH2_COMMAND	0x00C6
+
+/* TPM 2.0 tags */
+#define TPMP_ST_NO_SESSIONS		0x8001
+#define TPMP_ST_SESSIONS		0x8002
+
+/* TPM 1.2 ordinals */
+#define TPMP_ORD_OIAP			0x0000000A
+#define TPMP_ORD_OSAP			0x0000000B
+#define TPMP_ORD_TAKE_OWNERSHIP		0x0000000D
+#define TPMP_ORD_EXTEND			0x00000014
+#define TPMP_ORD_PCR_READ		0x00000015
+#define TPMP_ORD_QUOTE			0x00000016
+#define TPMP_ORD_SEAL			0x00000017
+#define TPMP_ORD_UNSEAL			0x00000018
+#define TPMP_ORD_CREATE_WRAP_KEY	0x0000001F
+#define TPMP_ORD_SIGN			0x0000003C
+#define TPMP_ORD_LOAD_KEY2		0x00000041
+#define TPMP_ORD_GET_RANDOM		0x00000046
+#define TPMP_ORD_SELF_TEST_FULL		0x00000050
+#define TPMP_ORD_CONTINUE_SELF_TEST	0x00000053
+#define TPMP_ORD_GET_CAPABILITY		0x00000065
+#define TPMP_ORD_CREATE_EK_PAIR		0x00000078
+#define TPMP_ORD_MAKE_IDENTITY		0x00000079
+#define TPMP_ORD_READ_PUBEK		0x0000007C
+#define TPMP_ORD_NV_WRITE_VALUE		0x000000CD
+#define TPMP_ORD_NV_READ_VALUE		0x000000CF
+
+/* TPM 2.0 command codes */
+#define TPMP_CC_FIRST			0x0000011F
+#define TPMP_CC_NV_UNDEFINE_SPACE_SPECIAL 0x0000011F
+#define TPMP_CC_EVICT_CONTROL		0x00000120
+#define TPMP_CC_HIERARCHY_CONTROL	0x00000121
+#define TPMP_CC_NV_UNDEFINE_SPACE	0x00000122
+#define TPMP_CC_CHANGE_EPS		0x00000124
+#define TPMP_CC_CHANGE_PPS		0x00000125
+#define TPMP_CC_CLEAR			0x00000126
+#define TPMP_CC_NV_DEFINE_SPACE		0x0000012A
+#define TPMP_CC_CREATE_PRIMARY		0x00000131
+#define TPMP_CC_NV_WRITE		0x00000137
+#define TPMP_CC_SEQUENCE_COMPLETE	0x0000013E
+#define TPMP_CC_INCREMENTAL_SELF_TEST	0x00000142
+#define TPMP_CC_SELF_TEST		0x00000143
+#define TPMP_CC_STARTUP			0x00000144
+#define TPMP_CC_SHUTDOWN		0x00000145
+#define TPMP_CC_STIR_RANDOM		0x00000146
+#define TPMP_CC_ACTIVATE_CREDENTIAL	0x00000147
+#define TPMP_CC_CERTIFY			0x00000148
+#define TPMP_CC_NV_READ			0x0000014E
+#define TPMP_CC_CREATE			0x00000153
+#define TPMP_CC_ECDH_ZGEN		0x00000154
+#define TPMP_CC_IMPORT			0x00000156
+#define TPMP_CC_LOAD			0x00000157
+#define TPMP_CC_QUOTE			0x00000158
+#define TPMP_CC_RSA_DECRYPT		0x00000159
+#define TPMP_CC_SIGN			0x0000015D
+#define TPMP_CC_UNSEAL			0x0000015E
+#define TPMP_CC_CONTEXT_LOAD		0x00000161
+#define TPMP_CC_CONTEXT_SAVE		0x00000162
+#define TPMP_CC_ECDH_KEYGEN		0x00000163
+#define TPMP_CC_FLUSH_CONTEXT		0x00000165
+#define TPMP_CC_LOAD_EXTERNAL		0x00000167
+#define TPMP_CC_MAKE_CREDENTIAL		0x00000168
+#define TPMP_CC_NV_READ_PUBLIC		0x00000169
+#define TPMP_CC_READ_PUBLIC		0x00000173
+#define TPMP_CC_RSA_ENCRYPT		0x00000174
+#define TPMP_CC_START_AUTH_SESSION	0x00000176
+#define TPMP_CC_VERIFY_SIGNATURE	0x00000177
+#define TPMP_CC_ECC_PARAMETERS		0x00000178
+#define TPMP_CC_GET_CAPABILITY		0x0000017A
+#define TPMP_CC_GET_RANDOM		0x0000017B
+#define TPMP_CC_GET_TEST_RESULT		0x0000017C
+#define TPMP_CC_HASH			0x0000017D
+#define TPMP_CC_PCR_READ		0x0000017E
+#define TPMP_CC_POLICY_PCR		0x0000017F
+#define TPMP_CC_READ_CLOCK		0x00000181
+#define TPMP_CC_PCR_EXTEND		0x00000182
+#define TPMP_CC_EVENT_SEQUENCE_COMPLETE	0x00000185
+#define TPMP_CC_HASH_SEQUENCE_START	0x00000186
+#define TPMP_CC_POLICY_GET_DIGEST	0x00000189
+#define TPMP_CC_TEST_PARMS		0x0000018A
+#define TPMP_CC_CREATE_LOADED		0x00000191
+#define TPMP_CC_LAST			0x00000193
+
+/* TPM 2.0 capabilities and properties */
+#define TPMP_CAP_ALGS			0x00000000
+#define TPMP_CAP_COMMANDS		0x00000002
+#define TPMP_CAP_TPM_PROPERTIES		0x00000006
+#define TPMP_PT_FIXED			0x00000100
+#define TPMP_PT_VAR			0x00000200
+#define TPMP_PT_MAX_COMMAND_SIZE	0x0000011E
+#define TPMP_PT_MAX_RESPONSE_SIZE	0x0000011F
+
+/* TPM 2.0 handle types */
+#define TPMP_HR_MASK			0xFF000000
+#define TPMP_HR_PERSISTENT		0x81000000
+
+#define TPMP_RC_SUCCESS			0x00000000
+
+/* Expected execution time classes of a command */
+enum tpmp_duration {
+	TPMP_DURATION_SHORT = 0,
+	TPMP_DURATION_MEDIUM,
+	TPMP_DURATION_LONG,
+	TPMP_DURATION_KEYGEN,
+	TPMP_DURATION_COUNT,
+};
+
+bool tpmp_tpm_parse_header(const u8 *buf, size_t len, u16 *tag, u32 *ordinal);
+enum tpmp_duration tpmp_tpm_duration(const u8 *buf, size_t len);
+unsigned int tpmp_tpm_timeout_ms(const u8 *buf, size_t len);
+bool tpmp_tpm_command_size_ok(const u8 *buf, size_t len);
+size_t tpmp_tpm_response_size(const u8 *buf, size_t len);
+u32 tpmp_tpm_response_code(const u8 *buf, size_t len);
+size_t tpmp_tpm2_max_size_cmd(u8 *buf);
+size_t tpmp_tpm2_parse_max_size(const u8 *buf, size_t len);
+size_t tpmp_tpm2_get_random_cmd(u8 *buf, u16 count);
+size_t tpmp_tpm2_parse_random(const u8 *buf, size_t len, u8 *out, size_t max);
+bool tpmp_tpm2_idempotent(const u8 *buf, size_t len);
+bool tpmp_tpm2_cacheable(const u8 *buf, size_t len);
+bool tpmp_tpm2_invalidates_cache(const u8 *buf, size_t len);
+
+#endif /* _TPMPROXY_TPM_H */
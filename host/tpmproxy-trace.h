@@ -0,0 +1,182 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ *  Copyright (c) 2018-2019 Xaptum, Inc.
+ *
+ * Tracepoints for the TPM proxy driver command lifecycle
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tpmproxy
+
+#if !defined(_TPMPROXY_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TPMPROXY_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "tpmproxy.h"
+
+DECLARE_EVENT_CLASS(tpmp_dev_class,
+	TP_PROTO(struct usb_tpmp *dev),
+	TP_ARGS(dev),
+
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+	),
+
+	TP_fast_assign(
+		__entry->busnum = dev->udev->bus->busnum;
+		__entry->devnum = dev->udev->devnum;
+	),
+
+	TP_printk("usb %d-%d", __entry->busnum, __entry->devnum)
+);
+
+DEFINE_EVENT(tpmp_dev_class, tpmp_open,
+	TP_PROTO(struct usb_tpmp *dev),
+	TP_ARGS(dev)
+);
+
+DEFINE_EVENT(tpmp_dev_class, tpmp_release,
+	TP_PROTO(struct usb_tpmp *dev),
+	TP_ARGS(dev)
+);
+
+DEFINE_EVENT(tpmp_dev_class, tpmp_disconnect,
+	TP_PROTO(struct usb_tpmp *dev),
+	TP_ARGS(dev)
+);
+
+DEFINE_EVENT(tpmp_dev_class, tpmp_pre_reset,
+	TP_PROTO(struct usb_tpmp *dev),
+	TP_ARGS(dev)
+);
+
+DEFINE_EVENT(tpmp_dev_class, tpmp_post_reset,
+	TP_PROTO(struct usb_tpmp *dev),
+	TP_ARGS(dev)
+);
+
+TRACE_EVENT(tpmp_submit,
+	TP_PROTO(struct usb_tpmp *dev, u32 ordinal, size_t len,
+		 unsigned int timeout_ms),
+	TP_ARGS(dev, ordinal, len, timeout_ms),
+
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(u32, ordinal)
+		__field(size_t, len)
+		__field(unsigned int, timeout_ms)
+	),
+
+	TP_fast_assign(
+		__entry->busnum = dev->udev->bus->busnum;
+		__entry->devnum = dev->udev->devnum;
+		__entry->ordinal = ordinal;
+		__entry->len = len;
+		__entry->timeout_ms = timeout_ms;
+	),
+
+	TP_printk("usb %d-%d cc=0x%08x len=%zu timeout=%ums",
+		  __entry->busnum, __entry->devnum, __entry->ordinal,
+		  __entry->len, __entry->timeout_ms)
+);
+
+TRACE_EVENT(tpmp_out_complete,
+	TP_PROTO(struct usb_tpmp *dev, int status, u32 len),
+	TP_ARGS(dev, status, len),
+
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(int, status)
+		__field(u32, len)
+	),
+
+	TP_fast_assign(
+		__entry->busnum = dev->udev->bus->busnum;
+		__entry->devnum = dev->udev->devnum;
+		__entry->status = status;
+		__entry->len = len;
+	),
+
+	TP_printk("usb %d-%d status=%d len=%u",
+		  __entry->busnum, __entry->devnum, __entry->status,
+		  __entry->len)
+);
+
+TRACE_EVENT(tpmp_in_complete,
+	TP_PROTO(struct usb_tpmp *dev, int status, u32 rc, size_t len),
+	TP_ARGS(dev, status, rc, len),
+
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(int, status)
+		__field(u32, rc)
+		__field(size_t, len)
+	),
+
+	TP_fast_assign(
+		__entry->busnum = dev->udev->bus->busnum;
+		__entry->devnum = dev->udev->devnum;
+		__entry->status = status;
+		__entry->rc = rc;
+		__entry->len = len;
+	),
+
+	TP_printk("usb %d-%d status=%d rc=0x%08x len=%zu",
+		  __entry->busnum, __entry->devnum, __entry->status,
+		  __entry->rc, __entry->len)
+);
+
+TRACE_EVENT(tpmp_read,
+	TP_PROTO(struct usb_tpmp *dev, ssize_t len, loff_t pos),
+	TP_ARGS(dev, len, pos),
+
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(ssize_t, len)
+		__field(loff_t, pos)
+	),
+
+	TP_fast_assign(
+		__entry->busnum = dev->udev->bus->busnum;
+		__entry->devnum = dev->udev->devnum;
+		__entry->len = len;
+		__entry->pos = pos;
+	),
+
+	TP_printk("usb %d-%d len=%zd pos=%lld",
+		  __entry->busnum, __entry->devnum, __entry->len, __entry->pos)
+);
+
+TRACE_EVENT(tpmp_timeout,
+	TP_PROTO(struct usb_tpmp *dev, u32 ordinal),
+	TP_ARGS(dev, ordinal),
+
+	TP_STRUCT__entry(
+		__field(int, busnum)
+		__field(int, devnum)
+		__field(u32, ordinal)
+	),
+
+	TP_fast_assign(
+		__entry->busnum = dev->udev->bus->busnum;
+		__entry->devnum = dev->udev->devnum;
+		__entry->ordinal = ordinal;
+	),
+
+	TP_printk("usb %d-%d cc=0x%08x",
+		  __entry->busnum, __entry->devnum, __entry->ordinal)
+);
+
+#endif /* _TPMPROXY_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE tpmproxy-trace
+#include <trace/define_trace.h>
@@ -0,0 +1,176 @@
+/*
+ * TPM Proxy driver for Linux
+ *
+ *  Copyright (c) 2018-2019 Xaptum, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
+
+#include "tpmproxy.h"
+#include "tpmproxy-ioctl.h"
+
+#ifdef TPMP_HAVE_URING_CMD
+
+/**
+ * struct tpmp_uring_cmd - A command submitted through io_uring
+ * @cmd: Command queued for the worker, @cmd.buf points to @data
+ * @ioucmd: io_uring request to complete
+ * @response: Userspace buffer for the response
+ * @response_size: Size of @response
+ * @data: Command, then response
+ */
+struct tpmp_uring_cmd {
+	struct tpmp_cmd		cmd;
+	struct io_uring_cmd	*ioucmd;
+	void __user		*response;
+	u32			response_size;
+	u8			data[];
+};
+
+static inline struct tpmp_uring_cmd **tpmp_uring_pdu(struct io_uring_cmd *ioucmd)
+{
+	BUILD_BUG_ON(sizeof(struct tpmp_uring_cmd *) > sizeof(ioucmd->pdu));
+	return (struct tpmp_uring_cmd **)ioucmd->pdu;
+}
+
+/* Runs in the submitter's task, so the response can go to its memory */
+static void __tpmp_uring_cmd_done(struct io_uring_cmd *ioucmd,
+				  unsigned int issue_flags)
+{
+	struct tpmp_uring_cmd *ucmd = *tpmp_uring_pdu(ioucmd);
+	int retval = ucmd->cmd.result;
+
+	if (retval > (int)ucmd->response_size)
+		retval = -ENOSPC;
+	else if (retval > 0 &&
+		 copy_to_user(ucmd->response, ucmd->data, retval))
+		retval = -EFAULT;
+
+	kfree(ucmd);
+	io_uring_cmd_done(ioucmd, retval, 0, issue_flags);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,15,0)
+static void tpmp_uring_cmd_done(struct io_uring_cmd *ioucmd,
+				io_tw_token_t tw)
+{
+	__tpmp_uring_cmd_done(ioucmd, IO_URING_CMD_TASK_WORK_ISSUE_FLAGS);
+}
+#else
+static void tpmp_uring_cmd_done(struct io_uring_cmd *ioucmd,
+				unsigned int issue_flags)
+{
+	__tpmp_uring_cmd_done(ioucmd, issue_flags);
+}
+#endif
+
+/* Called from the worker */
+static void tpmp_uring_complete(struct tpmp_cmd *cmd)
+{
+	struct tpmp_uring_cmd *ucmd = container_of(cmd, struct tpmp_uring_cmd,
+						   cmd);
+
+	io_uring_cmd_complete_in_task(ucmd->ioucmd, tpmp_uring_cmd_done);
+}
+
+/**
+ * tpmp_uring_cmd() - Queue a command submitted as an io_uring SQE
+ * @ioucmd: io_uring request
+ * @issue_flags: IO_URING_F_* flags
+ *
+ * The SQE must be an IORING_OP_URING_CMD with cmd_op TPMP_IOC_TRANSACT,
+ * on a ring set up with IORING_SETUP_SQE128, carrying a
+ * struct tpmp_transaction in its command area. The command is queued like a
+ * write() and completes with a CQE whose res is the length of the response,
+ * copied to transaction.response, or a negative errno. Any number of
+ * commands can be outstanding per file, they are sent in submission order.
+ *
+ * Return:
+ 	-EIOCBQUEUED once the command is queued
+	-ENOTTY on an unknown cmd_op
+	-EINVAL without IORING_SETUP_SQE128, on a nonzero reserved field or a
+	 header not announcing command_size bytes
+	-E2BIG on a command exceeding max write size
+	-ENODEV if the device was disconnected
+	-ENOMEM on allocation failure
+	-EFAULT on memory copy error
+ */
+int tpmp_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	struct tpmp_client *client = ioucmd->file->private_data;
+	struct usb_tpmp *dev = client->dev;
+	struct tpmp_transaction xfer;
+	struct tpmp_uring_cmd *ucmd;
+
+	if (ioucmd->cmd_op != TPMP_IOC_TRANSACT)
+		return -ENOTTY;
+
+	if (!(issue_flags & IO_URING_F_SQE128))
+		return -EINVAL;
+
+	memcpy(&xfer, io_uring_sqe_cmd(ioucmd->sqe), sizeof(xfer));
+
+	if (xfer.reserved)
+		return -EINVAL;
+
+	if (xfer.command_size > dev->bufsiz)
+		return -E2BIG;
+
+	if (!READ_ONCE(dev->interface))
+		return -ENODEV;
+
+	ucmd = kmalloc(struct_size(ucmd, data, dev->bufsiz), GFP_KERNEL);
+	if (!ucmd)
+		return -ENOMEM;
+
+	if (copy_from_user(ucmd->data, u64_to_user_ptr(xfer.command),
+			   xfer.command_size)) {
+		kfree(ucmd);
+		return -EFAULT;
+	}
+
+	if (!tpmp_tpm_command_size_ok(ucmd->data, xfer.command_size)) {
+		kfree(ucmd);
+		return -EINVAL;
+	}
+
+	ucmd->ioucmd = ioucmd;
+	ucmd->response = u64_to_user_ptr(xfer.response);
+	ucmd->response_size = xfer.response_size;
+	ucmd->cmd.client = client;
+	ucmd->cmd.buf = ucmd->data;
+	ucmd->cmd.len = xfer.command_size;
+	ucmd->cmd.bufsiz = dev->bufsiz;
+	ucmd->cmd.dma = false;
+	ucmd->cmd.complete = tpmp_uring_complete;
+	*tpmp_uring_pdu(ioucmd) = ucmd;
+
+	tpmp_queue_cmd(dev, &ucmd->cmd);
+	return -EIOCBQUEUED;
+}
+
+#endif /* TPMP_HAVE_URING_CMD */
@@ -0,0 +1,259 @@
+/*
+ * TPM Proxy driver for Linux
+ *
+ *  Copyright (c) 2018-2019 Xaptum, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _TPMPROXY_H
+#define _TPMPROXY_H
+
+#include <linux/kref.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/usb.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "tpmproxy-backports.h"
+#include "tpmproxy-tpm.h"
+
+#define TPM_BUFSIZE 4096
+#define TPMP_MAX_BUFSIZE 65536
+
+struct tpm_chip;
+struct tpmp_client;
+struct tpmp_ring;
+struct tpmp_rng;
+struct tpmp_ring_params;
+struct vm_area_struct;
+struct dentry;
+
+/* Latency histogram: log2 usec buckets per TPM 2.0 command code and phase */
+#define TPMP_HIST_BUCKETS	24
+#define TPMP_HIST_SLOTS		(TPMP_CC_LAST - TPMP_CC_FIRST + 2)	/* last slot: other commands */
+
+enum tpmp_hist_phase {
+	TPMP_HIST_OUT = 0,	/* command transfer */
+	TPMP_HIST_IN,		/* wait for and transfer of the response */
+	TPMP_HIST_TOTAL,	/* round trip */
+	TPMP_HIST_PHASES,
+};
+
+struct tpmp_stats {
+	spinlock_t		lock;			/* lock for the counters and histograms */
+	u64			commands;		/* commands submitted */
+	u64			bytes_out;		/* command bytes submitted */
+	u64			bytes_in;		/* response bytes received */
+	u64			timeouts;		/* commands that timed out */
+	u64			busy_errors;		/* writes refused with -EBUSY */
+	u64			pipe_errors;		/* transfers that stalled with -EPIPE */
+	u64			resets;			/* USB resets of the device */
+	u64			cache_hits;		/* commands answered from the cache */
+	u64			cache_misses;		/* cacheable commands sent to the device */
+	u64			stale_responses;	/* late or garbled transfers dropped with framing */
+	u64			cancels;		/* commands canceled on the card TPM */
+	u32			(*hist)[TPMP_HIST_PHASES][TPMP_HIST_BUCKETS];
+	ktime_t			submitted;		/* when the command in flight was submitted */
+	ktime_t			out_done;		/* when the command in flight was sent */
+	struct dentry		*debugfs;		/* per device debugfs directory */
+};
+
+/* Idempotent commands are short, longer ones are not kept for replay */
+#define TPMP_REPLAY_MAX		64
+
+/* Commands whose responses are cached are short, and so is the cache */
+#define TPMP_CACHE_KEY_MAX	32
+#define TPMP_CACHE_ENTRIES	32
+
+struct tpmp_cache {
+	spinlock_t		lock;			/* lock for the entries */
+	struct list_head	entries;		/* cached responses, most recently used first */
+	unsigned int		count;			/* number of entries */
+};
+
+/* Structure to hold all of our device specific stuff */
+struct usb_tpmp {
+	struct usb_device	*udev;			/* the usb device for this device */
+	struct usb_interface 	*interface;		/* the interface for this device */
+	__u8			bulk_in_endpointAddr;	/* the address of the bulk in endpoint */
+	__u8			bulk_out_endpointAddr;	/* the address of the bulk out endpoint */
+	struct kref		kref;			/* Reference counter */
+	struct mutex		usb_mutex;		/* synchronize I/O with disconnect */
+	struct mutex		buffer_mutex;		/* mutex for buffer access */
+	struct mutex		ctrl_mutex;		/* synchronize control requests with disconnect */
+	u8 			*data_buffer;		/* DMA coherent buffer holding the command, then its response */
+	dma_addr_t		data_dma;		/* DMA address of data_buffer */
+	u8			*io_buffer;		/* buffer of the command in flight, data_buffer or a ring slot */
+	size_t			io_hdr;			/* size of the frame header in front of io_buffer, 0 without framing */
+	bool			framing;		/* transfers are framed, see tpmproxy-proto.h */
+	bool			batching;		/* the gadget takes batch frames */
+	u32			seq;			/* sequence number of the last framed command */
+	u16			rsp_type;		/* frame type of the response to the transfer in flight */
+	u16			gadget_version;		/* vendor request protocol version, 0 without them */
+	u16			gadget_features;	/* TPMP_FEAT_* flags the gadget reported */
+	u32			gadget_max_cmd;		/* longest command the gadget takes, 0 if unknown */
+	u8			tpm_family;		/* TPMP_FAMILY_* family of the card TPM */
+	size_t			bufsiz;			/* size of data_buffer and of the client buffers */
+	size_t			rsp_received;		/* bytes of the response received so far */
+	size_t			rsp_expected;		/* response size announced by its header, 0 until known */
+	u32			ordinal;		/* command code of the command in flight, 0 if unknown */
+	struct urb		*bulk_out_urb;		/* the urb to send the command */
+	struct urb		*bulk_in_urb;		/* the urb to read the response, submitted once the command is out */
+	atomic_t 		data_pending;		/* Counter to the number of bytes waiting to be read into userspace */
+	spinlock_t		queue_lock;		/* lock for ready_clients and the client command lists */
+	struct list_head	ready_clients;		/* clients with queued commands, served round-robin */
+	struct work_struct	tx_work;		/* services the queued commands */
+	struct usb_anchor	submitted;		/* in case we need to retract our submissions */
+	spinlock_t		err_lock;		/* lock for errors, ongoing_io, timed_out, cancel_io, io_cmd and resetting */
+	int			errors;			/* the last command tanked */
+	bool			ongoing_io;		/* a command is in flight */
+	bool			timed_out;		/* the command in flight was unlinked on timeout */
+	bool			cancel_io;		/* the client of the command in flight gave up on it */
+	struct tpmp_cmd		*io_cmd;		/* command the worker is sending, NULL if none */
+	unsigned long		io_deadline;		/* jiffies at which the command in flight times out */
+	bool			resetting;		/* between pre_reset and post_reset */
+	wait_queue_head_t	reset_wait;		/* to wait for a reset to finish */
+	u8			replay_cmd[TPMP_REPLAY_MAX]; /* copy of the command in flight if idempotent */
+	size_t			replay_len;		/* length of replay_cmd, 0 if not replayable */
+	ktime_t			recovery_start;		/* when the reset or stall recovery started */
+	unsigned int		recovery_ms;		/* duration of the last recovery */
+	ktime_t			pm_last_cmd;		/* when the last command was sent */
+	u64			pm_gap_us;		/* moving average of the time between commands */
+	int			pm_delay_ms;		/* autosuspend delay last set */
+	struct delayed_work	timeout_work;		/* unlinks the command in flight on timeout */
+	wait_queue_head_t	bulk_in_wait;		/* to wait for the command in flight */
+	struct tpm_chip		*chip;			/* TPM core chip, if registered in chip mode */
+	unsigned int		timeout_ms;		/* fixed command timeout overriding the ordinal table, 0 if unset */
+	struct tpmp_stats	stats;			/* counters and latency histograms */
+	struct tpmp_cache	cache;			/* responses to immutable queries */
+	struct tpmp_rng		*rng;			/* hwrng, in char device mode */
+};
+
+/**
+ * struct tpmp_cmd - A command queued for the card TPM
+ * @node: Entry in the owning client's command list
+ * @client: Client the command is queued for
+ * @buf: Command buffer, overwritten with the response
+ * @len: Length of the command
+ * @bufsiz: Size of @buf
+ * @dma: @buf is DMA-able and is transferred from and into directly
+ * @result: Length of the response if >=0, negative errno otherwise
+ * @complete: Called from the worker once @result is set
+ */
+struct tpmp_cmd {
+	struct list_head	node;
+	struct tpmp_client	*client;
+	u8			*buf;
+	size_t			len;
+	size_t			bufsiz;
+	bool			dma;
+	int			result;
+	void			(*complete)(struct tpmp_cmd *cmd);
+};
+
+/* Per open file state */
+struct tpmp_client {
+	struct usb_tpmp		*dev;			/* the device this file was opened on */
+	struct list_head	node;			/* entry in dev->ready_clients */
+	struct list_head	cmds;			/* commands queued for this client */
+	struct mutex		buffer_mutex;		/* mutex for buffer access */
+	u8			*data_buffer;		/* Buffer holding the command, then its response */
+	size_t			response_length;	/* bytes waiting to be read into userspace */
+	size_t			response_off;		/* bytes of the response already read */
+	int			errors;			/* the last command tanked */
+	bool			cmd_queued;		/* the command is queued or in flight */
+	wait_queue_head_t	wait;			/* to wait for the queued command */
+	struct tpmp_cmd		cmd;			/* the command submitted through write() */
+	struct tpmp_ring	*ring;			/* command ring shared through mmap() */
+};
+
+void tpmp_queue_cmd(struct usb_tpmp *dev, struct tpmp_cmd *cmd);
+int tpmp_submit(struct usb_tpmp *dev, size_t len);
+int tpmp_wait(struct usb_tpmp *dev);
+int tpmp_transmit(struct usb_tpmp *dev, size_t len);
+int tpmp_transmit_buffer(struct usb_tpmp *dev, u8 *buf, size_t len);
+int tpmp_vendor_request(struct usb_tpmp *dev, u8 request, void *data, u16 size);
+
+long tpmp_ring_setup(struct tpmp_client *client,
+		     struct tpmp_ring_params __user *argp);
+long tpmp_ring_enter(struct tpmp_client *client);
+int tpmp_ring_mmap(struct file *file, struct vm_area_struct *vma);
+__poll_t tpmp_ring_poll(struct tpmp_client *client);
+bool tpmp_ring_idle(struct tpmp_client *client);
+void tpmp_ring_free(struct tpmp_client *client);
+
+void tpmp_cache_init(struct usb_tpmp *dev);
+void tpmp_cache_clear(struct usb_tpmp *dev);
+bool tpmp_cache_enabled(void);
+size_t tpmp_cache_key(const u8 *buf, size_t len, u8 *key);
+int tpmp_cache_lookup(struct usb_tpmp *dev, const u8 *key, size_t key_len,
+		      u8 *buf, size_t bufsiz);
+void tpmp_cache_insert(struct usb_tpmp *dev, const u8 *key, size_t key_len,
+		       const u8 *rsp, size_t rsp_len);
+void tpmp_cache_snoop(struct usb_tpmp *dev, const u8 *buf, size_t len);
+
+int tpmp_stats_init(struct usb_tpmp *dev);
+void tpmp_stats_free(struct usb_tpmp *dev);
+int tpmp_stats_register(struct usb_tpmp *dev);
+void tpmp_stats_unregister(struct usb_tpmp *dev);
+void tpmp_stats_submit(struct usb_tpmp *dev, size_t len);
+void tpmp_stats_out_done(struct usb_tpmp *dev);
+void tpmp_stats_complete(struct usb_tpmp *dev, int status, size_t received);
+void tpmp_stats_count_busy(struct usb_tpmp *dev);
+void tpmp_stats_count_reset(struct usb_tpmp *dev);
+void tpmp_stats_count_cache(struct usb_tpmp *dev, bool hit);
+void tpmp_stats_count_stale(struct usb_tpmp *dev);
+void tpmp_stats_count_cancel(struct usb_tpmp *dev);
+void tpmp_debugfs_init(void);
+void tpmp_debugfs_exit(void);
+
+#ifdef TPMP_HAVE_TPM_CHIP
+int tpmp_chip_register(struct usb_tpmp *dev);
+void tpmp_chip_unregister(struct usb_tpmp *dev);
+#else
+static inline int tpmp_chip_register(struct usb_tpmp *dev)
+{
+	return -ENODEV;
+}
+
+static inline void tpmp_chip_unregister(struct usb_tpmp *dev)
+{
+}
+#endif
+
+#ifdef TPMP_HAVE_HWRNG
+int tpmp_rng_register(struct usb_tpmp *dev);
+void tpmp_rng_unregister(struct usb_tpmp *dev);
+#else
+static inline int tpmp_rng_register(struct usb_tpmp *dev)
+{
+	return 0;
+}
+
+static inline void tpmp_rng_unregister(struct usb_tpmp *dev)
+{
+}
+#endif
+
+#ifdef TPMP_HAVE_URING_CMD
+struct io_uring_cmd;
+int tpmp_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags);
+#endif
+
+#endif /* _TPMPROXY_H */